@@ -5,15 +5,27 @@
 #include <benchmark/benchmark.h>
 #include <algorithm>
 #include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "bloomap.h"
 #include "bloomapfamily.h"
+#include "bitkernels.h"
+#include "bloomapexpr.h"
+#include "staticbloomap.h"
+#include "countingbloomap.h"
+#include "scalablebloomap.h"
+#include "bloomapkeys.h"
 
 using namespace std;
 
 #define CLOBBER_MEMORY asm volatile("" : : : "memory")
 
-static void BM_bloomap_insert( benchmark::State& state ) {
-	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y());
+static void H_bloomap_insert( benchmark::State& state, BloomapFamily::Layout layout ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y(), layout);
 	Bloomap *map = f->newMap();
 	uint32_t n = 0;
 	uint32_t range = state.range_x();
@@ -25,6 +37,532 @@ static void BM_bloomap_insert( benchmark::State& state ) {
 		map->clear();
 		state.ResumeTiming();
 	}
+	state.SetItemsProcessed(state.iterations()*range);
+	delete map;
+	delete f;
+}
+
+static void BM_bloomap_insert_batch( benchmark::State& state ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y());
+	Bloomap *map = f->newMap();
+	uint32_t n = 0;
+	uint32_t range = state.range_x();
+	vector<uint32_t> batch(range);
+	while (state.KeepRunning()) {
+		state.PauseTiming();
+		for (uint32_t i = 0; i < range; i++)
+			batch[i] = n++;
+		state.ResumeTiming();
+		benchmark::DoNotOptimize(map->addBatch(&batch[0], range));
+		state.PauseTiming();
+		map->clear();
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(state.iterations()*range);
+	delete map;
+	delete f;
+}
+
+/* Concurrent ingestion of 2^22 random elements (out of 2^26) into one map,
+ * split between state.range_x() threads. */
+struct H_ingest_slice {
+	Bloomap* map;
+	const uint32_t* ele;
+	size_t n;
+};
+
+static void* H_ingest_thread( void* arg ) {
+	H_ingest_slice* s = (H_ingest_slice*) arg;
+	s->map->addBatch(s->ele, s->n);
+	return NULL;
+}
+
+static void BM_bloomap_concurrent_insert( benchmark::State& state ) {
+	const uint32_t range = 1 << 22;
+	unsigned nthreads = state.range_x();
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(range, 0.01);
+	Bloomap *map = f->newMap();
+	f->setConcurrent(true);
+	vector<uint32_t> ele(range);
+	for (uint32_t i = 0; i < range; i++)
+		ele[i] = rand() % (range << 4);
+	/* Allocate the family index up front, only the ingestion is timed */
+	map->addBatch(&ele[0], range);
+	map->clear();
+	vector<pthread_t> threads(nthreads);
+	vector<H_ingest_slice> slices(nthreads);
+	for (unsigned t = 0; t < nthreads; t++) {
+		slices[t].map = map;
+		slices[t].ele = &ele[t*(range/nthreads)];
+		slices[t].n = (t == nthreads - 1) ? range - t*(range/nthreads) : range/nthreads;
+	}
+	while (state.KeepRunning()) {
+		for (unsigned t = 0; t < nthreads; t++)
+			pthread_create(&threads[t], NULL, H_ingest_thread, &slices[t]);
+		for (unsigned t = 0; t < nthreads; t++)
+			pthread_join(threads[t], NULL);
+		state.PauseTiming();
+		map->clear();
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(state.iterations()*range);
+	delete map;
+	delete f;
+}
+
+static void ThreadArgs( benchmark::internal::Benchmark* b ) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long t = 1; t < ncpu; t *= 2)
+		b->Arg(t);
+	b->Arg(ncpu > 0 ? ncpu : 1);
+}
+
+/* Random lookups, half of them hits. The larger sizes make maps well past
+ * the size of a typical LLC (2^26 elements at 1% is about 80MB). */
+static void H_prepare_lookup( Bloomap* map, vector<uint32_t>& keys, uint32_t range ) {
+	vector<uint32_t> ins(range);
+	for (uint32_t i = 0; i < range; i++)
+		ins[i] = rand();
+	map->addBatch(&ins[0], range);
+	keys.resize(1 << 16);
+	for (uint32_t i = 0; i < keys.size(); i++)
+		keys[i] = (i % 2) ? ins[rand() % range] : rand();
+}
+
+static void H_bloomap_lookup( benchmark::State& state, BloomapFamily::Layout layout ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y(), layout);
+	Bloomap *map = f->newMap();
+	vector<uint32_t> keys;
+	H_prepare_lookup(map, keys, state.range_x());
+	while (state.KeepRunning()) {
+		for (uint32_t i = 0; i < keys.size(); i++)
+			benchmark::DoNotOptimize(map->contains(keys[i]));
+	}
+	state.SetItemsProcessed(state.iterations()*keys.size());
+	delete map;
+	delete f;
+}
+
+static void H_bloomap_lookup_batch( benchmark::State& state, BloomapFamily::Layout layout ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y(), layout);
+	Bloomap *map = f->newMap();
+	vector<uint32_t> keys;
+	H_prepare_lookup(map, keys, state.range_x());
+	vector<uint64_t> result(keys.size() / 64);
+	while (state.KeepRunning()) {
+		map->containsBatch(&keys[0], keys.size(), &result[0]);
+		benchmark::DoNotOptimize(result.data());
+	}
+	state.SetItemsProcessed(state.iterations()*keys.size());
+	delete map;
+	delete f;
+}
+
+/* Measured FP rate (reported as a counter), and the time of lookups which
+ * are mostly misses. Inserted elements are even, queried ones odd. */
+static void H_bloomap_fp_rate( benchmark::State& state, BloomapFamily::Layout layout ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y(), layout);
+	Bloomap *map = f->newMap();
+	for (uint32_t i = 0; i < state.range_x(); i++)
+		map->add(2*(uint32_t) rand());
+	vector<uint32_t> keys(1 << 16);
+	for (uint32_t i = 0; i < keys.size(); i++)
+		keys[i] = 2*(uint32_t) rand() + 1;
+	uint64_t positives = 0;
+	while (state.KeepRunning()) {
+		positives = 0;
+		for (uint32_t i = 0; i < keys.size(); i++)
+			positives += map->contains(keys[i]);
+	}
+	state.counters["fp_rate"] = 1.0*positives / keys.size();
+	state.SetItemsProcessed(state.iterations()*keys.size());
+	delete map;
+	delete f;
+}
+
+static void BM_bloomap_insert( benchmark::State& state ) { H_bloomap_insert(state, BloomapFamily::LAYOUT_COMPARTMENTS); }
+static void BM_bloomap_insert_blocked( benchmark::State& state ) { H_bloomap_insert(state, BloomapFamily::LAYOUT_BLOCKED); }
+static void BM_bloomap_lookup( benchmark::State& state ) { H_bloomap_lookup(state, BloomapFamily::LAYOUT_COMPARTMENTS); }
+static void BM_bloomap_lookup_blocked( benchmark::State& state ) { H_bloomap_lookup(state, BloomapFamily::LAYOUT_BLOCKED); }
+static void BM_bloomap_lookup_batch( benchmark::State& state ) { H_bloomap_lookup_batch(state, BloomapFamily::LAYOUT_COMPARTMENTS); }
+static void BM_bloomap_lookup_batch_blocked( benchmark::State& state ) { H_bloomap_lookup_batch(state, BloomapFamily::LAYOUT_BLOCKED); }
+/* Enumeration of a map of state.range_x() elements, with the dense and the
+ * sparse family index, by BLOOMAP_FOR_EACH or enumerate() in bulk. The IDs
+ * are random 32-bit numbers (range_y == 0), or sequential (range_y == 1). The
+ * index size is reported as a counter. */
+static void H_bloomap_enumerate( benchmark::State& state, BloomapFamily::IndexMode index_mode, bool bulk ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 0.01,
+			BloomapFamily::LAYOUT_COMPARTMENTS, BLOOMAP_DEFAULT_SEED, index_mode);
+	Bloomap *map = f->newMap();
+	for (uint32_t i = 0; i < state.range_x(); i++)
+		map->add(state.range_y() ? 1000 + i : ((uint32_t) rand() << 16) ^ rand());
+	f->optimizeIndex();
+	unsigned found = 0;
+	vector<uint32_t> buf(1 << 12);
+	while (state.KeepRunning()) {
+		found = 0;
+		if (bulk) {
+			uint64_t cursor = 0;
+			while (cursor != BLOOMAP_ENUM_END)
+				found += map->enumerate(&buf[0], buf.size(), cursor);
+		} else {
+			unsigned e;
+			BLOOMAP_FOR_EACH(e, map) {
+				found++;
+			}
+		}
+		benchmark::DoNotOptimize(found);
+	}
+	state.counters["index_bytes"] = f->indexMemory();
+	state.SetItemsProcessed(state.iterations()*found);
+	delete map;
+	delete f;
+}
+
+static void BM_bloomap_for_each_dense( benchmark::State& state ) { H_bloomap_enumerate(state, BloomapFamily::INDEX_DENSE, false); }
+static void BM_bloomap_for_each_sparse( benchmark::State& state ) { H_bloomap_enumerate(state, BloomapFamily::INDEX_SPARSE, false); }
+static void BM_bloomap_enumerate_dense( benchmark::State& state ) { H_bloomap_enumerate(state, BloomapFamily::INDEX_DENSE, true); }
+static void BM_bloomap_enumerate_sparse( benchmark::State& state ) { H_bloomap_enumerate(state, BloomapFamily::INDEX_SPARSE, true); }
+
+static void EnumerateArgs( benchmark::internal::Benchmark* b ) {
+	b->ArgPair(1 << 10, 0);
+	b->ArgPair(1 << 14, 0);
+	b->ArgPair(1 << 18, 0);
+	b->ArgPair(1 << 14, 1);
+	b->ArgPair(1 << 18, 1);
+}
+
+/* count() and purge() of a map of 2^20 random elements, using state.range_x()
+ * threads. */
+static void H_bloomap_parallel( benchmark::State& state, bool purge ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(1 << 20, 0.01);
+	Bloomap *map = f->newMap();
+	for (uint32_t i = 0; i < (1 << 20); i++)
+		map->add(((uint32_t) rand() << 16) ^ rand());
+	f->setThreads(state.range_x());
+	size_t found = map->count();
+	while (state.KeepRunning()) {
+		if (purge)
+			map->purge();
+		else
+			benchmark::DoNotOptimize(map->count());
+	}
+	state.SetItemsProcessed(state.iterations()*found);
+	delete map;
+	delete f;
+}
+
+static void BM_bloomap_parallel_count( benchmark::State& state ) { H_bloomap_parallel(state, false); }
+static void BM_bloomap_parallel_purge( benchmark::State& state ) { H_bloomap_parallel(state, true); }
+
+/* Purging state.range_x() maps of 2^16 random elements each, one by one or
+ * in a single batch. */
+static void H_bloomap_purge_maps( benchmark::State& state, bool batch ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(1 << 16, 0.01);
+	vector<Bloomap*> maps;
+	for (long m = 0; m < state.range_x(); m++) {
+		maps.push_back(f->newMap());
+		for (uint32_t i = 0; i < (1 << 16); i++)
+			maps.back()->add(((uint32_t) rand() << 16) ^ rand());
+	}
+	while (state.KeepRunning()) {
+		if (batch) {
+			Bloomap::purge(&maps[0], maps.size());
+		} else {
+			for (unsigned m = 0; m < maps.size(); m++)
+				maps[m]->purge();
+		}
+	}
+	state.SetItemsProcessed(state.iterations()*maps.size()*(1 << 16));
+	for (unsigned m = 0; m < maps.size(); m++)
+		delete maps[m];
+	delete f;
+}
+
+static void BM_bloomap_purge_each( benchmark::State& state ) { H_bloomap_purge_maps(state, false); }
+static void BM_bloomap_purge_batch( benchmark::State& state ) { H_bloomap_purge_maps(state, true); }
+
+/* prune() of a family of 2 * state.range_x() maps of 2^16 random elements,
+ * half of which were deleted. Only the first pass removes anything, the
+ * rest is the cost of the sweep. */
+static void BM_family_prune( benchmark::State& state ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(1 << 16, 0.01);
+	vector<Bloomap*> maps;
+	for (long m = 0; m < 2*state.range_x(); m++) {
+		Bloomap* map = f->newMap();
+		for (uint32_t i = 0; i < (1 << 16); i++)
+			map->add(((uint32_t) rand() << 16) ^ rand());
+		if (m % 2) delete map;
+		else maps.push_back(map);
+	}
+	size_t removed = 0;
+	while (state.KeepRunning())
+		removed += f->prune();
+	state.counters["removed"] = removed;
+	state.SetItemsProcessed(state.iterations()*maps.size()*(1 << 16));
+	for (unsigned m = 0; m < maps.size(); m++)
+		delete maps[m];
+	delete f;
+}
+
+/* load() of a saved family of state.range_x() maps of 2^16 random elements
+ * each, followed by a count() of the first map, which faults in the pages it
+ * needs. Against that, building the same family from scratch. */
+static void BM_family_load( benchmark::State& state ) {
+	char path[] = "/tmp/bloomap-bench-XXXXXX";
+	int fd = mkstemp(path);
+	close(fd);
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(1 << 16, 0.01);
+	for (long m = 0; m < state.range_x(); m++) {
+		Bloomap* map = f->newMap();
+		for (uint32_t i = 0; i < (1 << 16); i++)
+			map->add(((uint32_t) rand() << 16) ^ rand());
+	}
+	f->save(path);
+	while (f->nmaps())
+		delete f->map(0);
+	delete f;
+	while (state.KeepRunning()) {
+		BloomapFamily *g = BloomapFamily::load(path);
+		benchmark::DoNotOptimize(g->map(0)->count());
+		while (g->nmaps())
+			delete g->map(0);
+		delete g;
+	}
+	unlink(path);
+}
+
+static void BM_family_build( benchmark::State& state ) {
+	while (state.KeepRunning()) {
+		BloomapFamily *f = BloomapFamily::forElementsAndProb(1 << 16, 0.01);
+		for (long m = 0; m < state.range_x(); m++) {
+			Bloomap* map = f->newMap();
+			for (uint32_t i = 0; i < (1 << 16); i++)
+				map->add(((uint32_t) rand() << 16) ^ rand());
+		}
+		benchmark::DoNotOptimize(f->map(0)->count());
+		while (f->nmaps())
+			delete f->map(0);
+		delete f;
+	}
+}
+
+/* A family of 100 maps of 2^14 elements each, 1% of which (one map) gets
+ * 2^10 elements already known to the family between the saves. Either the
+ * whole family is saved, or only the changed blocks are checkpointed. */
+static void H_family_update(benchmark::State& state, bool incremental) {
+	char path[] = "/tmp/bloomap-bench-XXXXXX";
+	int fd = mkstemp(path);
+	close(fd);
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(1 << 14, 0.01);
+	vector<uint32_t> ele;
+	for (unsigned m = 0; m < 100; m++) {
+		Bloomap* map = f->newMap();
+		for (uint32_t i = 0; i < (1 << 14); i++) {
+			ele.push_back(rand() & 0xffffff);
+			map->add(ele.back());
+		}
+	}
+	f->save(path);
+	f->trackChanges(true);
+	const string log = string(path) + ".log";
+	size_t written = 0;
+	unsigned n = 0;
+	while (state.KeepRunning()) {
+		state.PauseTiming();
+		Bloomap* map = f->map(n++ % 100);
+		for (unsigned i = 0; i < (1 << 10); i++)
+			map->add(ele[rand() % ele.size()]);
+		/* Start the log over, it would grow forever */
+		unlink(log.c_str());
+		state.ResumeTiming();
+		if (incremental) f->checkpoint(path);
+		else f->save(path);
+		state.PauseTiming();
+		struct stat st;
+		if (!stat(incremental ? log.c_str() : path, &st))
+			written += st.st_size;
+		state.ResumeTiming();
+	}
+	state.counters["bytes"] = written / state.iterations();
+	while (f->nmaps())
+		delete f->map(0);
+	delete f;
+	unlink(log.c_str());
+	unlink(path);
+}
+
+static void BM_family_save( benchmark::State& state ) { H_family_update(state, false); }
+static void BM_family_checkpoint( benchmark::State& state ) { H_family_update(state, true); }
+
+/* A long tail: 1000 maps in a family for 2^16 elements, map m holding
+ * about 2^16/(m+1) of them, so most maps hold a few dozen. The memory of
+ * the maps (as a counter), and the time of intersecting neighbouring maps
+ * and counting the results. Packed or plain maps. */
+static void H_family_long_tail(benchmark::State& state, bool compressed) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(1 << 16, 0.01);
+	f->setCompression(compressed);
+	vector<Bloomap*> maps;
+	size_t memory = 0;
+	for (unsigned m = 0; m < 1000; m++) {
+		maps.push_back(f->newMap());
+		for (uint32_t i = 0; i < (1U << 16)/(m + 1); i++)
+			maps[m]->add(rand() & 0xfffff);
+		memory += maps[m]->memoryUsage();
+	}
+	Bloomap* res = f->newMap();
+	while (state.KeepRunning()) {
+		for (unsigned m = 0; m + 1 < maps.size(); m++) {
+			res->clear();
+			res->add(maps[m + 1]);
+			res->intersect(maps[m]);
+			benchmark::DoNotOptimize(res->popcount());
+		}
+	}
+	state.counters["memory"] = memory;
+	state.SetItemsProcessed(state.iterations()*(maps.size() - 1));
+	delete res;
+	for (unsigned m = 0; m < maps.size(); m++)
+		delete maps[m];
+	delete f;
+}
+
+/* Short-lived maps, as in queries: a copy of a map is intersected with
+ * another one, counted and deleted. The bits are recycled by the arena of
+ * the family, or allocated and freed each time without the pool. */
+static void H_family_temporaries(benchmark::State& state, bool pooled) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 0.01);
+	f->setCompression(false);
+	if (!pooled) f->setPoolLimit(0);
+	Bloomap* map1 = f->newMap();
+	Bloomap* map2 = f->newMap();
+	for (long i = 0; i < state.range_x(); i++) {
+		map1->add(rand());
+		map2->add(rand());
+	}
+	while (state.KeepRunning()) {
+		Bloomap* tmp = new Bloomap(map1);
+		tmp->intersect(map2);
+		benchmark::DoNotOptimize(tmp->popcount());
+		delete tmp;
+	}
+	state.SetItemsProcessed(state.iterations());
+	delete map1;
+	delete map2;
+	delete f;
+}
+
+static void BM_family_temporaries( benchmark::State& state ) { H_family_temporaries(state, true); }
+static void BM_family_temporaries_unpooled( benchmark::State& state ) { H_family_temporaries(state, false); }
+
+/* Clones of a large map (1% FP rate for range_x elements), deleted right
+ * away, after a few adds, or after an intersection. With copy-on-write the
+ * clones share the bits of the map, the first clone writes them once. */
+static void H_bloomap_clone(benchmark::State& state, bool cow, int use) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 0.01);
+	f->setCompression(false);
+	f->setCopyOnWrite(cow);
+	Bloomap* map = f->newMap();
+	Bloomap* other = f->newMap();
+	for (long i = 0; i < state.range_x(); i++) {
+		map->add(rand());
+		other->add(rand());
+	}
+	while (state.KeepRunning()) {
+		Bloomap* clone = new Bloomap(map);
+		if (use == 1) {
+			for (unsigned i = 0; i < 1000; i++)
+				clone->add(rand());
+		} else if (use == 2) {
+			clone->intersect(other);
+			benchmark::DoNotOptimize(clone->popcount());
+		}
+		delete clone;
+	}
+	state.counters["bytes"] = map->memoryUsage();
+	delete map;
+	delete other;
+	delete f;
+}
+
+static void BM_bloomap_clone( benchmark::State& state ) { H_bloomap_clone(state, true, 0); }
+static void BM_bloomap_clone_copied( benchmark::State& state ) { H_bloomap_clone(state, false, 0); }
+static void BM_bloomap_clone_add( benchmark::State& state ) { H_bloomap_clone(state, true, 1); }
+static void BM_bloomap_clone_add_copied( benchmark::State& state ) { H_bloomap_clone(state, false, 1); }
+static void BM_bloomap_clone_intersect( benchmark::State& state ) { H_bloomap_clone(state, true, 2); }
+static void BM_bloomap_clone_intersect_copied( benchmark::State& state ) { H_bloomap_clone(state, false, 2); }
+
+static void BM_family_long_tail_plain( benchmark::State& state ) { H_family_long_tail(state, false); }
+static void BM_family_long_tail_packed( benchmark::State& state ) { H_family_long_tail(state, true); }
+
+static void BM_bloomap_fp_rate( benchmark::State& state ) { H_bloomap_fp_rate(state, BloomapFamily::LAYOUT_COMPARTMENTS); }
+static void BM_bloomap_fp_rate_blocked( benchmark::State& state ) { H_bloomap_fp_rate(state, BloomapFamily::LAYOUT_BLOCKED); }
+
+/* Fixed geometry of 7 compartments of 2^16 bits (about 6000 elements at
+ * 1%), in a static and a dynamic map of the same family. */
+#define STATIC_K 7
+#define STATIC_LOG 16
+
+static void BM_bloomap_fixed_insert( benchmark::State& state ) {
+	BloomapFamily *f = BloomapFamily::forCompartments(STATIC_K, STATIC_LOG);
+	Bloomap *map = f->newMap();
+	uint32_t n = 0;
+	uint32_t range = state.range_x();
+	while (state.KeepRunning()) {
+		for (uint32_t i = 0; i < range; i++)
+			benchmark::DoNotOptimize(map->add(n++));
+		state.PauseTiming();
+		map->clear();
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(state.iterations()*range);
+	delete map;
+	delete f;
+}
+
+static void BM_bloomap_static_insert( benchmark::State& state ) {
+	BloomapFamily *f = BloomapFamily::forCompartments(STATIC_K, STATIC_LOG);
+	StaticBloomap<STATIC_K, STATIC_LOG> *map = f->newStaticMap<STATIC_K, STATIC_LOG>();
+	uint32_t n = 0;
+	uint32_t range = state.range_x();
+	while (state.KeepRunning()) {
+		for (uint32_t i = 0; i < range; i++)
+			benchmark::DoNotOptimize(map->add(n++));
+		state.PauseTiming();
+		map->clear();
+		state.ResumeTiming();
+	}
+	state.SetItemsProcessed(state.iterations()*range);
+	delete map;
+	delete f;
+}
+
+static void BM_bloomap_fixed_lookup( benchmark::State& state ) {
+	BloomapFamily *f = BloomapFamily::forCompartments(STATIC_K, STATIC_LOG);
+	Bloomap *map = f->newMap();
+	vector<uint32_t> keys;
+	H_prepare_lookup(map, keys, state.range_x());
+	while (state.KeepRunning()) {
+		for (uint32_t i = 0; i < keys.size(); i++)
+			benchmark::DoNotOptimize(map->contains(keys[i]));
+	}
+	state.SetItemsProcessed(state.iterations()*keys.size());
+	delete map;
+	delete f;
+}
+
+static void BM_bloomap_static_lookup( benchmark::State& state ) {
+	BloomapFamily *f = BloomapFamily::forCompartments(STATIC_K, STATIC_LOG);
+	StaticBloomap<STATIC_K, STATIC_LOG> *map = f->newStaticMap<STATIC_K, STATIC_LOG>();
+	vector<uint32_t> keys;
+	H_prepare_lookup(map, keys, state.range_x());
+	while (state.KeepRunning()) {
+		for (uint32_t i = 0; i < keys.size(); i++)
+			benchmark::DoNotOptimize(map->contains(keys[i]));
+	}
+	state.SetItemsProcessed(state.iterations()*keys.size());
+	delete map;
+	delete f;
 }
 
 static void BM_bloomap_nofamily_insert( benchmark::State& state ) {
@@ -41,6 +579,8 @@ static void BM_bloomap_nofamily_insert( benchmark::State& state ) {
 		map->clear();
 		state.ResumeTiming();
 	}
+	delete map;
+	delete f;
 }
 
 static void BM_stdmap_insert( benchmark::State& state ) {
@@ -140,6 +680,73 @@ static void BM_bloomap_intersect( benchmark::State& state ) {
 	delete map_intersection;
 }
 
+/* A & B into a third map, the in-place way: copy, then intersect */
+static void BM_bloomap_intersect_copy( benchmark::State& state ) {
+	uint32_t range = state.range_x();
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y());
+	Bloomap *map1 = f->newMap();
+	Bloomap *map2 = f->newMap();
+	Bloomap *map_intersection = f->newMap();
+	H_fill_bloomap(map1, range, 0);
+	H_fill_bloomap(map2, range, range/2);
+
+	while (state.KeepRunning()) {
+		map_intersection->clear();
+		map_intersection->add(map1);
+		benchmark::DoNotOptimize(map_intersection->intersect(map2));
+	}
+
+	delete map_intersection;
+	delete map2;
+	delete map1;
+	delete f;
+}
+
+static void BM_bloomap_intersect_into( benchmark::State& state ) {
+	uint32_t range = state.range_x();
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y());
+	Bloomap *map1 = f->newMap();
+	Bloomap *map2 = f->newMap();
+	Bloomap *map_intersection = f->newMap();
+	H_fill_bloomap(map1, range, 0);
+	H_fill_bloomap(map2, range, range/2);
+
+	while (state.KeepRunning())
+		benchmark::DoNotOptimize(Bloomap::intersectInto(map_intersection, map1, map2));
+
+	delete map_intersection;
+	delete map2;
+	delete map1;
+	delete f;
+}
+
+/* The three-operand kernel on arrays of range_x words, with regular or
+ * non-temporal stores */
+static void H_kernel_and_into( benchmark::State& state, bool stream ) {
+	const size_t n = state.range_x();
+	uint64_t* a = bloomap_alloc_words(n);
+	uint64_t* b = bloomap_alloc_words(n);
+	uint64_t* dst = bloomap_alloc_words(n);
+	for (size_t i = 0; i < n; i++) {
+		a[i] = ((uint64_t) rand() << 32) ^ rand();
+		b[i] = ((uint64_t) rand() << 32) ^ rand();
+	}
+	memset(dst, 0, n*sizeof(uint64_t));
+
+	while (state.KeepRunning()) {
+		bitkernels()->and_into(dst, a, b, n, stream);
+		benchmark::DoNotOptimize(dst[n / 2]);
+	}
+	state.SetBytesProcessed(state.iterations()*3*n*sizeof(uint64_t));
+
+	bloomap_free_words(dst);
+	bloomap_free_words(b);
+	bloomap_free_words(a);
+}
+
+static void BM_kernel_and_into( benchmark::State& state ) { H_kernel_and_into(state, false); }
+static void BM_kernel_and_into_stream( benchmark::State& state ) { H_kernel_and_into(state, true); }
+
 static void BM_stdvector_intersect( benchmark::State& state ) {
 	uint32_t range = state.range_x();
     vector<uint32_t> v1,v2;
@@ -211,6 +818,104 @@ static void BM_bloomap_union_add( benchmark::State& state ) {
 	delete map_unionion;
 }
 
+/* (m0 & m1) | (m2 & m3) & m4, with temporaries as one would write it with
+ * the in-place operations. */
+static void BM_bloomap_expression_inplace( benchmark::State& state ) {
+	uint32_t range = state.range_x();
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y());
+	Bloomap *maps[5];
+	for (unsigned i = 0; i < 5; i++) {
+		maps[i] = f->newMap();
+		H_fill_bloomap(maps[i], range, 0);
+	}
+	Bloomap *res = f->newMap();
+	Bloomap *tmp = f->newMap();
+
+	while (state.KeepRunning()) {
+		res->clear();
+		res->add(maps[0]);
+		res->intersect(maps[1]);
+		tmp->clear();
+		tmp->add(maps[2]);
+		tmp->intersect(maps[3]);
+		res->or_from(tmp);
+		benchmark::DoNotOptimize(res->intersect(maps[4]));
+	}
+
+	for (unsigned i = 0; i < 5; i++)
+		delete maps[i];
+	delete res;
+	delete tmp;
+	delete f;
+}
+
+static void BM_bloomap_expression_lazy( benchmark::State& state ) {
+	uint32_t range = state.range_x();
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y());
+	Bloomap *maps[5];
+	for (unsigned i = 0; i < 5; i++) {
+		maps[i] = f->newMap();
+		H_fill_bloomap(maps[i], range, 0);
+	}
+	Bloomap *res = f->newMap();
+	BloomapExpr expr = ((BloomapExpr(maps[0]) & maps[1]) | (BloomapExpr(maps[2]) & maps[3])) & maps[4];
+
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(expr.evaluate(res));
+	}
+
+	for (unsigned i = 0; i < 5; i++)
+		delete maps[i];
+	delete res;
+	delete f;
+}
+
+static void BM_bloomap_expression_lazy_empty( benchmark::State& state ) {
+	uint32_t range = state.range_x();
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y());
+	Bloomap *maps[5];
+	for (unsigned i = 0; i < 5; i++) {
+		maps[i] = f->newMap();
+		H_fill_bloomap(maps[i], range, 0);
+	}
+	BloomapExpr expr = ((BloomapExpr(maps[0]) & maps[1]) | (BloomapExpr(maps[2]) & maps[3])) & maps[4];
+
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(expr.isEmpty());
+	}
+
+	for (unsigned i = 0; i < 5; i++)
+		delete maps[i];
+	delete f;
+}
+
+static void BM_bloomap_popcount( benchmark::State& state ) {
+	uint32_t range = state.range_x();
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y());
+	Bloomap *map = f->newMap();
+	H_fill_bloomap(map, range, 0);
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(map->popcount());
+	}
+	delete map;
+	delete f;
+}
+
+static void BM_bloomap_estimate_intersection( benchmark::State& state ) {
+	uint32_t range = state.range_x();
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y());
+	Bloomap *map1 = f->newMap();
+	Bloomap *map2 = f->newMap();
+	H_fill_bloomap(map1, range, 0);
+	H_fill_bloomap(map2, range, range/2);
+	while (state.KeepRunning()) {
+		benchmark::DoNotOptimize(map1->estimateIntersectionCardinality(map2));
+	}
+	delete map1;
+	delete map2;
+	delete f;
+}
+
 static void BM_stdvector_union( benchmark::State& state ) {
 	uint32_t range = state.range_x();
     vector<uint32_t> v1,v2;
@@ -236,6 +941,176 @@ static void BM_stdvector_union( benchmark::State& state ) {
 	}
 }
 
+/* Counting maps: inserting and removing range_x elements, and the union and
+ * intersection of two maps of them (counter sums and minima) */
+static void BM_counting_insert_remove( benchmark::State& state ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y());
+	CountingBloomap *map = f->newCountingMap();
+	vector<uint32_t> ele(state.range_x());
+	for (uint32_t i = 0; i < ele.size(); i++)
+		ele[i] = rand();
+
+	while (state.KeepRunning()) {
+		for (uint32_t i = 0; i < ele.size(); i++)
+			map->add(ele[i]);
+		for (uint32_t i = 0; i < ele.size(); i++)
+			map->remove(ele[i]);
+	}
+	state.SetItemsProcessed(state.iterations()*2*ele.size());
+
+	delete map;
+	delete f;
+}
+
+static void H_counting_pair( benchmark::State& state, bool intersect ) {
+	uint32_t range = state.range_x();
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y());
+	CountingBloomap *map1 = f->newCountingMap();
+	CountingBloomap *map2 = f->newCountingMap();
+	H_fill_bloomap(map1, range, 0);
+	H_fill_bloomap(map2, range, range/2);
+
+	/* Both are idempotent once the counters saturate or meet */
+	while (state.KeepRunning()) {
+		if (intersect)
+			benchmark::DoNotOptimize(map1->intersect(map2));
+		else
+			benchmark::DoNotOptimize(map1->add(map2));
+	}
+
+	delete map2;
+	delete map1;
+	delete f;
+}
+
+static void BM_counting_union( benchmark::State& state ) { H_counting_pair(state, false); }
+static void BM_counting_intersect( benchmark::State& state ) { H_counting_pair(state, true); }
+
+/* Scalable maps: the long tail of H_family_long_tail(), built into plain
+ * maps of a family sized for the largest map, or into scalable maps of a
+ * family sized for 2^10 elements. The memory of the maps and their false
+ * positive rate on keys never inserted, as counters. */
+static void H_scalable_long_tail(benchmark::State& state, bool scalable) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(scalable ? 1 << 10 : 1 << 16, 0.01);
+	size_t memory = 0;
+	uint64_t positives = 0, queries = 0;
+	while (state.KeepRunning()) {
+		vector<Bloomap*> maps;
+		vector<ScalableBloomap*> smaps;
+		srand(1);
+		for (unsigned m = 0; m < 1000; m++) {
+			if (scalable) smaps.push_back(f->newScalableMap());
+			else maps.push_back(f->newMap());
+			for (uint32_t i = 0; i < (1U << 16)/(m + 1); i++) {
+				if (scalable) smaps[m]->add(rand() & 0xfffff);
+				else maps[m]->add(rand() & 0xfffff);
+			}
+		}
+		state.PauseTiming();
+		memory = positives = queries = 0;
+		for (unsigned m = 0; m < 1000; m++) {
+			memory += scalable ? smaps[m]->memoryUsage() : maps[m]->memoryUsage();
+			for (unsigned i = 0; i < 1000; i++, queries++) {
+				const uint32_t key = 0x100000 | (rand() & 0xfffff);
+				positives += scalable ? smaps[m]->contains(key) : maps[m]->contains(key);
+			}
+			if (scalable) delete smaps[m];
+			else delete maps[m];
+		}
+		state.ResumeTiming();
+	}
+	state.counters["memory"] = memory;
+	state.counters["fp_rate"] = 1.0*positives / queries;
+	state.SetItemsProcessed(state.iterations()*1000);
+	delete f;
+}
+
+static void BM_scalable_long_tail_plain( benchmark::State& state ) { H_scalable_long_tail(state, false); }
+static void BM_scalable_long_tail_scalable( benchmark::State& state ) { H_scalable_long_tail(state, true); }
+
+/* Wide keys: range_x random keys inserted into a map through BloomapKeys,
+ * and looked up, half of the lookups hitting. The 32-bit variants add
+ * random elements directly, for comparison. All in a family with the
+ * sparse index. */
+static void H_gen_key(uint32_t& key) { key = ((uint32_t) rand() << 16) ^ rand(); }
+static void H_gen_key(uint64_t& key) { key = ((uint64_t) rand() << 32) ^ rand(); }
+static void H_gen_key(std::string& key) {
+	char buf[48];
+	snprintf(buf, sizeof(buf), "user-%d-%d@example.com", rand(), rand());
+	key = buf;
+}
+
+static bool H_add_key(BloomapKeys<uint32_t>*, Bloomap* map, uint32_t key) { return map->add(key); }
+template<typename Key>
+static bool H_add_key(BloomapKeys<Key>* keys, Bloomap* map, const Key& key) { return keys->add(map, key); }
+static bool H_contains_key(BloomapKeys<uint32_t>*, Bloomap* map, uint32_t key) { return map->contains(key); }
+template<typename Key>
+static bool H_contains_key(BloomapKeys<Key>* keys, Bloomap* map, const Key& key) { return keys->contains(map, key); }
+
+template<typename Key>
+static void H_keys( benchmark::State& state, bool lookup ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(state.range_x(), 1.0/state.range_y(),
+			BloomapFamily::LAYOUT_COMPARTMENTS, BLOOMAP_DEFAULT_SEED, BloomapFamily::INDEX_SPARSE);
+	BloomapKeys<Key>* keys = new BloomapKeys<Key>(f);
+	Bloomap *map = f->newMap();
+	vector<Key> ins(state.range_x()), queries(1 << 16);
+	for (uint32_t i = 0; i < ins.size(); i++)
+		H_gen_key(ins[i]);
+	for (uint32_t i = 0; i < queries.size(); i++) {
+		if (i % 2) queries[i] = ins[rand() % ins.size()];
+		else H_gen_key(queries[i]);
+	}
+	for (uint32_t i = 0; i < ins.size(); i++)
+		H_add_key(keys, map, ins[i]);
+	while (state.KeepRunning()) {
+		if (lookup) {
+			for (uint32_t i = 0; i < queries.size(); i++)
+				benchmark::DoNotOptimize(H_contains_key(keys, map, queries[i]));
+		} else {
+			for (uint32_t i = 0; i < ins.size(); i++)
+				benchmark::DoNotOptimize(H_add_key(keys, map, ins[i]));
+			state.PauseTiming();
+			map->clear();
+			state.ResumeTiming();
+		}
+	}
+	state.SetItemsProcessed(state.iterations()*(lookup ? queries.size() : ins.size()));
+	delete map;
+	delete keys;
+	delete f;
+}
+
+static void BM_keys_insert_u32( benchmark::State& state ) { H_keys<uint32_t>(state, false); }
+static void BM_keys_insert_u64( benchmark::State& state ) { H_keys<uint64_t>(state, false); }
+static void BM_keys_insert_string( benchmark::State& state ) { H_keys<std::string>(state, false); }
+static void BM_keys_lookup_u32( benchmark::State& state ) { H_keys<uint32_t>(state, true); }
+static void BM_keys_lookup_u64( benchmark::State& state ) { H_keys<uint64_t>(state, true); }
+static void BM_keys_lookup_string( benchmark::State& state ) { H_keys<std::string>(state, true); }
+
+/* Runs the benchmark with the given bit kernels forced, restoring the
+ * previously active ones afterwards. */
+static void H_with_kernels( benchmark::State& state, const char* name, void (*bm)(benchmark::State&) ) {
+	const BitKernels* prev = bitkernels();
+	if (!bitkernels_select(name)) {
+		state.SkipWithError("kernels not supported by this CPU");
+		return;
+	}
+	bm(state);
+	bitkernels_select(prev->name);
+}
+
+#define BM_KERNEL_VARIANTS(BM) \
+	static void BM##_scalar( benchmark::State& state ) { H_with_kernels(state, "scalar", BM); } \
+	static void BM##_sse2( benchmark::State& state ) { H_with_kernels(state, "sse2", BM); } \
+	static void BM##_avx2( benchmark::State& state ) { H_with_kernels(state, "avx2", BM); } \
+	static void BM##_avx512( benchmark::State& state ) { H_with_kernels(state, "avx512", BM); }
+
+BM_KERNEL_VARIANTS(BM_bloomap_union)
+BM_KERNEL_VARIANTS(BM_counting_union)
+BM_KERNEL_VARIANTS(BM_bloomap_union_add)
+BM_KERNEL_VARIANTS(BM_bloomap_intersect)
+BM_KERNEL_VARIANTS(BM_bloomap_popcount)
+
 static void BloomapCustomArgs( benchmark::internal::Benchmark* b ) {
 	b->ArgPair(1 << 6, 10);
 	b->ArgPair(1 << 8, 10);
@@ -252,6 +1127,13 @@ static void BloomapCustomArgs( benchmark::internal::Benchmark* b ) {
 	b->ArgPair(1 << 14, 100);
 }
 
+static void LookupArgs( benchmark::internal::Benchmark* b ) {
+	b->ArgPair(1 << 14, 100);
+	b->ArgPair(1 << 20, 100);
+	b->ArgPair(1 << 24, 100);
+	b->ArgPair(1 << 26, 100);
+}
+
 static void CustomArgs( benchmark::internal::Benchmark* b ) {
 	b->Arg(1 << 2);
 	b->Arg(1 << 8);
@@ -261,11 +1143,87 @@ static void CustomArgs( benchmark::internal::Benchmark* b ) {
 }
 
 BENCHMARK(BM_bloomap_union)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_union_scalar)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_union_sse2)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_union_avx2)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_union_avx512)->Apply(BloomapCustomArgs);
 BENCHMARK(BM_bloomap_union_add)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_union_add_scalar)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_union_add_sse2)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_union_add_avx2)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_union_add_avx512)->Apply(BloomapCustomArgs);
 BENCHMARK(BM_stdvector_union)->Apply(CustomArgs);
 BENCHMARK(BM_bloomap_intersect)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_intersect_scalar)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_intersect_sse2)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_intersect_avx2)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_intersect_avx512)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_intersect_copy)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_intersect_into)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_kernel_and_into)->Arg(1 << 16)->Arg(1 << 23);
+BENCHMARK(BM_kernel_and_into_stream)->Arg(1 << 16)->Arg(1 << 23);
 BENCHMARK(BM_stdvector_intersect)->Apply(CustomArgs);
+BENCHMARK(BM_bloomap_popcount)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_popcount_scalar)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_popcount_sse2)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_popcount_avx2)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_popcount_avx512)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_counting_insert_remove)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_counting_union)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_counting_union_scalar)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_counting_union_sse2)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_counting_union_avx2)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_counting_union_avx512)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_counting_intersect)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_estimate_intersection)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_expression_inplace)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_expression_lazy)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_expression_lazy_empty)->Apply(BloomapCustomArgs);
 BENCHMARK(BM_bloomap_insert)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_insert_blocked)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_insert_batch)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_lookup)->Apply(LookupArgs);
+BENCHMARK(BM_bloomap_lookup_blocked)->Apply(LookupArgs);
+BENCHMARK(BM_bloomap_lookup_batch)->Apply(LookupArgs);
+BENCHMARK(BM_bloomap_lookup_batch_blocked)->Apply(LookupArgs);
+BENCHMARK(BM_bloomap_concurrent_insert)->Apply(ThreadArgs)->UseRealTime();
+BENCHMARK(BM_bloomap_fixed_insert)->Arg(1 << 12);
+BENCHMARK(BM_bloomap_static_insert)->Arg(1 << 12);
+BENCHMARK(BM_bloomap_fixed_lookup)->Arg(1 << 12);
+BENCHMARK(BM_bloomap_static_lookup)->Arg(1 << 12);
+BENCHMARK(BM_bloomap_for_each_dense)->Apply(EnumerateArgs);
+BENCHMARK(BM_bloomap_for_each_sparse)->Apply(EnumerateArgs);
+BENCHMARK(BM_bloomap_enumerate_dense)->Apply(EnumerateArgs);
+BENCHMARK(BM_bloomap_enumerate_sparse)->Apply(EnumerateArgs);
+BENCHMARK(BM_bloomap_parallel_count)->Apply(ThreadArgs)->UseRealTime();
+BENCHMARK(BM_bloomap_parallel_purge)->Apply(ThreadArgs)->UseRealTime();
+BENCHMARK(BM_bloomap_purge_each)->Arg(4)->Arg(16);
+BENCHMARK(BM_bloomap_purge_batch)->Arg(4)->Arg(16);
+BENCHMARK(BM_family_prune)->Arg(4)->Arg(16);
+BENCHMARK(BM_family_load)->Arg(4)->Arg(16);
+BENCHMARK(BM_family_build)->Arg(4)->Arg(16);
+BENCHMARK(BM_family_save);
+BENCHMARK(BM_family_checkpoint);
+BENCHMARK(BM_family_long_tail_plain);
+BENCHMARK(BM_family_long_tail_packed);
+BENCHMARK(BM_scalable_long_tail_plain);
+BENCHMARK(BM_scalable_long_tail_scalable);
+BENCHMARK(BM_keys_insert_u32)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_keys_insert_u64)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_keys_insert_string)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_keys_lookup_u32)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_keys_lookup_u64)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_keys_lookup_string)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_family_temporaries)->Arg(1 << 16)->Arg(1 << 20);
+BENCHMARK(BM_family_temporaries_unpooled)->Arg(1 << 16)->Arg(1 << 20);
+BENCHMARK(BM_bloomap_clone)->Arg(1 << 20)->Arg(1 << 23);
+BENCHMARK(BM_bloomap_clone_copied)->Arg(1 << 20)->Arg(1 << 23);
+BENCHMARK(BM_bloomap_clone_add)->Arg(1 << 20)->Arg(1 << 23);
+BENCHMARK(BM_bloomap_clone_add_copied)->Arg(1 << 20)->Arg(1 << 23);
+BENCHMARK(BM_bloomap_clone_intersect)->Arg(1 << 20)->Arg(1 << 23);
+BENCHMARK(BM_bloomap_clone_intersect_copied)->Arg(1 << 20)->Arg(1 << 23);
+BENCHMARK(BM_bloomap_fp_rate)->Apply(BloomapCustomArgs);
+BENCHMARK(BM_bloomap_fp_rate_blocked)->Apply(BloomapCustomArgs);
 BENCHMARK(BM_bloomap_nofamily_insert)->Apply(BloomapCustomArgs);
 BENCHMARK(BM_stdmap_insert)->Apply(CustomArgs);
 BENCHMARK(BM_stdset_insert)->Apply(CustomArgs);
@@ -0,0 +1,670 @@
+#include <cstring>
+#include <unistd.h>
+
+#include "bitkernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BITKERNELS_X86
+#include <immintrin.h>
+#endif
+
+/* Scalar implementation, always available. */
+
+static void scalar_and_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		dst[i] &= src[i];
+}
+
+static void scalar_or_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		dst[i] |= src[i];
+}
+
+static bool scalar_or_to_changed(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	uint64_t diff = 0;
+	for (size_t i = 0; i < n; i++) {
+		diff |= src[i] & ~dst[i];
+		dst[i] |= src[i];
+	}
+	return diff != 0;
+}
+
+/* The scalar kernels have no portable non-temporal store, stream is a hint. */
+static void scalar_and_into(uint64_t *__restrict dst, const uint64_t *a, const uint64_t *b, size_t n, bool stream) {
+	(void) stream;
+	for (size_t i = 0; i < n; i++)
+		dst[i] = a[i] & b[i];
+}
+
+static void scalar_or_into(uint64_t *__restrict dst, const uint64_t *a, const uint64_t *b, size_t n, bool stream) {
+	(void) stream;
+	for (size_t i = 0; i < n; i++)
+		dst[i] = a[i] | b[i];
+}
+
+/* Saturating add and minimum of the 4-bit counters in a word, the low and
+ * high nibbles of each byte done separately. */
+static inline uint64_t nibbles_add(uint64_t a, uint64_t b) {
+	const uint64_t m = 0x0F0F0F0F0F0F0F0FULL, ones = 0x0101010101010101ULL;
+	uint64_t lo = (a & m) + (b & m);
+	uint64_t hi = ((a >> 4) & m) + ((b >> 4) & m);
+	/* Sums of 16 and more have bit 4 set, make them 15 */
+	lo = (lo | ((lo >> 4) & ones)*15) & m;
+	hi = (hi | ((hi >> 4) & ones)*15) & m;
+	return lo | (hi << 4);
+}
+
+static inline uint64_t nibbles_min(uint64_t a, uint64_t b) {
+	const uint64_t m = 0x0F0F0F0F0F0F0F0FULL, ones = 0x0101010101010101ULL, sixteen = 0x1010101010101010ULL;
+	uint64_t res = 0;
+	for (unsigned shift = 0; shift < 8; shift += 4) {
+		uint64_t x = (a >> shift) & m, y = (b >> shift) & m;
+		/* 16 + x - y has bit 4 set iff x >= y, no byte borrows */
+		uint64_t ge = ((((x | sixteen) - y) >> 4) & ones)*15;
+		res |= ((y & ge) | (x & ~ge)) << shift;
+	}
+	return res;
+}
+
+static void scalar_nibble_add_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		dst[i] = nibbles_add(dst[i], src[i]);
+}
+
+static void scalar_nibble_min_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		dst[i] = nibbles_min(dst[i], src[i]);
+}
+
+static uint64_t scalar_popcount(const uint64_t *a, size_t n) {
+	uint64_t count = 0;
+	for (size_t i = 0; i < n; i++)
+		count += __builtin_popcountll(a[i]);
+	return count;
+}
+
+static void scalar_popcount_pair(const uint64_t *a, const uint64_t *b, size_t n, uint64_t counts[3]) {
+	for (size_t i = 0; i < n; i++) {
+		counts[0] += __builtin_popcountll(a[i]);
+		counts[1] += __builtin_popcountll(b[i]);
+		counts[2] += __builtin_popcountll(a[i] | b[i]);
+	}
+}
+
+#ifdef BITKERNELS_X86
+
+/* The vector kernels first do the words before the first address of dst
+ * aligned to the vector width, so dst is read and written with aligned
+ * accesses. Bit arrays from BloomapArena are aligned to a cache line, so
+ * normally there are none, and src, aligned as well, never splits a cache
+ * line even though it is read with unaligned loads. */
+static inline size_t bitkernels_head(const uint64_t *p, size_t n, size_t align) {
+	size_t head = ((align - ((uintptr_t) p & (align - 1))) & (align - 1)) / sizeof(uint64_t);
+	return head < n ? head : n;
+}
+
+/* SSE2, two words at a time. The tail is left to the scalar code. */
+
+__attribute__((target("sse2")))
+static void sse2_and_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	size_t i = bitkernels_head(dst, n, 16);
+	scalar_and_to(dst, src, i);
+	for (; i + 2 <= n; i += 2) {
+		__m128i a = _mm_load_si128((const __m128i*) (dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i*) (src + i));
+		_mm_store_si128((__m128i*) (dst + i), _mm_and_si128(a, b));
+	}
+	scalar_and_to(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void sse2_or_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	size_t i = bitkernels_head(dst, n, 16);
+	scalar_or_to(dst, src, i);
+	for (; i + 2 <= n; i += 2) {
+		__m128i a = _mm_load_si128((const __m128i*) (dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i*) (src + i));
+		_mm_store_si128((__m128i*) (dst + i), _mm_or_si128(a, b));
+	}
+	scalar_or_to(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static bool sse2_or_to_changed(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	size_t i = bitkernels_head(dst, n, 16);
+	bool changed = scalar_or_to_changed(dst, src, i);
+	__m128i diff = _mm_setzero_si128();
+	for (; i + 2 <= n; i += 2) {
+		__m128i a = _mm_load_si128((const __m128i*) (dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i*) (src + i));
+		diff = _mm_or_si128(diff, _mm_andnot_si128(a, b));
+		_mm_store_si128((__m128i*) (dst + i), _mm_or_si128(a, b));
+	}
+	/* There is no ptest in SSE2, compare bytes against zero instead. */
+	changed |= _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF;
+	return scalar_or_to_changed(dst + i, src + i, n - i) || changed;
+}
+
+/* Three-operand kernels. With stream, dst is written with non-temporal
+ * stores, which need it aligned, and fenced so the words are visible to
+ * other threads once the kernel returns. */
+__attribute__((target("sse2")))
+static void sse2_and_into(uint64_t *__restrict dst, const uint64_t *a, const uint64_t *b, size_t n, bool stream) {
+	size_t i = bitkernels_head(dst, n, 16);
+	scalar_and_into(dst, a, b, i, false);
+	if (stream) {
+		for (; i + 2 <= n; i += 2) {
+			__m128i x = _mm_loadu_si128((const __m128i*) (a + i));
+			__m128i y = _mm_loadu_si128((const __m128i*) (b + i));
+			_mm_stream_si128((__m128i*) (dst + i), _mm_and_si128(x, y));
+		}
+		_mm_sfence();
+	} else {
+		for (; i + 2 <= n; i += 2) {
+			__m128i x = _mm_loadu_si128((const __m128i*) (a + i));
+			__m128i y = _mm_loadu_si128((const __m128i*) (b + i));
+			_mm_store_si128((__m128i*) (dst + i), _mm_and_si128(x, y));
+		}
+	}
+	scalar_and_into(dst + i, a + i, b + i, n - i, false);
+}
+
+__attribute__((target("sse2")))
+static void sse2_or_into(uint64_t *__restrict dst, const uint64_t *a, const uint64_t *b, size_t n, bool stream) {
+	size_t i = bitkernels_head(dst, n, 16);
+	scalar_or_into(dst, a, b, i, false);
+	if (stream) {
+		for (; i + 2 <= n; i += 2) {
+			__m128i x = _mm_loadu_si128((const __m128i*) (a + i));
+			__m128i y = _mm_loadu_si128((const __m128i*) (b + i));
+			_mm_stream_si128((__m128i*) (dst + i), _mm_or_si128(x, y));
+		}
+		_mm_sfence();
+	} else {
+		for (; i + 2 <= n; i += 2) {
+			__m128i x = _mm_loadu_si128((const __m128i*) (a + i));
+			__m128i y = _mm_loadu_si128((const __m128i*) (b + i));
+			_mm_store_si128((__m128i*) (dst + i), _mm_or_si128(x, y));
+		}
+	}
+	scalar_or_into(dst + i, a + i, b + i, n - i, false);
+}
+
+/* 4-bit counters, split into bytes of the low and high nibbles */
+__attribute__((target("sse2")))
+static void sse2_nibble_add_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	const __m128i m = _mm_set1_epi8(0x0f);
+	size_t i = bitkernels_head(dst, n, 16);
+	scalar_nibble_add_to(dst, src, i);
+	for (; i + 2 <= n; i += 2) {
+		__m128i a = _mm_load_si128((const __m128i*) (dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i*) (src + i));
+		__m128i lo = _mm_min_epu8(_mm_add_epi8(_mm_and_si128(a, m), _mm_and_si128(b, m)), m);
+		__m128i hi = _mm_min_epu8(_mm_add_epi8(_mm_and_si128(_mm_srli_epi16(a, 4), m),
+					_mm_and_si128(_mm_srli_epi16(b, 4), m)), m);
+		_mm_store_si128((__m128i*) (dst + i), _mm_or_si128(lo, _mm_slli_epi16(hi, 4)));
+	}
+	scalar_nibble_add_to(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void sse2_nibble_min_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	const __m128i m = _mm_set1_epi8(0x0f);
+	size_t i = bitkernels_head(dst, n, 16);
+	scalar_nibble_min_to(dst, src, i);
+	for (; i + 2 <= n; i += 2) {
+		__m128i a = _mm_load_si128((const __m128i*) (dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i*) (src + i));
+		__m128i lo = _mm_min_epu8(_mm_and_si128(a, m), _mm_and_si128(b, m));
+		__m128i hi = _mm_min_epu8(_mm_andnot_si128(m, a), _mm_andnot_si128(m, b));
+		_mm_store_si128((__m128i*) (dst + i), _mm_or_si128(lo, hi));
+	}
+	scalar_nibble_min_to(dst + i, src + i, n - i);
+}
+
+/* There is no byte shuffle in SSE2, so count the bits by the usual SWAR
+ * reduction down to bytes, and sum the bytes with psadbw. */
+__attribute__((target("sse2")))
+static inline __m128i sse2_popcount_bytes(__m128i v) {
+	const __m128i m1 = _mm_set1_epi8(0x55);
+	const __m128i m2 = _mm_set1_epi8(0x33);
+	const __m128i m4 = _mm_set1_epi8(0x0f);
+	v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi16(v, 1), m1));
+	v = _mm_add_epi8(_mm_and_si128(v, m2), _mm_and_si128(_mm_srli_epi16(v, 2), m2));
+	v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi16(v, 4)), m4);
+	return _mm_sad_epu8(v, _mm_setzero_si128());
+}
+
+__attribute__((target("sse2")))
+static uint64_t sse2_popcount(const uint64_t *a, size_t n) {
+	size_t i = 0;
+	__m128i acc = _mm_setzero_si128();
+	for (; i + 2 <= n; i += 2)
+		acc = _mm_add_epi64(acc, sse2_popcount_bytes(_mm_loadu_si128((const __m128i*) (a + i))));
+	uint64_t sum[2];
+	_mm_storeu_si128((__m128i*) sum, acc);
+	return sum[0] + sum[1] + scalar_popcount(a + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void sse2_popcount_pair(const uint64_t *a, const uint64_t *b, size_t n, uint64_t counts[3]) {
+	size_t i = 0;
+	__m128i ca = _mm_setzero_si128(), cb = _mm_setzero_si128(), cor = _mm_setzero_si128();
+	for (; i + 2 <= n; i += 2) {
+		__m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*) (b + i));
+		ca = _mm_add_epi64(ca, sse2_popcount_bytes(va));
+		cb = _mm_add_epi64(cb, sse2_popcount_bytes(vb));
+		cor = _mm_add_epi64(cor, sse2_popcount_bytes(_mm_or_si128(va, vb)));
+	}
+	uint64_t sum[2];
+	_mm_storeu_si128((__m128i*) sum, ca);
+	counts[0] += sum[0] + sum[1];
+	_mm_storeu_si128((__m128i*) sum, cb);
+	counts[1] += sum[0] + sum[1];
+	_mm_storeu_si128((__m128i*) sum, cor);
+	counts[2] += sum[0] + sum[1];
+	scalar_popcount_pair(a + i, b + i, n - i, counts);
+}
+
+/* AVX2, four words at a time. */
+
+__attribute__((target("avx2")))
+static void avx2_and_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	size_t i = bitkernels_head(dst, n, 32);
+	scalar_and_to(dst, src, i);
+	for (; i + 4 <= n; i += 4) {
+		__m256i a = _mm256_load_si256((const __m256i*) (dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (src + i));
+		_mm256_store_si256((__m256i*) (dst + i), _mm256_and_si256(a, b));
+	}
+	scalar_and_to(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_or_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	size_t i = bitkernels_head(dst, n, 32);
+	scalar_or_to(dst, src, i);
+	for (; i + 4 <= n; i += 4) {
+		__m256i a = _mm256_load_si256((const __m256i*) (dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (src + i));
+		_mm256_store_si256((__m256i*) (dst + i), _mm256_or_si256(a, b));
+	}
+	scalar_or_to(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static bool avx2_or_to_changed(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	size_t i = bitkernels_head(dst, n, 32);
+	bool changed = scalar_or_to_changed(dst, src, i);
+	__m256i diff = _mm256_setzero_si256();
+	for (; i + 4 <= n; i += 4) {
+		__m256i a = _mm256_load_si256((const __m256i*) (dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (src + i));
+		diff = _mm256_or_si256(diff, _mm256_andnot_si256(a, b));
+		_mm256_store_si256((__m256i*) (dst + i), _mm256_or_si256(a, b));
+	}
+	changed |= !_mm256_testz_si256(diff, diff);
+	return scalar_or_to_changed(dst + i, src + i, n - i) || changed;
+}
+
+__attribute__((target("avx2")))
+static void avx2_and_into(uint64_t *__restrict dst, const uint64_t *a, const uint64_t *b, size_t n, bool stream) {
+	size_t i = bitkernels_head(dst, n, 32);
+	scalar_and_into(dst, a, b, i, false);
+	if (stream) {
+		for (; i + 4 <= n; i += 4) {
+			__m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+			__m256i y = _mm256_loadu_si256((const __m256i*) (b + i));
+			_mm256_stream_si256((__m256i*) (dst + i), _mm256_and_si256(x, y));
+		}
+		_mm_sfence();
+	} else {
+		for (; i + 4 <= n; i += 4) {
+			__m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+			__m256i y = _mm256_loadu_si256((const __m256i*) (b + i));
+			_mm256_store_si256((__m256i*) (dst + i), _mm256_and_si256(x, y));
+		}
+	}
+	scalar_and_into(dst + i, a + i, b + i, n - i, false);
+}
+
+__attribute__((target("avx2")))
+static void avx2_or_into(uint64_t *__restrict dst, const uint64_t *a, const uint64_t *b, size_t n, bool stream) {
+	size_t i = bitkernels_head(dst, n, 32);
+	scalar_or_into(dst, a, b, i, false);
+	if (stream) {
+		for (; i + 4 <= n; i += 4) {
+			__m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+			__m256i y = _mm256_loadu_si256((const __m256i*) (b + i));
+			_mm256_stream_si256((__m256i*) (dst + i), _mm256_or_si256(x, y));
+		}
+		_mm_sfence();
+	} else {
+		for (; i + 4 <= n; i += 4) {
+			__m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+			__m256i y = _mm256_loadu_si256((const __m256i*) (b + i));
+			_mm256_store_si256((__m256i*) (dst + i), _mm256_or_si256(x, y));
+		}
+	}
+	scalar_or_into(dst + i, a + i, b + i, n - i, false);
+}
+
+__attribute__((target("avx2")))
+static void avx2_nibble_add_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	const __m256i m = _mm256_set1_epi8(0x0f);
+	size_t i = bitkernels_head(dst, n, 32);
+	scalar_nibble_add_to(dst, src, i);
+	for (; i + 4 <= n; i += 4) {
+		__m256i a = _mm256_load_si256((const __m256i*) (dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (src + i));
+		__m256i lo = _mm256_min_epu8(_mm256_add_epi8(_mm256_and_si256(a, m), _mm256_and_si256(b, m)), m);
+		__m256i hi = _mm256_min_epu8(_mm256_add_epi8(_mm256_and_si256(_mm256_srli_epi16(a, 4), m),
+					_mm256_and_si256(_mm256_srli_epi16(b, 4), m)), m);
+		_mm256_store_si256((__m256i*) (dst + i), _mm256_or_si256(lo, _mm256_slli_epi16(hi, 4)));
+	}
+	scalar_nibble_add_to(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_nibble_min_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	const __m256i m = _mm256_set1_epi8(0x0f);
+	size_t i = bitkernels_head(dst, n, 32);
+	scalar_nibble_min_to(dst, src, i);
+	for (; i + 4 <= n; i += 4) {
+		__m256i a = _mm256_load_si256((const __m256i*) (dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (src + i));
+		__m256i lo = _mm256_min_epu8(_mm256_and_si256(a, m), _mm256_and_si256(b, m));
+		__m256i hi = _mm256_min_epu8(_mm256_andnot_si256(m, a), _mm256_andnot_si256(m, b));
+		_mm256_store_si256((__m256i*) (dst + i), _mm256_or_si256(lo, hi));
+	}
+	scalar_nibble_min_to(dst + i, src + i, n - i);
+}
+
+/* Nibble lookup with vpshufb, bytes summed with vpsadbw. */
+__attribute__((target("avx2")))
+static inline __m256i avx2_popcount_bytes(__m256i v) {
+	const __m256i lookup = _mm256_setr_epi8(
+			0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+			0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+	__m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+	return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t avx2_sum(__m256i v) {
+	uint64_t sum[4];
+	_mm256_storeu_si256((__m256i*) sum, v);
+	return sum[0] + sum[1] + sum[2] + sum[3];
+}
+
+__attribute__((target("avx2")))
+static uint64_t avx2_popcount(const uint64_t *a, size_t n) {
+	size_t i = 0;
+	__m256i acc = _mm256_setzero_si256();
+	for (; i + 4 <= n; i += 4)
+		acc = _mm256_add_epi64(acc, avx2_popcount_bytes(_mm256_loadu_si256((const __m256i*) (a + i))));
+	return avx2_sum(acc) + scalar_popcount(a + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_popcount_pair(const uint64_t *a, const uint64_t *b, size_t n, uint64_t counts[3]) {
+	size_t i = 0;
+	__m256i ca = _mm256_setzero_si256(), cb = _mm256_setzero_si256(), cor = _mm256_setzero_si256();
+	for (; i + 4 <= n; i += 4) {
+		__m256i va = _mm256_loadu_si256((const __m256i*) (a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i*) (b + i));
+		ca = _mm256_add_epi64(ca, avx2_popcount_bytes(va));
+		cb = _mm256_add_epi64(cb, avx2_popcount_bytes(vb));
+		cor = _mm256_add_epi64(cor, avx2_popcount_bytes(_mm256_or_si256(va, vb)));
+	}
+	counts[0] += avx2_sum(ca);
+	counts[1] += avx2_sum(cb);
+	counts[2] += avx2_sum(cor);
+	scalar_popcount_pair(a + i, b + i, n - i, counts);
+}
+
+/* AVX-512, eight words (a cache line) at a time. GCC's own intrinsics
+ * trigger bogus uninitialized warnings (_mm512_undefined_*), silence them. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+static void avx512_and_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	size_t i = bitkernels_head(dst, n, 64);
+	scalar_and_to(dst, src, i);
+	for (; i + 8 <= n; i += 8) {
+		__m512i a = _mm512_load_si512((const void*) (dst + i));
+		__m512i b = _mm512_loadu_si512((const void*) (src + i));
+		_mm512_store_si512((void*) (dst + i), _mm512_and_si512(a, b));
+	}
+	scalar_and_to(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void avx512_or_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	size_t i = bitkernels_head(dst, n, 64);
+	scalar_or_to(dst, src, i);
+	for (; i + 8 <= n; i += 8) {
+		__m512i a = _mm512_load_si512((const void*) (dst + i));
+		__m512i b = _mm512_loadu_si512((const void*) (src + i));
+		_mm512_store_si512((void*) (dst + i), _mm512_or_si512(a, b));
+	}
+	scalar_or_to(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static bool avx512_or_to_changed(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	size_t i = bitkernels_head(dst, n, 64);
+	bool changed = scalar_or_to_changed(dst, src, i);
+	__m512i diff = _mm512_setzero_si512();
+	for (; i + 8 <= n; i += 8) {
+		__m512i a = _mm512_load_si512((const void*) (dst + i));
+		__m512i b = _mm512_loadu_si512((const void*) (src + i));
+		diff = _mm512_or_si512(diff, _mm512_andnot_si512(a, b));
+		_mm512_store_si512((void*) (dst + i), _mm512_or_si512(a, b));
+	}
+	changed |= _mm512_test_epi64_mask(diff, diff) != 0;
+	return scalar_or_to_changed(dst + i, src + i, n - i) || changed;
+}
+
+__attribute__((target("avx512f")))
+static void avx512_and_into(uint64_t *__restrict dst, const uint64_t *a, const uint64_t *b, size_t n, bool stream) {
+	size_t i = bitkernels_head(dst, n, 64);
+	scalar_and_into(dst, a, b, i, false);
+	if (stream) {
+		for (; i + 8 <= n; i += 8) {
+			__m512i x = _mm512_loadu_si512((const void*) (a + i));
+			__m512i y = _mm512_loadu_si512((const void*) (b + i));
+			_mm512_stream_si512((__m512i*) (dst + i), _mm512_and_si512(x, y));
+		}
+		_mm_sfence();
+	} else {
+		for (; i + 8 <= n; i += 8) {
+			__m512i x = _mm512_loadu_si512((const void*) (a + i));
+			__m512i y = _mm512_loadu_si512((const void*) (b + i));
+			_mm512_store_si512((void*) (dst + i), _mm512_and_si512(x, y));
+		}
+	}
+	scalar_and_into(dst + i, a + i, b + i, n - i, false);
+}
+
+__attribute__((target("avx512f")))
+static void avx512_or_into(uint64_t *__restrict dst, const uint64_t *a, const uint64_t *b, size_t n, bool stream) {
+	size_t i = bitkernels_head(dst, n, 64);
+	scalar_or_into(dst, a, b, i, false);
+	if (stream) {
+		for (; i + 8 <= n; i += 8) {
+			__m512i x = _mm512_loadu_si512((const void*) (a + i));
+			__m512i y = _mm512_loadu_si512((const void*) (b + i));
+			_mm512_stream_si512((__m512i*) (dst + i), _mm512_or_si512(x, y));
+		}
+		_mm_sfence();
+	} else {
+		for (; i + 8 <= n; i += 8) {
+			__m512i x = _mm512_loadu_si512((const void*) (a + i));
+			__m512i y = _mm512_loadu_si512((const void*) (b + i));
+			_mm512_store_si512((void*) (dst + i), _mm512_or_si512(x, y));
+		}
+	}
+	scalar_or_into(dst + i, a + i, b + i, n - i, false);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void avx512_nibble_add_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	const __m512i m = _mm512_set1_epi8(0x0f);
+	size_t i = bitkernels_head(dst, n, 64);
+	scalar_nibble_add_to(dst, src, i);
+	for (; i + 8 <= n; i += 8) {
+		__m512i a = _mm512_load_si512((const void*) (dst + i));
+		__m512i b = _mm512_loadu_si512((const void*) (src + i));
+		__m512i lo = _mm512_min_epu8(_mm512_add_epi8(_mm512_and_si512(a, m), _mm512_and_si512(b, m)), m);
+		__m512i hi = _mm512_min_epu8(_mm512_add_epi8(_mm512_and_si512(_mm512_srli_epi16(a, 4), m),
+					_mm512_and_si512(_mm512_srli_epi16(b, 4), m)), m);
+		_mm512_store_si512((void*) (dst + i), _mm512_or_si512(lo, _mm512_slli_epi16(hi, 4)));
+	}
+	scalar_nibble_add_to(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void avx512_nibble_min_to(uint64_t *__restrict dst, const uint64_t *__restrict src, size_t n) {
+	const __m512i m = _mm512_set1_epi8(0x0f);
+	size_t i = bitkernels_head(dst, n, 64);
+	scalar_nibble_min_to(dst, src, i);
+	for (; i + 8 <= n; i += 8) {
+		__m512i a = _mm512_load_si512((const void*) (dst + i));
+		__m512i b = _mm512_loadu_si512((const void*) (src + i));
+		__m512i lo = _mm512_min_epu8(_mm512_and_si512(a, m), _mm512_and_si512(b, m));
+		__m512i hi = _mm512_min_epu8(_mm512_andnot_si512(m, a), _mm512_andnot_si512(m, b));
+		_mm512_store_si512((void*) (dst + i), _mm512_or_si512(lo, hi));
+	}
+	scalar_nibble_min_to(dst + i, src + i, n - i);
+}
+
+/* Same nibble lookup as AVX2, byte shuffles need AVX-512BW. */
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i avx512_popcount_bytes(__m512i v) {
+	const __m512i lookup = _mm512_broadcast_i32x4(_mm_setr_epi8(
+			0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+	const __m512i low = _mm512_set1_epi8(0x0f);
+	__m512i lo = _mm512_shuffle_epi8(lookup, _mm512_and_si512(v, low));
+	__m512i hi = _mm512_shuffle_epi8(lookup, _mm512_and_si512(_mm512_srli_epi16(v, 4), low));
+	return _mm512_sad_epu8(_mm512_add_epi8(lo, hi), _mm512_setzero_si512());
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t avx512_popcount(const uint64_t *a, size_t n) {
+	size_t i = 0;
+	__m512i acc = _mm512_setzero_si512();
+	for (; i + 8 <= n; i += 8)
+		acc = _mm512_add_epi64(acc, avx512_popcount_bytes(_mm512_loadu_si512((const void*) (a + i))));
+	return _mm512_reduce_add_epi64(acc) + scalar_popcount(a + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void avx512_popcount_pair(const uint64_t *a, const uint64_t *b, size_t n, uint64_t counts[3]) {
+	size_t i = 0;
+	__m512i ca = _mm512_setzero_si512(), cb = _mm512_setzero_si512(), cor = _mm512_setzero_si512();
+	for (; i + 8 <= n; i += 8) {
+		__m512i va = _mm512_loadu_si512((const void*) (a + i));
+		__m512i vb = _mm512_loadu_si512((const void*) (b + i));
+		ca = _mm512_add_epi64(ca, avx512_popcount_bytes(va));
+		cb = _mm512_add_epi64(cb, avx512_popcount_bytes(vb));
+		cor = _mm512_add_epi64(cor, avx512_popcount_bytes(_mm512_or_si512(va, vb)));
+	}
+	counts[0] += _mm512_reduce_add_epi64(ca);
+	counts[1] += _mm512_reduce_add_epi64(cb);
+	counts[2] += _mm512_reduce_add_epi64(cor);
+	scalar_popcount_pair(a + i, b + i, n - i, counts);
+}
+
+#pragma GCC diagnostic pop
+
+#endif /* BITKERNELS_X86 */
+
+static const BitKernels kernels_scalar = {
+	"scalar", scalar_and_to, scalar_or_to, scalar_or_to_changed,
+	scalar_and_into, scalar_or_into, scalar_nibble_add_to, scalar_nibble_min_to,
+	scalar_popcount, scalar_popcount_pair
+};
+
+#ifdef BITKERNELS_X86
+static const BitKernels kernels_sse2 = {
+	"sse2", sse2_and_to, sse2_or_to, sse2_or_to_changed,
+	sse2_and_into, sse2_or_into, sse2_nibble_add_to, sse2_nibble_min_to,
+	sse2_popcount, sse2_popcount_pair
+};
+static const BitKernels kernels_avx2 = {
+	"avx2", avx2_and_to, avx2_or_to, avx2_or_to_changed,
+	avx2_and_into, avx2_or_into, avx2_nibble_add_to, avx2_nibble_min_to,
+	avx2_popcount, avx2_popcount_pair
+};
+static const BitKernels kernels_avx512 = {
+	"avx512", avx512_and_to, avx512_or_to, avx512_or_to_changed,
+	avx512_and_into, avx512_or_into, avx512_nibble_add_to, avx512_nibble_min_to,
+	avx512_popcount, avx512_popcount_pair
+};
+#endif
+
+const char* bitkernels_names[] = { "scalar", "sse2", "avx2", "avx512", NULL };
+
+const BitKernels* bitkernels_find(const char *name) {
+	if (!strcmp(name, "scalar")) return &kernels_scalar;
+#ifdef BITKERNELS_X86
+	__builtin_cpu_init();
+	if (!strcmp(name, "sse2") && __builtin_cpu_supports("sse2")) return &kernels_sse2;
+	if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) return &kernels_avx2;
+	if (!strcmp(name, "avx512") && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		return &kernels_avx512;
+#endif
+	return NULL;
+}
+
+/* Pick the widest supported kernels. */
+static const BitKernels* bitkernels_detect(void) {
+	const BitKernels *k = NULL;
+	for (unsigned i = 0; bitkernels_names[i]; i++) {
+		const BitKernels *candidate = bitkernels_find(bitkernels_names[i]);
+		if (candidate) k = candidate;
+	}
+	return k;
+}
+
+size_t bitkernels_cache_size(void) {
+	static size_t size = 0;
+	size_t s = __atomic_load_n(&size, __ATOMIC_RELAXED);
+	if (!s) {
+		long bytes = 0;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+		bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+		if (bytes <= 0)
+			bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+		s = (bytes > 0) ? bytes : BITKERNELS_CACHE_SIZE;
+		__atomic_store_n(&size, s, __ATOMIC_RELAXED);
+	}
+	return s;
+}
+
+/* Read by the workers of the thread pools and the concurrent writers. Threads
+ * racing on the first call detect the same kernels, any store wins. */
+static const BitKernels *active_kernels = NULL;
+
+const BitKernels* bitkernels(void) {
+	const BitKernels *k = __atomic_load_n(&active_kernels, __ATOMIC_ACQUIRE);
+	if (!k) {
+		k = bitkernels_detect();
+		__atomic_store_n(&active_kernels, k, __ATOMIC_RELEASE);
+	}
+	return k;
+}
+
+bool bitkernels_select(const char *name) {
+	const BitKernels *k = bitkernels_find(name);
+	if (!k) return false;
+	__atomic_store_n(&active_kernels, k, __ATOMIC_RELEASE);
+	return true;
+}
@@ -0,0 +1,68 @@
+/******************************************************************************
+ * Filename: bitkernels.h
+ *
+ * Created: 2026/10/16 10:12
+ *
+ ******************************************************************************/
+
+#ifndef __BITKERNELS_H__
+#define __BITKERNELS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Word array kernels used by the Bloomap set operations. Each kernel works on
+ * n 64-bit words, dst and src must not overlap.
+ *
+ * Several implementations exist (scalar, sse2, avx2, avx512), the best one
+ * supported by the CPU is selected on the first call to bitkernels(). Any
+ * alignment works, arrays aligned to 64 bytes (see BloomapArena) are the
+ * fastest. */
+struct BitKernels {
+	const char *name;
+
+	/* dst[i] &= src[i] */
+	void (*and_to)(uint64_t *dst, const uint64_t *src, size_t n);
+	/* dst[i] |= src[i] */
+	void (*or_to)(uint64_t *dst, const uint64_t *src, size_t n);
+	/* dst[i] |= src[i], returns true if any bit of dst changed. Branch-free,
+	 * the change is accumulated as (src & ~dst) and tested once at the end. */
+	bool (*or_to_changed)(uint64_t *dst, const uint64_t *src, size_t n);
+	/* dst[i] = a[i] & b[i] and dst[i] = a[i] | b[i], reading a and b (which
+	 * may be the same) once. With stream, dst is written with non-temporal
+	 * stores, past the cache: for results larger than the cache, which would
+	 * only evict the operands (see bitkernels_cache_size()). */
+	void (*and_into)(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n, bool stream);
+	void (*or_into)(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n, bool stream);
+	/* Words of sixteen 4-bit counters (see CountingBloomap): dst gets the
+	 * sum of the counters, saturated at 15, or their minimum. */
+	void (*nibble_add_to)(uint64_t *dst, const uint64_t *src, size_t n);
+	void (*nibble_min_to)(uint64_t *dst, const uint64_t *src, size_t n);
+
+	/* Number of bits set in a[] */
+	uint64_t (*popcount)(const uint64_t *a, size_t n);
+	/* Bits set in a[], b[] and a[] | b[], in one pass. counts[] receives the
+	 * three numbers in this order. */
+	void (*popcount_pair)(const uint64_t *a, const uint64_t *b, size_t n, uint64_t counts[3]);
+};
+
+/* Size of the last level cache in bytes, as reported by the system, or
+ * BITKERNELS_CACHE_SIZE if unknown. */
+#define BITKERNELS_CACHE_SIZE (8U << 20)
+size_t bitkernels_cache_size(void);
+
+/* Returns the currently active kernels. */
+const BitKernels* bitkernels(void);
+
+/* Returns kernels with given name, or NULL if unknown or not supported by
+ * this CPU. */
+const BitKernels* bitkernels_find(const char *name);
+
+/* Makes the named kernels active. Returns false (and keeps the current ones)
+ * if they are not available. Intended for benchmarks and tests. */
+bool bitkernels_select(const char *name);
+
+/* NULL terminated list of all kernel names, supported or not. */
+extern const char* bitkernels_names[];
+
+#endif
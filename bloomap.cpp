@@ -4,35 +4,81 @@
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <cmath>
 
 #include "murmur.h"
 #include "bloomap.h"
 #include "bloomapfamily.h"
-
-/* This is static vector of hash functions. There are in fact seeds for the
- * murmur hash function, and are generated in constructor randomly, as needed */
-static std::vector<uint32_t> hashfn_a;
-static std::vector<uint32_t> hashfn_b;
+#include "bitkernels.h"
+#include "threadpool.h"
 
 Bloomap::Bloomap(BloomapFamily* f, unsigned m, unsigned k, unsigned index_logsize)
 	: f(f)
 {
 	_init(k, m/k, 1, index_logsize);
+	if (f) f->addMap(this);
+	if (f && f->isTrackingChanges()) trackChanges(true);
 #ifdef DEBUG_STATS
 	resetStats();
 #endif
 }
 
 Bloomap::Bloomap(Bloomap *orig) {
-
-	_init(orig->ncomp, orig->compsize, orig->nfunc, orig->index_logsize);
-
+	/* Copy the geometry as is, _init() would round the (already rounded)
+	 * compartment size once more. */
+	f = orig->f;
+	nfunc = orig->nfunc;
+	compsize = orig->compsize;
+	compsize_shiftbits = orig->compsize_shiftbits;
+	ncomp = orig->ncomp;
+	bits_segsize = orig->bits_segsize;
+	bits_size = orig->bits_size;
+	blocked = orig->blocked;
+	nblocks = orig->nblocks;
+	index_logsize = orig->index_logsize;
+	index_size = orig->index_size;
+	hash_seeds = orig->hash_seeds;
+	own_seeds = NULL;
+	if (orig->own_seeds) {
+		own_seeds = new uint32_t[2*(ncomp*nfunc + 1)];
+		memcpy(own_seeds, orig->own_seeds, 2*(ncomp*nfunc + 1)*sizeof(uint32_t));
+		hash_seeds = own_seeds;
+	}
 	specials = orig->specials;
-	for (unsigned comp = 0; comp < ncomp; comp++) {
-		for (unsigned pos = 0; pos < orig->compsize; pos++) {
-			bits[comp*bits_segsize + pos] = orig->bits[comp*bits_segsize + pos];
+
+	packable = orig->packable;
+	purgeable = orig->purgeable;
+	packed = NULL;
+	bits = NULL;
+	snapshot = NULL;
+	mapped_bits = false;
+	copied_pages = NULL;
+	ncopied = 0;
+	external_bits = false;
+	if (orig->packed) {
+		packed = new SparseIndex(*orig->packed);
+	} else if (bits_size*sizeof(BITS_TYPE) >= BLOOMAP_SHARE_ABOVE && (!f || f->copy_on_write) && orig->share()) {
+		bits = bloomap_snapshot_map(orig->snapshot);
+		if (bits) {
+			snapshot = orig->snapshot;
+			bloomap_snapshot_ref(snapshot);
+			mapped_bits = true;
+			copied_pages = new uint64_t[(dirtyBlocks() + 63) / 64];
+			memset(copied_pages, 0, (dirtyBlocks() + 63) / 64*sizeof(uint64_t));
 		}
 	}
+	if (!packed && !bits) {
+		bits = allocBits();
+		memcpy(bits, orig->bits, bits_size*sizeof(BITS_TYPE));
+	}
+	side_index = (f && bits) ? bits + (bits_size - index_size) : NULL;
+	dirty = NULL;
+	if (f) f->addMap(this);
+	if (f && f->isTrackingChanges()) trackChanges(true);
+#ifdef DEBUG_STATS
+	real_contents = orig->real_contents;
+	resetStats();
+#endif
 }
 
 void Bloomap::_init(unsigned _ncomp, unsigned _compsize, unsigned _nfunc, unsigned _index_logsize) {
@@ -55,19 +101,30 @@ void Bloomap::_init(unsigned _ncomp, unsigned _compsize, unsigned _nfunc, unsign
 		}
 	}
 
-	/* Generate seeds for all the hash functions */
-	while (hashfn_a.size() < nfunc*ncomp) {
-		/* TODO: Possibly ensure different functions */
-		unsigned a = rand();
-		while (a == 0) a = rand();
-		hashfn_a.push_back(a);
-		hashfn_b.push_back(rand());
-	}
+	/* The hash functions are owned by the family, the map keeps a pointer to
+	 * them. splitFamily() makes a copy. */
+	assert(f);
+	assert(f->nseeds() >= nfunc*ncomp + 1);
+	hash_seeds = f->seeds();
+	own_seeds = NULL;
 
 	/* Generate compartments.*/
 	//std::cerr << "Compsize is: " << compsize << std::endl;
 	bits_segsize = (compsize / BITS_WORD);
 	//std::cerr << "Segment is: " << bits_segsize << std::endl;
+
+	/* The blocked layout uses the same amount of memory, but as a single
+	 * compartment of 64-byte blocks. An element sets all of its bits in one
+	 * block, picked by an extra hash function. */
+	blocked = f && f->layout == BloomapFamily::LAYOUT_BLOCKED;
+	nblocks = 0;
+	if (blocked) {
+		nblocks = (bits_segsize*ncomp + BLOOMAP_BLOCK_WORDS - 1) / BLOOMAP_BLOCK_WORDS;
+		nfunc = nfunc*ncomp;
+		ncomp = 1;
+		bits_segsize = nblocks*BLOOMAP_BLOCK_WORDS;
+		compsize = bits_segsize*BITS_WORD;
+	}
 	bits_size = bits_segsize*ncomp;
 
 	/* If we are in a family, append a few more bits for the side index. */
@@ -78,7 +135,23 @@ void Bloomap::_init(unsigned _ncomp, unsigned _compsize, unsigned _nfunc, unsign
 		side_index = NULL;
 	}
 
-	bits = new BITS_TYPE[bits_size];
+	/* New maps are empty, start packed if possible */
+	external_bits = false;
+	snapshot = NULL;
+	mapped_bits = false;
+	copied_pages = NULL;
+	ncopied = 0;
+	dirty = NULL;
+	packable = true;
+	purgeable = true;
+	packed = NULL;
+	bits = NULL;
+	if (canPack()) {
+		packed = new SparseIndex();
+		side_index = NULL;
+		return;
+	}
+	bits = allocBits();
 	memset(bits, 0, bits_size*sizeof(BITS_TYPE));
 
 	/* Make a pointer into the side index, just for convenience. */
@@ -89,11 +162,17 @@ void Bloomap::_init(unsigned _ncomp, unsigned _compsize, unsigned _nfunc, unsign
 }
 
 Bloomap::~Bloomap() {
-	delete[] bits;
+	if (f) f->removeMap(this);
+	delete[] own_seeds;
+	delete[] dirty;
+	delete packed;
 	/* Side index is actually inside bits, don't try to delete it! */
+	freeBits();
 }
 
 bool Bloomap::add(unsigned ele) {
+	if (f && f->concurrent) return addAtomic(ele);
+	if (copiedMost()) unshare();
 #ifdef DEBUG_STATS
 	real_contents.insert(ele);
 #endif
@@ -101,40 +180,175 @@ bool Bloomap::add(unsigned ele) {
 	if (f) {
 		last_index_hash = f->newElement(ele);
 		assert(last_index_hash < (1U << index_logsize));
-		unsigned side_i = last_index_hash / BITS_WORD;
-		side_index[side_i] |= ((BITS_TYPE) 1) << (last_index_hash % BITS_WORD );
+		orSide(last_index_hash);
 		//std::cerr << "side_index[" << side_i << "] |= " << (1 << (last_index_hash % (sizeof(BITS_TYPE)*8) )) << std::endl;
 	}
 
 	changed = false;
 	if (ele < sizeof(specials)*CHAR_BIT) {
 		SPECIALS_TYPE mask = 0x1 << ele;
-		if (specials & mask) changed = false;
-		else specials |= mask;
+		changed = !(specials & mask);
+		specials |= mask;
 		return changed;
 	}
 	/* Set appropriate bits in each container */
 	unsigned fn = 0;
 	for (unsigned comp = 0; comp < ncomp; comp++) {
 		for (unsigned i = 0; i < nfunc; i++) {
-			uint32_t h = hash(ele, fn++);
-			set(comp,h);
+			set(comp, probe(ele, fn++));
 		}
 	}
+	if (packed && packed->cardinality() > BLOOMAP_UNPACK_ABOVE*bits_size)
+		unpack();
 	return changed;
 }
 
+bool Bloomap::addAtomic(unsigned ele) {
+	/* Same as add(), but other threads may be updating the same words, so
+	 * every update is an atomic OR and the changed flag is kept local.
+	 * DEBUG_STATS are not collected. Maps are never packed meanwhile. */
+	assert(!packed);
+	unsigned h = f->newElement(ele);
+	bloomap_fetch_or(&side_index[h / BITS_WORD], ((BITS_TYPE) 1) << (h % BITS_WORD));
+	touch(bits_size - index_size + h / BITS_WORD, true);
+
+	if (ele < sizeof(specials)*CHAR_BIT) {
+		SPECIALS_TYPE mask = 0x1 << ele;
+		return !(__atomic_fetch_or(&specials, mask, __ATOMIC_RELAXED) & mask);
+	}
+	BITS_TYPE diff = 0;
+	unsigned fn = 0;
+	for (unsigned comp = 0; comp < ncomp; comp++) {
+		for (unsigned i = 0; i < nfunc; i++) {
+			unsigned bit = probe(ele, fn++);
+			diff |= bloomap_fetch_or(&bits[comp*bits_segsize + bit / BITS_WORD], ((BITS_TYPE) 1) << (bit % BITS_WORD));
+			touch(comp*bits_segsize + bit / BITS_WORD, true);
+		}
+	}
+	return diff != 0;
+}
+
+bool Bloomap::addBatch(const uint32_t* ele, size_t n) {
+	const bool atomic = f && f->concurrent;
+	bool batch_changed = false;
+	if (!atomic && copiedMost()) unshare();
+	/* Packed maps take the elements one by one, until they are unpacked */
+	while (packed && n) {
+		batch_changed |= add(*ele++);
+		n--;
+	}
+	const unsigned nhash = ncomp*nfunc;
+	unsigned hashes[BLOOMAP_BATCH];
+	uint32_t regular[BLOOMAP_BATCH];
+	std::vector<unsigned> pos(nhash*BLOOMAP_BATCH);
+
+	for (size_t start = 0; start < n; start += BLOOMAP_BATCH) {
+		const uint32_t* e = ele + start;
+		unsigned len = (n - start < BLOOMAP_BATCH) ? n - start : BLOOMAP_BATCH;
+#ifdef DEBUG_STATS
+		if (!atomic) real_contents.insert(e, e + len);
+#endif
+		/* Register the whole block in the family, then update the side
+		 * index, merging updates of the same word. */
+		if (f) {
+			f->newElements(e, len, hashes);
+			unsigned side_i = hashes[0] / BITS_WORD;
+			BITS_TYPE side_mask = 0;
+			for (unsigned j = 0; j < len; j++) {
+				if (hashes[j] / BITS_WORD != side_i) {
+					orWord(side_index[side_i], side_mask, atomic);
+					touch(bits_size - index_size + side_i, atomic);
+					side_i = hashes[j] / BITS_WORD;
+					side_mask = 0;
+				}
+				side_mask |= ((BITS_TYPE) 1) << (hashes[j] % BITS_WORD);
+			}
+			orWord(side_index[side_i], side_mask, atomic);
+			touch(bits_size - index_size + side_i, atomic);
+		}
+
+		/* Special elements go aside, the rest is hashed up front. */
+		unsigned nregular = 0;
+		for (unsigned j = 0; j < len; j++) {
+			if (e[j] < sizeof(specials)*CHAR_BIT) {
+				SPECIALS_TYPE mask = 0x1 << e[j];
+				SPECIALS_TYPE old;
+				if (atomic) {
+					old = __atomic_fetch_or(&specials, mask, __ATOMIC_RELAXED);
+				} else {
+					old = specials;
+					specials |= mask;
+				}
+				if (!(old & mask)) batch_changed = true;
+			} else {
+				regular[nregular++] = e[j];
+			}
+		}
+		for (unsigned fn = 0; fn < nhash; fn++) {
+			unsigned* p = &pos[fn*BLOOMAP_BATCH];
+			for (unsigned j = 0; j < nregular; j++)
+				p[j] = probe(regular[j], fn);
+		}
+
+		/* Set the bits compartment by compartment, prefetching the words
+		 * a few elements ahead. */
+		BITS_TYPE diff = 0;
+		for (unsigned fn = 0; fn < nhash; fn++) {
+			const unsigned* p = &pos[fn*BLOOMAP_BATCH];
+			BITS_TYPE* comp_bits = bits + (fn / nfunc)*bits_segsize;
+			for (unsigned j = 0; j < nregular && j < BLOOMAP_PREFETCH_DIST; j++)
+				__builtin_prefetch(comp_bits + p[j] / BITS_WORD, 1);
+			for (unsigned j = 0; j < nregular; j++) {
+				if (j + BLOOMAP_PREFETCH_DIST < nregular)
+					__builtin_prefetch(comp_bits + p[j + BLOOMAP_PREFETCH_DIST] / BITS_WORD, 1);
+				diff |= orWord(comp_bits[p[j] / BITS_WORD], ((BITS_TYPE) 1) << (p[j] % BITS_WORD), atomic);
+				touch(comp_bits - bits + p[j] / BITS_WORD, atomic);
+			}
+		}
+		if (diff) batch_changed = true;
+	}
+	return batch_changed;
+}
+
 bool Bloomap::add(Bloomap *map) {
 	changed = false;
+	if (map == this) return changed;
 	if ((specials | map->specials) != specials) changed = true;
 	specials |= map->specials;
-	for (unsigned i = 0; i < bits_size; i++) {
-		if ((bits[i] | map->bits[i]) != bits[i]) {
-			changed = true;
-			bits[i] |= map->bits[i];
+	changed |= orFrom(map);
+	return changed;
+}
+
+bool Bloomap::orFrom(Bloomap* map) {
+	/* A plain map makes the union plain, most likely */
+	if (packed && !map->packed)
+		unpack();
+	bool diff = false;
+	if (!map->packed && mapped_bits) {
+		/* The kernels write all the words, changed or not */
+		diff = unshare(map, false);
+	} else if (!map->packed) {
+		diff = bitkernels()->or_to_changed(bits, map->bits, bits_size);
+	} else if (packed) {
+		/* Bits are only added, any change shows in the count */
+		const size_t before = packed->cardinality();
+		packed->orWith(*map->packed);
+		diff = packed->cardinality() != before;
+		if (packed->cardinality() > BLOOMAP_UNPACK_ABOVE*bits_size)
+			unpack();
+	} else {
+		/* Blocks from the non-zero words of the packed one on */
+		const SparseIndex* src = map->packed;
+		BITS_TYPE buf[BLOOMAP_PACKED_BLOCK];
+		unsigned len = 0;
+		for (unsigned i = src->nextWord(0, 0); i < bits_size; i = src->nextWord(i + len, 0)) {
+			len = (bits_size - i < BLOOMAP_PACKED_BLOCK) ? bits_size - i : BLOOMAP_PACKED_BLOCK;
+			src->words(i, len, buf);
+			diff |= bitkernels()->or_to_changed(bits + i, buf, len);
 		}
 	}
-	return changed;
+	if (diff) touchAll();
+	return diff;
 }
 
 bool Bloomap::contains(unsigned ele) {
@@ -146,8 +360,7 @@ bool Bloomap::contains(unsigned ele) {
 	unsigned fn = 0;
 	for (unsigned comp = 0; comp < ncomp; comp++) {
 		for (unsigned i = 0; i < nfunc; i++) {
-			uint32_t h = hash(ele, fn++);
-			if (!get(comp,h)) {
+			if (!get(comp, probe(ele, fn++))) {
 				ret = false;
 				goto stat_and_ret;
 			}
@@ -162,14 +375,224 @@ bool Bloomap::contains(unsigned ele) {
 	return ret;
 }
 
+void Bloomap::containsBatch(const uint32_t* keys, size_t n, uint64_t* result_bitmask, unsigned prefetch_dist) {
+	memset(result_bitmask, 0, ((n + 63) / 64)*sizeof(uint64_t));
+	for (size_t start = 0; start < n; start += BLOOMAP_BATCH) {
+		unsigned len = (n - start < BLOOMAP_BATCH) ? n - start : BLOOMAP_BATCH;
+		containsBlock(keys + start, len, result_bitmask, start, prefetch_dist);
+	}
+}
+
+void Bloomap::containsBlock(const uint32_t* e, unsigned len, uint64_t* result, size_t offset, unsigned prefetch_dist) {
+	const unsigned nhash = ncomp*nfunc;
+	unsigned alive[BLOOMAP_BATCH];
+	unsigned pos[BLOOMAP_BATCH];
+	assert(len <= BLOOMAP_BATCH);
+
+	/* Specials are answered right away. */
+	unsigned nalive = 0;
+	for (unsigned j = 0; j < len; j++) {
+		if (e[j] < sizeof(specials)*CHAR_BIT) {
+			if (specials & (0x1 << e[j]))
+				result[(offset + j) / 64] |= 1ULL << ((offset + j) % 64);
+		} else {
+			alive[nalive++] = j;
+		}
+	}
+
+	/* Probe one compartment at a time for all the keys still alive,
+	 * prefetching prefetch_dist probes ahead so the misses overlap. Keys
+	 * which miss are dropped, so later compartments get cheaper. */
+	for (unsigned fn = 0; fn < nhash && nalive; fn++) {
+		if (blocked) {
+			for (unsigned a = 0; a < nalive; a++)
+				pos[a] = probe(e[alive[a]], fn);
+		} else {
+			/* Same as hash(), with the seeds kept in registers */
+			const uint32_t sa = hash_seeds[2*fn], sb = hash_seeds[2*fn+1];
+			for (unsigned a = 0; a < nalive; a++)
+				pos[a] = (e[alive[a]]*sa + sb) >> compsize_shiftbits;
+		}
+		unsigned kept = 0;
+		if (packed) {
+			/* Nothing to prefetch, the containers are small */
+			const unsigned base = (fn / nfunc)*bits_segsize;
+			for (unsigned a = 0; a < nalive; a++) {
+				unsigned h = pos[a];
+				if (packed->word(base + h / BITS_WORD) & (((BITS_TYPE) 1) << (h % BITS_WORD)))
+					alive[kept++] = alive[a];
+			}
+			nalive = kept;
+			continue;
+		}
+		const BITS_TYPE* comp_bits = bits + (fn / nfunc)*bits_segsize;
+		for (unsigned a = 0; a < nalive && a < prefetch_dist; a++)
+			__builtin_prefetch(comp_bits + pos[a] / BITS_WORD, 0);
+		for (unsigned a = 0; a < nalive; a++) {
+			if (a + prefetch_dist < nalive)
+				__builtin_prefetch(comp_bits + pos[a + prefetch_dist] / BITS_WORD, 0);
+			unsigned h = pos[a];
+			if (comp_bits[h / BITS_WORD] & (((BITS_TYPE) 1) << (h % BITS_WORD)))
+				alive[kept++] = alive[a];
+		}
+		nalive = kept;
+	}
+	for (unsigned a = 0; a < nalive; a++)
+		result[(offset + alive[a]) / 64] |= 1ULL << ((offset + alive[a]) % 64);
+#ifdef DEBUG_STATS
+	counter_query += len;
+	for (unsigned a = 0; a < nalive; a++)
+		if (!real_contents.count(e[alive[a]])) counter_fp++;
+#endif
+}
+
+/* Set in the cursor if the enumeration scans the family index linearly */
+#define BLOOMAP_ENUM_LINEAR (1ULL << 62)
+
+size_t Bloomap::enumerate(uint32_t* out, size_t cap, uint64_t& cursor) {
+	return enumeratePart(out, cap, cursor, 0, 1);
+}
+
+/* Copies the candidates in the map to out (all of them if not checked),
+ * returns how many. */
+unsigned Bloomap::checkCandidates(const uint32_t* cand, unsigned ncand, uint32_t* out, bool check) {
+	if (!check) {
+		memcpy(out, cand, ncand*sizeof(uint32_t));
+		return ncand;
+	}
+	uint64_t hits[BLOOMAP_BATCH / 64];
+	unsigned n = 0;
+	memset(hits, 0, sizeof(hits));
+	containsBlock(cand, ncand, hits, 0, BLOOMAP_PREFETCH_DIST);
+	for (unsigned i = 0; i < BLOOMAP_BATCH / 64; i++)
+		for (uint64_t w = hits[i]; w; w &= w - 1)
+			out[n++] = cand[i*64 + __builtin_ctzll(w)];
+	return n;
+}
+
+size_t Bloomap::enumeratePart(uint32_t* out, size_t cap, uint64_t& cursor, unsigned part, unsigned nparts,
+		const BITS_TYPE* candidates) {
+	if (!f || cursor == BLOOMAP_ENUM_END) {
+		cursor = BLOOMAP_ENUM_END;
+		return 0;
+	}
+	if (!cap) return 0;
+	/* NULL for the side index of a packed map */
+	const BITS_TYPE* side = candidates ? candidates : side_index;
+	const unsigned stride = 1U << index_logsize;
+	uint32_t cand[BLOOMAP_BATCH];
+	unsigned ncand = 0;
+	size_t n = 0;
+	size_t limit = (cap < BLOOMAP_BATCH) ? cap : BLOOMAP_BATCH;
+
+	/* The candidates are the family index words whose hash is set in the
+	 * side index. Either walk the words of each hash in the side index
+	 * (strided, cheap for small maps), or scan the whole family index and
+	 * test the side index for each word (linear, cheap for sparse indices
+	 * and maps with most of the hashes set). The choice is made once and
+	 * kept in the cursor. */
+	bool linear;
+	if (cursor == 0) {
+		uint64_t hashes = side ? bitkernels()->popcount(side, index_size) : countRange(bits_size - index_size, index_size);
+		uint64_t per_hash = (f->index_words >> index_logsize) + 1;
+		linear = f->indexScanCost() < hashes*per_hash;
+	} else {
+		linear = cursor & BLOOMAP_ENUM_LINEAR;
+	}
+	/* The part is a range of the index words (linear), or of the side
+	 * index words (strided). */
+	const unsigned ip_lo = (uint64_t) f->index_words*part/nparts;
+	const unsigned ip_hi = (uint64_t) f->index_words*(part + 1)/nparts;
+	const unsigned side_lo = (uint64_t) index_size*part/nparts;
+	const unsigned side_hi = (uint64_t) index_size*(part + 1)/nparts;
+
+	/* Current word of the index, and the position in the side index */
+	unsigned ip = f->index_words;
+	uint64_t word = 0;
+	unsigned side_i = side_lo;
+	BITS_TYPE side_word = (side_lo < side_hi) ? sideWord(side, side_lo) : 0;
+	if (cursor != 0) {
+		/* The cursor is one past the last candidate checked */
+		uint32_t last = cursor - 1;
+		unsigned h = (last >> 6) & (stride - 1);
+		ip = last >> 6;
+		if (!linear || (sideWord(side, h / BITS_WORD) & (((BITS_TYPE) 1) << (h % BITS_WORD))))
+			word = f->indexWord(ip) & (((last & 63) == 63) ? 0 : ~0ULL << ((last & 63) + 1));
+		side_i = h / BITS_WORD;
+		side_word = sideWord(side, side_i) & ~((~((BITS_TYPE) 0)) >> (BITS_WORD - 1 - h % BITS_WORD));
+	} else if (linear) {
+		ip = f->nextIndexWord(ip_lo, 0);
+		unsigned h = ip & (stride - 1);
+		if (ip < ip_hi && (sideWord(side, h / BITS_WORD) & (((BITS_TYPE) 1) << (h % BITS_WORD))))
+			word = f->indexWord(ip);
+	}
+
+	while (1) {
+		/* Candidates of the current word, checked in batches of up to
+		 * BLOOMAP_BATCH, never more than there is room for in out[]. */
+		while (word) {
+			cand[ncand++] = (ip << 6) | __builtin_ctzll(word);
+			word &= word - 1;
+			if (ncand < limit) continue;
+
+			n += checkCandidates(cand, ncand, out + n, !candidates);
+			if (n == cap) {
+				cursor = ((uint64_t) cand[ncand-1] + 1) | (linear ? BLOOMAP_ENUM_LINEAR : 0);
+				return n;
+			}
+			ncand = 0;
+			limit = (cap - n < BLOOMAP_BATCH) ? cap - n : BLOOMAP_BATCH;
+		}
+
+		/* Next word */
+		if (linear) {
+			ip = f->nextIndexWord(ip + 1, 0);
+			if (ip >= ip_hi) break;
+			unsigned h = ip & (stride - 1);
+			if (sideWord(side, h / BITS_WORD) & (((BITS_TYPE) 1) << (h % BITS_WORD)))
+				word = f->indexWord(ip);
+			continue;
+		}
+		if (ip < f->index_words)
+			ip = f->nextIndexWord(ip + stride);
+		if (ip >= f->index_words) {
+			/* Done with this hash, take the next one from the side index */
+			while (!side_word) {
+				if (++side_i >= side_hi) goto done;
+				if (!side) {
+					/* Skip the zero words of a packed side index */
+					const unsigned base = bits_size - index_size;
+					unsigned next = packed->nextWord(base + side_i, 0);
+					if (next >= base + side_hi) goto done;
+					side_i = next - base;
+				}
+				side_word = sideWord(side, side_i);
+			}
+			unsigned h = side_i*BITS_WORD + __builtin_ctzll(side_word);
+			side_word &= side_word - 1;
+			ip = f->nextIndexWord(h);
+		}
+		word = f->indexWord(ip);
+	}
+
+done:
+	n += checkCandidates(cand, ncand, out + n, !candidates);
+	cursor = BLOOMAP_ENUM_END;
+	return n;
+}
+
 bool Bloomap::isEmpty(void) {
 	if (specials) return false;
 	for (unsigned comp = 0; comp < ncomp; comp++) {
 		bool empty = true;
-		for (unsigned i = 0; i < bits_segsize; i++) {
-			if (bits[comp*bits_segsize + i]) {
-				empty = false;
-				break;
+		if (packed) {
+			empty = packed->nextWord(comp*bits_segsize, 0) >= (comp + 1)*bits_segsize;
+		} else {
+			for (unsigned i = 0; i < bits_segsize; i++) {
+				if (bits[comp*bits_segsize + i]) {
+					empty = false;
+					break;
+				}
 			}
 		}
 		if (empty) return true;
@@ -179,27 +602,120 @@ bool Bloomap::isEmpty(void) {
 
 void Bloomap::clear(void) {
 	specials = 0;
-	memset(bits, 0, bits_size*sizeof(BITS_TYPE));
+	if (packed) {
+		delete packed;
+		packed = new SparseIndex();
+	} else {
+		/* Plain maps stay plain, they are usually filled again. Shared
+		 * bits are dropped, not copied. */
+		if (mapped_bits) {
+			freeBits();
+			bits = allocBits();
+			side_index = f ? bits + (bits_size - index_size) : NULL;
+		}
+		memset(bits, 0, bits_size*sizeof(BITS_TYPE));
+	}
+	touchAll();
 }
 
 Bloomap* Bloomap::intersect(Bloomap* map) {
+	if (map == this) return this;
 	specials &= map->specials;
-	for (unsigned i = 0; i < bits_size; i++) {
-		bits[i] &= map->bits[i];
+	/* The intersection is at most as large as a packed operand, so it is
+	 * computed from its containers, and packed. */
+	if (packed && map->packed) {
+		packed->andWith(*map->packed);
+	} else if (packed) {
+		packed->andWords(map->bits, bits_size);
+	} else if (map->packed && canPack()) {
+		SparseIndex* res = new SparseIndex(*map->packed);
+		res->andWords(bits, bits_size);
+		freeBits();
+		packed = res;
+	} else if (map->packed) {
+		unshare();
+		BITS_TYPE buf[BLOOMAP_DIRTY_WORDS];
+		for (unsigned i = 0; i < bits_size; i += BLOOMAP_DIRTY_WORDS) {
+			unsigned len = (bits_size - i < BLOOMAP_DIRTY_WORDS) ? bits_size - i : BLOOMAP_DIRTY_WORDS;
+			bitkernels()->and_to(bits + i, map->words(i, len, buf), len);
+		}
+	} else {
+		if (mapped_bits)
+			unshare(map, true);
+		else
+			bitkernels()->and_to(bits, map->bits, bits_size);
+		adapt();
 	}
+	touchAll();
 	return this;
 }
 
 bool Bloomap::isIntersectionEmpty(Bloomap* map) {
-	if (specials & map->specials) return false;
-	for (unsigned comp = 0; comp < ncomp; comp++) {
+	Bloomap* maps[2] = { this, map };
+	return isIntersectionEmpty(maps, 2);
+}
+
+bool Bloomap::isIntersectionEmpty(Bloomap** maps, unsigned n) {
+	assert(n);
+	SPECIALS_TYPE sp = maps[0]->specials;
+	for (unsigned j = 1; j < n; j++)
+		sp &= maps[j]->specials;
+	if (sp) return false;
+
+	/* The intersection is empty iff some compartment of it is all zero. With
+	 * a packed operand, only the blocks of its non-zero words need to be
+	 * checked. */
+	for (unsigned j = 0; j < n; j++) {
+		const SparseIndex* p = maps[j]->packed;
+		if (!p) continue;
+		const unsigned segsize = maps[0]->bits_segsize;
+		BITS_TYPE acc[BLOOMAP_PACKED_BLOCK], buf[BLOOMAP_PACKED_BLOCK];
+		for (unsigned comp = 0; comp < maps[0]->ncomp; comp++) {
+			const unsigned end = (comp + 1)*segsize;
+			bool empty = true;
+			unsigned len = 0;
+			for (unsigned i = p->nextWord(comp*segsize, 0); empty && i < end; i = p->nextWord(i + len, 0)) {
+				len = (end - i < BLOOMAP_PACKED_BLOCK) ? end - i : BLOOMAP_PACKED_BLOCK;
+				p->words(i, len, acc);
+				for (unsigned k = 0; k < n; k++) {
+					if (k == j) continue;
+					const BITS_TYPE* b = maps[k]->words(i, len, buf);
+					for (unsigned w = 0; w < len; w++)
+						acc[w] &= b[w];
+				}
+				BITS_TYPE any = 0;
+				for (unsigned w = 0; w < len; w++)
+					any |= acc[w];
+				if (any) empty = false;
+			}
+			if (empty) return true;
+		}
+		return false;
+	}
+
+	/* Walk
+	 * the compartments in blocks of a cache line, AND all the operands
+	 * together and move to the next compartment as soon as a non-zero word
+	 * shows up. */
+	const unsigned block = 64 / sizeof(BITS_TYPE);
+	const unsigned segsize = maps[0]->bits_segsize;
+	for (unsigned comp = 0; comp < maps[0]->ncomp; comp++) {
+		unsigned offset = comp*segsize;
 		bool empty = true;
-		for (unsigned i = 0; i < bits_segsize; i++) {
-		    	unsigned index = comp*bits_segsize + i;
-			if (bits[i] & map->bits[i]) {
-				empty = false;
-				break;
+		for (unsigned i = 0; empty && i < segsize; i += block) {
+			unsigned len = (segsize - i < block) ? segsize - i : block;
+			BITS_TYPE acc[block];
+			for (unsigned w = 0; w < len; w++)
+				acc[w] = maps[0]->bits[offset + i + w];
+			for (unsigned j = 1; j < n; j++) {
+				const BITS_TYPE* b = maps[j]->bits + offset + i;
+				for (unsigned w = 0; w < len; w++)
+					acc[w] &= b[w];
 			}
+			BITS_TYPE any = 0;
+			for (unsigned w = 0; w < len; w++)
+				any |= acc[w];
+			if (any) empty = false;
 		}
 		if (empty) return true;
 	}
@@ -209,36 +725,550 @@ bool Bloomap::isIntersectionEmpty(Bloomap* map) {
 Bloomap* Bloomap::or_from(Bloomap *filter) {
 	assert(this != filter);
 	specials |= filter->specials;
-	BITS_TYPE*__restrict from = filter->bits;
-	BITS_TYPE*__restrict to = bits;
 	changed = false;
-	for (unsigned i = 0; i < bits_size; i++) {
-		to[i] |= from[i];
+	if (packed || filter->packed || mapped_bits) {
+		orFrom(filter);
+		return this;
 	}
+	bitkernels()->or_to(bits, filter->bits, bits_size);
+	touchAll();
 	return this;
 }
 
-void Bloomap::purge() {
-	Bloomap orig(this);
-	clear();
-	for (BloomapIterator it = begin(this); !it.atEnd(); ++it) {
-		if (orig.contains(*it))
-			add(*it);
+/* Results which don't fit into the cache would only evict the operands */
+static inline bool bloomap_stream(unsigned words) {
+	return words*sizeof(BITS_TYPE) > bitkernels_cache_size();
+}
+
+Bloomap* Bloomap::intersectInto(Bloomap* dst, Bloomap* a, Bloomap* b) {
+	assert(a->bits_size == b->bits_size && dst->bits_size == a->bits_size);
+	if (dst == a) return a->intersect(b);
+	if (dst == b) return b->intersect(a);
+	dst->specials = a->specials & b->specials;
+	if (a->packed || b->packed) {
+		/* At most as large as a packed operand, see intersect() */
+		const Bloomap* p = a->packed ? a : b;
+		const Bloomap* q = (p == a) ? b : a;
+		SparseIndex* res = new SparseIndex(*p->packed);
+		if (q->packed)
+			res->andWith(*q->packed);
+		else
+			res->andWords(q->bits, q->bits_size);
+		dst->replaceBits(res);
+	} else {
+		dst->replaceBits(NULL);
+		bitkernels()->and_into(dst->bits, a->bits, b->bits, dst->bits_size, bloomap_stream(dst->bits_size));
+	}
+	dst->adapt();
+	dst->touchAll();
+	return dst;
+}
+
+Bloomap* Bloomap::unionInto(Bloomap* dst, Bloomap* a, Bloomap* b) {
+	assert(a->bits_size == b->bits_size && dst->bits_size == a->bits_size);
+	if (dst == a || dst == b) {
+		Bloomap* other = (dst == a) ? b : a;
+		return (other == dst) ? dst : dst->or_from(other);
+	}
+	dst->specials = a->specials | b->specials;
+	if (a->packed && b->packed) {
+		SparseIndex* res = new SparseIndex(*a->packed);
+		res->orWith(*b->packed);
+		dst->replaceBits(res);
+		dst->adapt();
+	} else {
+		/* A plain operand makes the union plain */
+		const unsigned n = dst->bits_size;
+		const bool stream = bloomap_stream(n);
+		dst->replaceBits(NULL);
+		if (!a->packed && !b->packed) {
+			bitkernels()->or_into(dst->bits, a->bits, b->bits, n, stream);
+		} else {
+			const Bloomap* p = a->packed ? b : a;
+			const Bloomap* q = a->packed ? a : b;
+			BITS_TYPE buf[BLOOMAP_PACKED_BLOCK];
+			for (unsigned i = 0; i < n; i += BLOOMAP_PACKED_BLOCK) {
+				const unsigned len = (n - i < BLOOMAP_PACKED_BLOCK) ? n - i : BLOOMAP_PACKED_BLOCK;
+				bitkernels()->or_into(dst->bits + i, p->bits + i, q->words(i, len, buf), len, stream);
+			}
+		}
+	}
+	dst->touchAll();
+	return dst;
+}
+
+Bloomap* Bloomap::andNotInto(Bloomap* dst, Bloomap* a, Bloomap* b) {
+	assert(a->f && a->f == b->f && dst->f == a->f);
+	/* Specials are exact, and not enumerated */
+	const SPECIALS_TYPE sp = a->specials & ~b->specials;
+	/* All of them first, dst may be a or b */
+	std::vector<uint32_t> ele;
+	a->enumerateAll(ele);
+	std::vector<uint64_t> in_b((ele.size() + 63) / 64);
+	if (!ele.empty())
+		b->containsBatch(&ele[0], ele.size(), &in_b[0]);
+	size_t n = 0;
+	for (size_t i = 0; i < ele.size(); i++)
+		if (!((in_b[i / 64] >> (i % 64)) & 1))
+			ele[n++] = ele[i];
+	dst->clear();
+	if (n)
+		dst->addBatch(&ele[0], n);
+	dst->specials |= sp;
+	dst->adapt();
+	return dst;
+}
+
+unsigned Bloomap::partsFor(BloomapFamily* f) {
+	/* More parts than threads, the hashes are rarely spread evenly */
+	return (f && f->pool) ? 4*f->pool->size() : 1;
+}
+
+void Bloomap::runParts(BloomapFamily* f, unsigned nparts, void (*fn)(void*, unsigned), void* arg) {
+	if (f && f->pool) {
+		f->pool->run(nparts, fn, arg);
+		return;
+	}
+	for (unsigned part = 0; part < nparts; part++)
+		fn(arg, part);
+}
+
+void Bloomap::partTask(void* arg, unsigned part) {
+	PartTask* task = (PartTask*) arg;
+	uint32_t buf[BLOOMAP_BATCH];
+	uint64_t cursor = 0;
+	while (cursor != BLOOMAP_ENUM_END) {
+		size_t n = task->map->enumeratePart(buf, BLOOMAP_BATCH, cursor, part, task->nparts);
+		if (task->elements)
+			(*task->elements)[part].insert((*task->elements)[part].end(), buf, buf + n);
+		if (task->counts)
+			(*task->counts)[part] += n;
+		if (task->dst_bits)
+			task->map->setBits(buf, n, task->dst_bits, task->dst_specials, task->nparts > 1);
+	}
+}
+
+void Bloomap::enumerateAll(std::vector<uint32_t>& out) {
+	/* Each part fills its own vector, they are joined in order */
+	std::vector< std::vector<uint32_t> > parts;
+	PartTask task = { this, partsFor(f), &parts, NULL, NULL, NULL };
+	parts.resize(task.nparts);
+	runParts(f, task.nparts, partTask, &task);
+	size_t total = out.size();
+	for (unsigned i = 0; i < parts.size(); i++)
+		total += parts[i].size();
+	out.reserve(total);
+	for (unsigned i = 0; i < parts.size(); i++)
+		out.insert(out.end(), parts[i].begin(), parts[i].end());
+}
+
+bool Bloomap::enumerates(unsigned ele) {
+	if (!f || !f->hasElement(ele)) return false;
+	const unsigned h = (ele >> 6) & ((1U << index_logsize) - 1);
+	return ((sideWord(h / BITS_WORD) >> (h % BITS_WORD)) & 1) && contains(ele);
+}
+
+size_t Bloomap::count(void) {
+	std::vector<size_t> counts;
+	PartTask task = { this, partsFor(f), NULL, &counts, NULL, NULL };
+	counts.resize(task.nparts);
+	runParts(f, task.nparts, partTask, &task);
+	size_t total = 0;
+	for (unsigned i = 0; i < counts.size(); i++)
+		total += counts[i];
+	return total;
+}
+
+unsigned Bloomap::purge() {
+	/* The elements are enumerated from the map as it is, and their bits set
+	 * in a scratch buffer, which then replaces the bits. */
+	assert(f && purgeable);
+	BITS_TYPE* fresh = allocBits();
+	memset(fresh, 0, bits_size*sizeof(BITS_TYPE));
+	SPECIALS_TYPE fresh_specials = 0;
+	PartTask task = { this, partsFor(f), NULL, NULL, fresh, &fresh_specials };
+	runParts(f, task.nparts, partTask, &task);
+	return swapBits(fresh, fresh_specials);
+}
+
+unsigned Bloomap::swapBits(BITS_TYPE* fresh, SPECIALS_TYPE fresh_specials) {
+	unsigned before = popcount();
+	freeBits();
+	delete packed;
+	packed = NULL;
+	bits = fresh;
+	side_index = bits + (bits_size - index_size);
+	specials = fresh_specials;
+	adapt();
+	touchAll();
+	return before - popcount();
+}
+
+void Bloomap::useBits(BITS_TYPE* ext) {
+	freeBits();
+	delete packed;
+	packed = NULL;
+	bits = ext;
+	external_bits = true;
+	side_index = f ? bits + (bits_size - index_size) : NULL;
+}
+
+void Bloomap::trackChanges(bool on) {
+	delete[] dirty;
+	dirty = NULL;
+	if (on) {
+		dirty = new uint64_t[(dirtyBlocks() + 63) / 64];
+		touchAll();
+	}
+}
+
+void Bloomap::resetChanges(void) {
+	if (dirty)
+		memset(dirty, 0, (dirtyBlocks() + 63) / 64*sizeof(uint64_t));
+}
+
+void Bloomap::touchAll(void) {
+	if (snapshot) leaveSnapshot();
+	if (!dirty) return;
+	const unsigned n = dirtyBlocks();
+	memset(dirty, 0xff, n / 64*sizeof(uint64_t));
+	if (n % 64)
+		dirty[n / 64] = (1ULL << (n % 64)) - 1;
+}
+
+void Bloomap::ownBits(void) {
+	if (!external_bits) return;
+	BITS_TYPE* own = allocBits();
+	memcpy(own, bits, bits_size*sizeof(BITS_TYPE));
+	bits = own;
+	external_bits = false;
+	side_index = f ? bits + (bits_size - index_size) : NULL;
+}
+
+BITS_TYPE* Bloomap::allocBits(void) {
+	return f ? f->arena.alloc(bits_size) : bloomap_alloc_words(bits_size);
+}
+
+void Bloomap::releaseBits(BITS_TYPE* p) {
+	if (f) f->arena.release(p, bits_size);
+	else bloomap_free_words(p);
+}
+
+void Bloomap::freeBits(void) {
+	if (mapped_bits)
+		bloomap_unmap_words(bits, bits_size);
+	else if (!external_bits)
+		releaseBits(bits);
+	leaveSnapshot();
+	delete[] copied_pages;
+	copied_pages = NULL;
+	ncopied = 0;
+	mapped_bits = false;
+	external_bits = false;
+	bits = NULL;
+	side_index = NULL;
+}
+
+void Bloomap::replaceBits(SparseIndex* res) {
+	if (packed) {
+		delete packed;
+		packed = NULL;
+	} else if (res || mapped_bits || external_bits) {
+		freeBits();
+	}
+	if (res) {
+		packed = res;
+	} else if (!bits) {
+		bits = allocBits();
+		side_index = f ? bits + (bits_size - index_size) : NULL;
+	}
+}
+
+bool Bloomap::share(void) {
+	if (!snapshot)
+		snapshot = bloomap_snapshot(bits, bits_size);
+	return snapshot != NULL;
+}
+
+void Bloomap::leaveSnapshot(void) {
+	/* Several threads may be adding in the concurrent mode */
+	BloomapSnapshot* s = __atomic_exchange_n(&snapshot, (BloomapSnapshot*) NULL, __ATOMIC_RELAXED);
+	if (s) bloomap_snapshot_release(s);
+}
+
+void Bloomap::notePage(unsigned index, bool atomic) {
+	const unsigned page = index >> BLOOMAP_DIRTY_LOG;
+	const uint64_t mask = 1ULL << (page % 64);
+	if (atomic) {
+		if (bloomap_fetch_or(&copied_pages[page / 64], mask))
+			__atomic_add_fetch(&ncopied, 1, __ATOMIC_RELAXED);
+	} else if (!(copied_pages[page / 64] & mask)) {
+		copied_pages[page / 64] |= mask;
+		ncopied++;
+	}
+}
+
+bool Bloomap::unshare(const Bloomap* map, bool intersect) {
+	if (!mapped_bits) return false;
+	/* Block by block, the operation finds the copy in the cache */
+	BITS_TYPE* own = allocBits();
+	bool diff = false;
+	for (unsigned i = 0; i < bits_size; i += BLOOMAP_DIRTY_WORDS) {
+		const unsigned len = (bits_size - i < BLOOMAP_DIRTY_WORDS) ? bits_size - i : BLOOMAP_DIRTY_WORDS;
+		memcpy(own + i, bits + i, len*sizeof(BITS_TYPE));
+		if (map && intersect)
+			bitkernels()->and_to(own + i, map->bits + i, len);
+		else if (map)
+			diff |= bitkernels()->or_to_changed(own + i, map->bits + i, len);
+	}
+	BloomapSnapshot* s = snapshot;
+	snapshot = NULL;
+	freeBits();
+	bits = own;
+	side_index = f ? bits + (bits_size - index_size) : NULL;
+	/* Still the same bits, unless changed by the operation */
+	snapshot = s;
+	return diff;
+}
+
+bool Bloomap::canPack(void) const {
+	return packable && f && f->compression && !f->concurrent;
+}
+
+void Bloomap::pack(void) {
+	if (packed) return;
+	packed = new SparseIndex(bits, bits_size);
+	freeBits();
+}
+
+void Bloomap::unpack(void) {
+	if (!packed) return;
+	bits = allocBits();
+	packed->words(0, bits_size, bits);
+	delete packed;
+	packed = NULL;
+	side_index = f ? bits + (bits_size - index_size) : NULL;
+}
+
+void Bloomap::adapt(void) {
+	if (packed) {
+		if (packed->cardinality() > BLOOMAP_UNPACK_ABOVE*bits_size || !canPack())
+			unpack();
+	} else if (canPack()) {
+		/* Most maps are way over the limit, stop counting once there */
+		const unsigned chunk = 64;
+		const uint64_t limit = BLOOMAP_PACK_BELOW*bits_size;
+		uint64_t count = 0;
+		for (unsigned i = 0; count < limit && i < bits_size; i += chunk) {
+			unsigned len = (bits_size - i < chunk) ? bits_size - i : chunk;
+			count += bitkernels()->popcount(bits + i, len);
+		}
+		if (count < limit) pack();
+	}
+}
+
+const BITS_TYPE* Bloomap::words(unsigned first, unsigned len, BITS_TYPE* scratch) const {
+	if (!packed) return bits + first;
+	packed->words(first, len, scratch);
+	return scratch;
+}
+
+void Bloomap::orSide(unsigned h) {
+	const unsigned i = bits_size - index_size + h / BITS_WORD;
+	const BITS_TYPE mask = ((BITS_TYPE) 1) << (h % BITS_WORD);
+	if (packed)
+		packed->orWord(i, mask);
+	else
+		bits[i] |= mask;
+	touch(i);
+}
+
+uint64_t Bloomap::countRange(unsigned lo, unsigned len) const {
+	if (packed) return packed->cardinality(lo, lo + len);
+	return bitkernels()->popcount(bits + lo, len);
+}
+
+uint64_t Bloomap::countAnd(const Bloomap* map, unsigned lo, unsigned len) const {
+	/* Walk the blocks of a packed operand */
+	const Bloomap* a = packed ? this : map;
+	const Bloomap* b = packed ? map : this;
+	if (!a->packed) {
+		uint64_t counts[3];
+		bitkernels()->popcount_pair(bits + lo, map->bits + lo, len, counts);
+		return counts[0] + counts[1] - counts[2];
+	}
+	uint64_t n = 0;
+	BITS_TYPE x[BLOOMAP_PACKED_BLOCK], y[BLOOMAP_PACKED_BLOCK];
+	const unsigned end = lo + len;
+	unsigned part = 0;
+	for (unsigned i = a->packed->nextWord(lo, 0); i < end; i = a->packed->nextWord(i + part, 0)) {
+		part = (end - i < BLOOMAP_PACKED_BLOCK) ? end - i : BLOOMAP_PACKED_BLOCK;
+		a->packed->words(i, part, x);
+		const BITS_TYPE* m = b->words(i, part, y);
+		for (unsigned w = 0; w < part; w++)
+			n += __builtin_popcountll(x[w] & m[w]);
+	}
+	return n;
+}
+
+size_t Bloomap::memoryUsage(void) const {
+	if (packed) return packed->memoryUsage();
+	return bits_size*sizeof(BITS_TYPE);
+}
+
+/* Purging many maps at once. The candidates of all the maps are enumerated
+ * together, then checked against each map whose side index has their hash. */
+struct SweepTask {
+	Bloomap** maps;
+	unsigned n;
+	unsigned nparts;
+	/* Union of the side indices */
+	const BITS_TYPE* side;
+	/* Scratch bits for each of the maps, NULL if not purging */
+	BITS_TYPE** fresh;
+	SPECIALS_TYPE* fresh_specials;
+	/* Elements found in any of the maps, per part, if requested */
+	std::vector< std::vector<uint32_t> >* live;
+};
+
+void Bloomap::sweepTask(void* arg, unsigned part) {
+	SweepTask* task = (SweepTask*) arg;
+	uint32_t cand[BLOOMAP_BATCH];
+	uint32_t sel[BLOOMAP_BATCH];
+	unsigned sel_pos[BLOOMAP_BATCH];
+	uint32_t hit[BLOOMAP_BATCH];
+	uint64_t hits[BLOOMAP_BATCH / 64];
+	uint64_t live[BLOOMAP_BATCH / 64];
+	uint64_t cursor = 0;
+	while (cursor != BLOOMAP_ENUM_END) {
+		size_t ncand = task->maps[0]->enumeratePart(cand, BLOOMAP_BATCH, cursor, part, task->nparts, task->side);
+		memset(live, 0, sizeof(live));
+		for (unsigned m = 0; m < task->n; m++) {
+			Bloomap* map = task->maps[m];
+			unsigned nsel = 0;
+			for (size_t i = 0; i < ncand; i++) {
+				unsigned h = map->f->elementHash(cand[i]);
+				if (map->sideWord(h / BITS_WORD) & (((BITS_TYPE) 1) << (h % BITS_WORD))) {
+					sel_pos[nsel] = i;
+					sel[nsel++] = cand[i];
+				}
+			}
+			memset(hits, 0, sizeof(hits));
+			map->containsBlock(sel, nsel, hits, 0, BLOOMAP_PREFETCH_DIST);
+			unsigned nhit = 0;
+			for (unsigned i = 0; i < BLOOMAP_BATCH / 64; i++) {
+				for (uint64_t w = hits[i]; w; w &= w - 1) {
+					unsigned j = i*64 + __builtin_ctzll(w);
+					hit[nhit++] = sel[j];
+					live[sel_pos[j] / 64] |= 1ULL << (sel_pos[j] % 64);
+				}
+			}
+			if (task->fresh && task->fresh[m])
+				map->setBits(hit, nhit, task->fresh[m], &task->fresh_specials[m], task->nparts > 1);
+		}
+		if (task->live) {
+			std::vector<uint32_t>& out = (*task->live)[part];
+			for (unsigned i = 0; i < BLOOMAP_BATCH / 64; i++)
+				for (uint64_t w = live[i]; w; w &= w - 1)
+					out.push_back(cand[i*64 + __builtin_ctzll(w)]);
+		}
+	}
+}
+
+void Bloomap::sweep(Bloomap** maps, unsigned n, bool purge, unsigned* dropped,
+		std::vector< std::vector<uint32_t> >* live) {
+	if (!n) return;
+	BloomapFamily* f = maps[0]->f;
+	assert(f);
+	std::vector<BITS_TYPE> side(maps[0]->index_size, 0);
+	std::vector<BITS_TYPE> scratch(maps[0]->index_size);
+	std::vector<BITS_TYPE*> fresh(n, (BITS_TYPE*) NULL);
+	std::vector<SPECIALS_TYPE> fresh_specials(n, 0);
+	for (unsigned m = 0; m < n; m++) {
+		assert(maps[m]->f == f);
+		const BITS_TYPE* map_side = maps[m]->words(maps[m]->bits_size - side.size(), side.size(), &scratch[0]);
+		for (unsigned i = 0; i < side.size(); i++)
+			side[i] |= map_side[i];
+		if (purge && maps[m]->purgeable) {
+			fresh[m] = maps[m]->allocBits();
+			memset(fresh[m], 0, maps[m]->bits_size*sizeof(BITS_TYPE));
+		}
+	}
+
+	SweepTask task = { maps, n, partsFor(f), &side[0], purge ? &fresh[0] : NULL, &fresh_specials[0], live };
+	if (live) live->assign(task.nparts, std::vector<uint32_t>());
+	runParts(f, task.nparts, sweepTask, &task);
+
+	for (unsigned m = 0; purge && m < n; m++) {
+		/* The others still tell which elements are live */
+		unsigned d = fresh[m] ? maps[m]->swapBits(fresh[m], fresh_specials[m]) : 0;
+		if (dropped) dropped[m] = d;
+	}
+}
+
+void Bloomap::purge(Bloomap** maps, unsigned n, unsigned* dropped) {
+	sweep(maps, n, true, dropped, NULL);
+}
+
+void Bloomap::setBits(const uint32_t* ele, size_t n, BITS_TYPE* dst, SPECIALS_TYPE* dst_specials, bool atomic) {
+	/* Same bits as add(), but the family index is left alone */
+	const BITS_TYPE one = 1;
+	BITS_TYPE* dst_side = dst + (bits_size - index_size);
+	for (size_t j = 0; j < n; j++) {
+		unsigned e = ele[j];
+		unsigned h = f->elementHash(e);
+		orWord(dst_side[h / BITS_WORD], one << (h % BITS_WORD), atomic);
+		if (e < sizeof(specials)*CHAR_BIT) {
+			SPECIALS_TYPE mask = 0x1 << e;
+			if (atomic) __atomic_fetch_or(dst_specials, mask, __ATOMIC_RELAXED);
+			else *dst_specials |= mask;
+			continue;
+		}
+		unsigned fn = 0;
+		for (unsigned comp = 0; comp < ncomp; comp++) {
+			for (unsigned i = 0; i < nfunc; i++) {
+				unsigned bit = probe(e, fn++);
+				orWord(dst[comp*bits_segsize + bit / BITS_WORD], one << (bit % BITS_WORD), atomic);
+			}
+		}
 	}
 }
 
 void Bloomap::splitFamily(void) {
+	if (!f) return;
+	/* Keep the hash functions, the family may go away */
+	own_seeds = new uint32_t[2*(ncomp*nfunc + 1)];
+	memcpy(own_seeds, hash_seeds, 2*(ncomp*nfunc + 1)*sizeof(uint32_t));
+	hash_seeds = own_seeds;
+	f->removeMap(this);
 	f = NULL;
+	trackChanges(false);
 }
 
 unsigned Bloomap::hash(unsigned ele, unsigned i) {
 	//unsigned p = 767461883;
-	uint32_t h = (ele*hashfn_a[i] + hashfn_b[i]);
+	uint32_t h = (ele*hash_seeds[2*i] + hash_seeds[2*i+1]);
 	h >>= compsize_shiftbits;
 	return h;
 	//return MurmurHash1(ele, hash_functions[i]) % compsize;
 }
 
+void Bloomap::seeds(unsigned i, uint32_t* a, uint32_t* b) {
+	*a = hash_seeds[2*i];
+	*b = hash_seeds[2*i+1];
+}
+
+unsigned Bloomap::probe(unsigned ele, unsigned i) {
+	if (!blocked) return hash(ele, i);
+	/* Pick the block by the upper bits of the extra hash function, then
+	 * a bit inside it with the function i. */
+	unsigned fb = ncomp*nfunc;
+	uint32_t hb = ele*hash_seeds[2*fb] + hash_seeds[2*fb+1];
+	unsigned block = ((uint64_t) hb * nblocks) >> 32;
+	uint32_t h = (ele*hash_seeds[2*i] + hash_seeds[2*i+1]) >> (32 - BLOOMAP_BLOCK_SHIFT);
+	return block*BLOOMAP_BLOCK_WORDS*BITS_WORD + h;
+}
+
 #ifdef DEBUG_STATS
 void Bloomap::resetStats(void) {
 	counter_fp = 0;
@@ -261,22 +1291,80 @@ void Bloomap::dump(void) {
 }
 
 void Bloomap::dumpStats(void) {
+	unsigned pop = popcount();
 	std::cerr << "  Map compartments:       " << ncomp << std::endl;
 	std::cerr << "  Map size (in bits):     " << mapsize() << std::endl;
-	std::cerr << "  Map popcount (in bits): " << popcount()<< std::endl;
-	std::cerr << "  Map popcount (ratio):   " << popcount()*1.0/mapsize() << std::endl;
+	std::cerr << "  Map popcount (in bits): " << pop << std::endl;
+	std::cerr << "  Map popcount (ratio):   " << pop*1.0/mapsize() << std::endl;
+	std::cerr << "  Estimated elements:     " << estimateCardinality() << std::endl;
 	std::cerr << "  Empty:                  " << (isEmpty() ? "yes" : "no") << std::endl;
 
 }
 
 unsigned Bloomap::popcount(void) {
 	unsigned count = __builtin_popcount(specials);
+	count += countRange(0, ncomp*bits_segsize);
+	return count;
+}
+
+/* The usual fill ratio estimator, n = -(m/k) ln(1 - X/m), applied to a single
+ * compartment of m = compsize bits with X bits set. */
+double Bloomap::fillEstimate(uint64_t set_bits) {
+	double x = set_bits;
+	/* A full compartment says nothing, except there is a lot of elements. */
+	if (x >= compsize) x = compsize - 0.5;
+	return -(1.0*compsize / nfunc) * log(1.0 - x / compsize);
+}
+
+double Bloomap::estimateCardinality(void) {
+	double est = 0;
+	for (unsigned comp = 0; comp < ncomp; comp++)
+		est += fillEstimate(countRange(comp*bits_segsize, bits_segsize));
+	return est / ncomp + __builtin_popcount(specials);
+}
+
+double Bloomap::falsePositiveRate(void) {
+	double rate = 1.0;
+	for (unsigned comp = 0; comp < ncomp; comp++)
+		rate *= pow((double) countRange(comp*bits_segsize, bits_segsize) / compsize, nfunc);
+	return rate;
+}
+
+/* Estimates of this map, the other one and their union, all from one pass
+ * over both maps. Specials are not included. */
+void Bloomap::estimatePair(Bloomap* map, double est[3]) {
+	est[0] = est[1] = est[2] = 0;
 	for (unsigned comp = 0; comp < ncomp; comp++) {
-		for (unsigned i = 0; i < compsize; i++) {
-			if (get(comp,i)) count++;
+		uint64_t counts[3] = { 0, 0, 0 };
+		unsigned offset = comp*bits_segsize;
+		if (packed || map->packed) {
+			counts[0] = countRange(offset, bits_segsize);
+			counts[1] = map->countRange(offset, bits_segsize);
+			counts[2] = counts[0] + counts[1] - countAnd(map, offset, bits_segsize);
+		} else {
+			bitkernels()->popcount_pair(bits + offset, map->bits + offset, bits_segsize, counts);
 		}
+		for (unsigned i = 0; i < 3; i++)
+			est[i] += fillEstimate(counts[i]);
 	}
-	return count;
+	for (unsigned i = 0; i < 3; i++)
+		est[i] /= ncomp;
+}
+
+double Bloomap::estimateUnionCardinality(Bloomap* map) {
+	double est[3];
+	estimatePair(map, est);
+	return est[2] + __builtin_popcount(specials | map->specials);
+}
+
+double Bloomap::estimateIntersectionCardinality(Bloomap* map) {
+	/* |A n B| = |A| + |B| - |A u B|, which is a lot more precise than
+	 * estimating from the bits of A & B. */
+	double est[3];
+	estimatePair(map, est);
+	double inter = est[0] + est[1] - est[2];
+	if (inter < 0) inter = 0;
+	return inter + __builtin_popcount(specials & map->specials);
 }
 
 unsigned Bloomap::mapsize(void) {
@@ -295,7 +1383,7 @@ bool Bloomap::operator==(const Bloomap* rhs) {
 	/* If this passes, let's check the bits */
 	if (ncomp != rhs->ncomp || compsize != rhs->compsize || nfunc != rhs->nfunc) return false;
 	for (unsigned i = 0; i < bits_size; i++) {
-		if (rhs->bits[i] != bits[i]) return false;
+		if (rhs->word(i) != word(i)) return false;
 	}
 	return true;
 }
@@ -330,9 +1418,13 @@ void BloomapIterator::_init(Bloomap *_map, bool end) {
 	flagAtEnd = end;
 	current_hash = 0;
 	if (!flagAtEnd) {
-		if (map->side_index[0] & 1)
+		if (map->sideWord(0) & 1)
 			chi = map->family()->begin(current_hash);
-		else findNextHash();
+		else if (!findNextHash())
+			return;
+		/* The first candidate has to be checked as well */
+		if (!isValid() || !map->contains(*chi))
+			operator++();
 	}
 }
 
@@ -359,26 +1451,20 @@ bool BloomapIterator::advanceHashIterator(void) {
 }
 
 bool BloomapIterator::findNextHash(void) {
-	unsigned side_i;
-	BITS_TYPE side_mask;
-	do {
-		current_hash++;
-		side_i = current_hash / BITS_WORD;
-		//std::cerr << "Scanning hash: " << current_hash << ", index: " << side_i << std::endl;
-		if (side_i >= map->index_size) {
-			//std::cerr << "Ended: " << side_i << std::endl;
+	/* Next bit set in the side index, a word at a time */
+	unsigned next = current_hash + 1;
+	unsigned side_i = next / BITS_WORD;
+	BITS_TYPE side_word = 0;
+	if (side_i < map->index_size)
+		side_word = map->sideWord(side_i) & (~((BITS_TYPE) 0) << (next % BITS_WORD));
+	while (!side_word) {
+		if (++side_i >= map->index_size) {
 			flagAtEnd = true;
 			return false; /* There is no next hash */
 		}
-		side_mask = (((BITS_TYPE) 1) << (current_hash % BITS_WORD));
-		/* We are at the first bit, check if the byte is empty */
-		if ((side_mask == 1) && (map->side_index[side_i] == 0)) {
-			/* The -1 is here to compensate current_hash++ at the start of the loop. */
-			current_hash += sizeof(BITS_TYPE)*8-1;
-		//	std::cerr << "Skipping empty block." << std::endl;
-		}
-	} while ((map->side_index[side_i] & side_mask) == 0 );
-	//std::cerr << "Found next hash: " << current_hash << std::endl;
+		side_word = map->sideWord(side_i);
+	}
+	current_hash = side_i*BITS_WORD + __builtin_ctzll(side_word);
 	chi = map->f->begin(current_hash);
 	return true;
 }
@@ -23,6 +23,37 @@
 #define SPECIALS_TYPE uint8_t
 #define BITS_WORD (sizeof(BITS_TYPE)*8)
 
+/* Number of elements hashed at once by the batch operations, and how many
+ * probes ahead they prefetch. */
+#define BLOOMAP_BATCH 256
+#define BLOOMAP_PREFETCH_DIST 16
+
+/* Cursor value of a finished enumeration, see Bloomap::enumerate() */
+#define BLOOMAP_ENUM_END (~0ULL)
+
+/* Packed maps take about 2 bytes per set bit, plain ones 8 bytes per word.
+ * Maps are packed with fewer set bits than BLOOMAP_PACK_BELOW per word (1/64
+ * of the memory of plain bits), and unpacked with more than
+ * BLOOMAP_UNPACK_ABOVE (1/16 of it). Operations on packed maps take time by
+ * the set bits, which is about the time of the plain ones at the limit. */
+#define BLOOMAP_PACK_BELOW 0.0625
+#define BLOOMAP_UNPACK_ABOVE 0.25
+/* Words of packed maps unpacked at once by the operations */
+#define BLOOMAP_PACKED_BLOCK 256
+
+/* Clones of plain maps of at least this many bytes share the bits with the
+ * original, copy-on-write in 4KB pages (see BloomapSnapshot). Smaller ones
+ * are copied, which is cheaper than the mapping. */
+#define BLOOMAP_SHARE_ABOVE (256U << 10)
+/* A page fault costs about ten times a copy of the page. Clones copy all
+ * the shared bits at once after writing to more than this part of the
+ * pages. */
+#define BLOOMAP_SHARE_COPY_ABOVE 0.015625
+
+/* Block of the blocked layout, one cache line. */
+#define BLOOMAP_BLOCK_WORDS 8
+#define BLOOMAP_BLOCK_SHIFT 9 /* log2 of bits in a block */
+
 
 class BloomapFamily;
 class BloomapFamilyIterator;
@@ -32,6 +63,11 @@ class Bloomap {
 	    	Bloomap() {};
 	public:
 		Bloomap(BloomapFamily* f, unsigned m, unsigned k, unsigned index_logsize);
+		/* A copy of orig. Large plain maps are not copied, the clone
+		 * shares the bits of orig and copies the pages it changes, see
+		 * BLOOMAP_SHARE_ABOVE and BloomapFamily::setCopyOnWrite(). The
+		 * first clone of a map writes its bits once, clones of an
+		 * unchanged map or of its clones cost a mapping. */
 		Bloomap(Bloomap *orig);
 		~Bloomap();
 		void _init(unsigned _ncomp, unsigned _compsize, unsigned _nfunc, unsigned _index_logsize);
@@ -39,15 +75,70 @@ class Bloomap {
 		/* Most common operations */
 		bool add(unsigned ele);
 		bool add(Bloomap *map);
+		/* Same as add() for each of the elements, returns true if any of
+		 * them changed the map. */
+		bool addBatch(const uint32_t* ele, size_t n);
 		bool contains(unsigned ele);
+		/* Same as contains() for each of the keys, bit i of result_bitmask
+		 * (an array of (n+63)/64 words) is set iff keys[i] is in the map. The
+		 * probes are interleaved, prefetching prefetch_dist of them ahead. */
+		void containsBatch(const uint32_t* keys, size_t n, uint64_t* result_bitmask,
+				unsigned prefetch_dist = BLOOMAP_PREFETCH_DIST);
+		/* Writes up to cap elements of the map (including false positives)
+		 * into out, returns how many. Start with cursor = 0 and call again
+		 * until it becomes BLOOMAP_ENUM_END to get all of them. The map and
+		 * the family must not change in the meantime. Allocation free, and
+		 * much faster than BLOOMAP_FOR_EACH. */
+		size_t enumerate(uint32_t* out, size_t cap, uint64_t& cursor);
+		/* Calls fn(element) for each element of the map, same as
+		 * enumerate(). */
+		template<typename F>
+		void forEach(F fn) {
+			uint32_t buf[BLOOMAP_BATCH];
+			uint64_t cursor = 0;
+			while (cursor != BLOOMAP_ENUM_END) {
+				size_t n = enumerate(buf, BLOOMAP_BATCH, cursor);
+				for (size_t i = 0; i < n; i++)
+					fn(buf[i]);
+			}
+		}
+		/* Parallel operations, split into parts of the family index and run
+		 * on the thread pool of the family (see BloomapFamily::setThreads).
+		 * enumerateAll() appends all the elements to out, in the order of
+		 * enumerate(), and count() returns their number. */
+		void enumerateAll(std::vector<uint32_t>& out);
+		size_t count(void);
+		/* Whether the enumeration lists ele, i.e. the family index has it
+		 * and it is in the map */
+		bool enumerates(unsigned ele);
 		bool isEmpty(void);
 		bool isIntersectionEmpty(Bloomap* map);
+		/* Checks whether the intersection of n maps is empty, without
+		 * materializing it. */
+		static bool isIntersectionEmpty(Bloomap** maps, unsigned n);
 		void clear(void);
 		Bloomap* intersect(Bloomap* map);
 		Bloomap* or_from(Bloomap *filter);
+		/* Three-operand set operations: dst becomes a & b or a | b, and a
+		 * and b are left alone. The operands are read once and dst is
+		 * written once, instead of a copy followed by an in-place
+		 * operation. Results larger than the cache are written with
+		 * non-temporal stores. dst may be one of the operands. */
+		static Bloomap* intersectInto(Bloomap* dst, Bloomap* a, Bloomap* b);
+		static Bloomap* unionInto(Bloomap* dst, Bloomap* a, Bloomap* b);
+		/* dst becomes the elements of a which are not in b. Bits can't be
+		 * taken out of a bloom filter, so this enumerates a, and false
+		 * positives of b are missing from the result. Needs a family. */
+		static Bloomap* andNotInto(Bloomap* dst, Bloomap* a, Bloomap* b);
 
-		/* Purges the map according to the family records. */
-		void purge();
+		/* Purges the map according to the family records: only the bits of
+		 * the elements enumerated from it are kept. Returns the number of
+		 * bits dropped. In parallel, like enumerateAll(). */
+		unsigned purge();
+		/* Purges n maps of one family in a single pass over the family
+		 * index. dropped[i], if given, is set to the bits dropped from
+		 * maps[i]. CountingBloomaps among them are left as they are. */
+		static void purge(Bloomap** maps, unsigned n, unsigned* dropped = NULL);
 
 		/* Split this map from the family. 
 		 * Can not be reversed! */
@@ -55,6 +146,9 @@ class Bloomap {
 
 		/* Helper function to compute hash */
 		unsigned hash(unsigned ele, unsigned i);
+		/* Position of the i-th bit of ele, relative to its compartment. Same
+		 * as hash() unless the map uses the blocked layout. */
+		unsigned probe(unsigned ele, unsigned i);
 
 		BloomapFamily* family() { return f; }
 
@@ -62,16 +156,64 @@ class Bloomap {
 		bool operator==(const Bloomap* rhs);
 		bool operator!=(const Bloomap* rhs);
 
+		/* Cardinality estimates, from the fill ratio of each compartment. */
+		double estimateCardinality(void);
+		double estimateUnionCardinality(Bloomap* map);
+		double estimateIntersectionCardinality(Bloomap* map);
+		/* Expected false positive rate, from the fill ratio of each
+		 * compartment. A bit low in the blocked layout. */
+		double falsePositiveRate(void);
+
 		/* Debugging and slow stuff */
 		void dump(void);
 		void dumpStats(void);
 		unsigned popcount(void);
 		unsigned mapsize(void);
 
+		/* Maps holding few elements keep their bits packed (in a
+		 * SparseIndex), and all the operations work on them in that form.
+		 * Maps switch to plain bits as they fill up, and back once they
+		 * get sparse in intersect(), purge() and the like. See
+		 * BloomapFamily::setCompression(). */
+		bool isCompressed(void) const { return packed != NULL; }
+		/* Memory taken by the bits (the side index included), in bytes */
+		size_t memoryUsage(void) const;
+		/* The bits are a snapshot shared with clones, and unchanged */
+		bool isShared(void) const { return snapshot != NULL; }
+
 	protected:
 		unsigned nfunc, compsize, compsize_shiftbits, ncomp, bits_segsize, bits_size;
+		/* Blocked layout, see BloomapFamily::Layout */
+		bool blocked;
+		unsigned nblocks;
 		BloomapFamily *f;
+		const uint32_t* hash_seeds; /* Owned by the family, see BloomapFamily::seeds() */
+		uint32_t* own_seeds; /* Copy of them, once split from the family */
 		BITS_TYPE* bits;
+		/* The bits are not ours to free, see BloomapFamily::load() */
+		bool external_bits;
+		/* Dirty blocks of bits, NULL unless the family tracks changes (see
+		 * BloomapFamily::trackChanges()) */
+		uint64_t* dirty;
+		/* Snapshot of the bits while they are unchanged, see
+		 * Bloomap(Bloomap*). mapped_bits are a private mapping of a
+		 * snapshot. */
+		BloomapSnapshot* snapshot;
+		bool mapped_bits;
+		/* The 4KB pages of mapped bits written to (and so copied), as a
+		 * bitmap, and their number */
+		uint64_t* copied_pages;
+		unsigned ncopied;
+		/* The bits, packed. bits and side_index are NULL meanwhile. */
+		SparseIndex* packed;
+		/* May be packed at all, StaticBloomap is not */
+		bool packable;
+		/* May have its bits rebuilt by purge(), CountingBloomap may not */
+		bool purgeable;
+		/* Position in the maps of the family, see BloomapFamily::map(),
+		 * and in its file and delta log (~0U if not in them yet) */
+		unsigned slot;
+		unsigned saved_slot;
 		SPECIALS_TYPE specials;
 
 		/* Side index, only used if part of a family */
@@ -79,6 +221,128 @@ class Bloomap {
 		unsigned index_logsize;
 		unsigned index_size;
 
+		/* containsBatch() of up to BLOOMAP_BATCH keys, ORs the results into
+		 * bits offset ... offset + len - 1 of result. */
+		void containsBlock(const uint32_t* keys, unsigned len, uint64_t* result, size_t offset,
+				unsigned prefetch_dist);
+
+		/* add() for families in the concurrent mode */
+		bool addAtomic(unsigned ele);
+		/* Sets the bits of elements already in the family index (which is
+		 * left untouched) in dst, a buffer shaped like bits. Atomic updates
+		 * if several threads set bits at once. */
+		void setBits(const uint32_t* ele, size_t n, BITS_TYPE* dst, SPECIALS_TYPE* dst_specials, bool atomic);
+		/* Replaces the bits by fresh ones, returns the number of bits dropped */
+		unsigned swapBits(BITS_TYPE* fresh, SPECIALS_TYPE fresh_specials);
+		/* Uses bits stored elsewhere (which outlive the map), or copies
+		 * them back into memory of its own. */
+		void useBits(BITS_TYPE* ext);
+		void ownBits(void);
+		/* Arrays shaped like bits, aligned, from the arena of the family
+		 * while in one (see BloomapArena). freeBits() takes the bits
+		 * away, unless they are external. */
+		BITS_TYPE* allocBits(void);
+		void releaseBits(BITS_TYPE* p);
+		void freeBits(void);
+		/* Drops the bits before all of them are overwritten: the map gets
+		 * plain bits of its own, contents undefined, or takes res as its
+		 * packed bits. */
+		void replaceBits(SparseIndex* res);
+		/* Copy-on-write clones. share() makes the snapshot of the bits,
+		 * and returns false if it can't. leaveSnapshot() is called on
+		 * the first change. unshare() copies mapped bits into an array
+		 * of their own, before changing all of them. With map, the bits
+		 * are ANDed (or ORed) with it on the way, and the return value
+		 * tells whether the OR changed them. */
+		bool share(void);
+		void leaveSnapshot(void);
+		bool unshare(const Bloomap* map = NULL, bool intersect = false);
+		void notePage(unsigned index, bool atomic);
+		bool inline copiedMost(void) const {
+			return copied_pages && ncopied > BLOOMAP_SHARE_COPY_ABOVE*dirtyBlocks();
+		}
+
+		/* Switching between plain and packed bits. adapt() picks the
+		 * form by the fill, see BLOOMAP_PACK_BELOW. */
+		bool canPack(void) const;
+		void pack(void);
+		void unpack(void);
+		void adapt(void);
+		/* Word i of the bits, in either form */
+		BITS_TYPE inline word(unsigned i) const { return packed ? packed->word(i) : bits[i]; }
+		BITS_TYPE inline sideWord(unsigned i) const { return word(bits_size - index_size + i); }
+		/* Word i of side, or of the side index if it is NULL */
+		BITS_TYPE inline sideWord(const BITS_TYPE* side, unsigned i) const { return side ? side[i] : sideWord(i); }
+		/* Words first ... first + len - 1, in place, or unpacked into
+		 * scratch */
+		const BITS_TYPE* words(unsigned first, unsigned len, BITS_TYPE* scratch) const;
+		/* Sets bit h of the side index */
+		void orSide(unsigned h);
+		/* Set bits in words lo ... lo + len - 1, and in their AND with map */
+		uint64_t countRange(unsigned lo, unsigned len) const;
+		uint64_t countAnd(const Bloomap* map, unsigned lo, unsigned len) const;
+		/* ORs map into this one, returns whether it changed */
+		bool orFrom(Bloomap* map);
+
+		/* Change tracking. trackChanges(true) starts with all the blocks
+		 * dirty, the map is new to any saved state. */
+		void trackChanges(bool on);
+		void resetChanges(void);
+		unsigned dirtyBlocks(void) const { return (bits_size + BLOOMAP_DIRTY_WORDS - 1) >> BLOOMAP_DIRTY_LOG; }
+		void inline touch(unsigned index, bool atomic = false) {
+			if (dirty) bloomap_mark_dirty(dirty, index, atomic);
+			if (snapshot) leaveSnapshot();
+			if (copied_pages) notePage(index, atomic);
+		}
+		void touchAll(void);
+
+		/* enumerate() of one of nparts parts of the family index. The
+		 * parts are consecutive, and together give enumerate(). With
+		 * candidates, a side index, all the family elements of its hashes
+		 * are returned instead, without checking the map. */
+		size_t enumeratePart(uint32_t* out, size_t cap, uint64_t& cursor, unsigned part, unsigned nparts,
+				const BITS_TYPE* candidates = NULL);
+		/* Copies those of the ncand candidates which are in the map (all
+		 * of them if not checked) to out, returns how many. */
+		unsigned checkCandidates(const uint32_t* cand, unsigned ncand, uint32_t* out, bool check);
+
+		/* Parallel operations, fn(arg, part) is run for each of the parts
+		 * on the thread pool of the family. */
+		static unsigned partsFor(BloomapFamily* f);
+		static void runParts(BloomapFamily* f, unsigned nparts, void (*fn)(void*, unsigned), void* arg);
+		struct PartTask {
+			Bloomap* map;
+			unsigned nparts;
+			/* Results per part, depending on the operation */
+			std::vector< std::vector<uint32_t> >* elements;
+			std::vector<size_t>* counts;
+			/* purge() sets the bits of the elements here */
+			BITS_TYPE* dst_bits;
+			SPECIALS_TYPE* dst_specials;
+		};
+		static void partTask(void* task, unsigned part);
+		/* One pass over the family index for n maps of a family. Purges
+		 * them if requested, and collects the elements found in any of
+		 * them into live (per part). */
+		static void sweep(Bloomap** maps, unsigned n, bool purge, unsigned* dropped,
+				std::vector< std::vector<uint32_t> >* live);
+		static void sweepTask(void* task, unsigned part);
+
+		/* word |= mask, atomically if requested. Returns the bits which
+		 * were not set before. */
+		static inline BITS_TYPE orWord(BITS_TYPE& word, BITS_TYPE mask, bool atomic) {
+			if (atomic) return bloomap_fetch_or(&word, mask);
+			BITS_TYPE diff = mask & ~word;
+			word |= mask;
+			return diff;
+		}
+
+		/* Seeds of the i-th hash function */
+		void seeds(unsigned i, uint32_t* a, uint32_t* b);
+
+		double fillEstimate(uint64_t set_bits);
+		void estimatePair(Bloomap* map, double est[3]);
+
 		/* The data manipulation functions. The class-wide changed flag is
 		 * used, and has to be reset by it's user. */
 		bool changed;
@@ -87,8 +351,14 @@ class Bloomap {
 			assert(index < bits_size);
 			assert (index < ((comp+1)*bits_segsize));
 			BITS_TYPE mask = ((BITS_TYPE) 1) << (bit % BITS_WORD);
-			changed |= !(bits[index] & mask);
-			bits[index] |= mask;
+			if (packed) {
+				changed |= !(packed->word(index) & mask);
+				packed->orWord(index, mask);
+			} else {
+				changed |= !(bits[index] & mask);
+				bits[index] |= mask;
+			}
+			touch(index);
 			return changed;
 		}
 
@@ -96,8 +366,10 @@ class Bloomap {
 			unsigned index = comp*bits_segsize + bit / BITS_WORD;
 			assert(index < bits_size);
 			BITS_TYPE mask = ((BITS_TYPE) 1) << (bit % BITS_WORD);
+			if (packed) unpack();
 			changed |= bits[index] & mask;
 			bits[index] &= ~mask;
+			touch(index);
 			return changed;
 		}
 
@@ -107,10 +379,12 @@ class Bloomap {
 			assert(bit < compsize);
 			assert (index < ((comp+1)*bits_segsize));
 			BITS_TYPE mask = ((BITS_TYPE) 1) << (bit % BITS_WORD);
-			return !!(bits[index] & mask);
+			return !!(word(index) & mask);
 		}
 
 	friend class BloomapIterator;
+	friend class BloomapExpr;
+	friend class BloomapFamily;
 #ifdef DEBUG_STATS
 	protected:
 		std::set<unsigned> real_contents;
@@ -152,6 +426,6 @@ class BloomapIterator : public std::iterator<std::input_iterator_tag, unsigned >
 BloomapIterator begin(Bloomap *map);
 BloomapIterator end(Bloomap *map);
 
-#define BLOOMAP_FOR_EACH(VAR, MAP) for (BloomapIterator _bloomap_it(MAP,VAR); _bloomap_it != end(MAP); _bloomap_it++, VAR=*_bloomap_it)
+#define BLOOMAP_FOR_EACH(VAR, MAP) for (BloomapIterator _bloomap_it(MAP,VAR); _bloomap_it != end(MAP); ++_bloomap_it, VAR=*_bloomap_it)
 
 #endif
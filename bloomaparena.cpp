@@ -0,0 +1,108 @@
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bloomaparena.h"
+
+uint64_t* bloomap_alloc_words(size_t n) {
+	void* mem = NULL;
+	/* Whole cache lines, so two arrays never share one */
+	size_t bytes = (n*sizeof(uint64_t) + BLOOMAP_ALIGN - 1) / BLOOMAP_ALIGN * BLOOMAP_ALIGN;
+	if (posix_memalign(&mem, BLOOMAP_ALIGN, bytes ? bytes : BLOOMAP_ALIGN))
+		throw std::bad_alloc();
+	return (uint64_t*) mem;
+}
+
+BloomapArena::BloomapArena(size_t limit)
+	: pooled_bytes(0), max_bytes(limit)
+{
+}
+
+BloomapArena::~BloomapArena() {
+	setLimit(0);
+}
+
+uint64_t* BloomapArena::alloc(size_t n) {
+	std::map< size_t, std::vector<uint64_t*> >::iterator it = free_lists.find(sizeClass(n));
+	if (it == free_lists.end() || it->second.empty())
+		return bloomap_alloc_words(n);
+	uint64_t* p = it->second.back();
+	it->second.pop_back();
+	pooled_bytes -= it->first*BLOOMAP_ALIGN;
+	return p;
+}
+
+void BloomapArena::release(uint64_t* p, size_t n) {
+	if (!p) return;
+	const size_t cls = sizeClass(n);
+	if (pooled_bytes + cls*BLOOMAP_ALIGN > max_bytes) {
+		bloomap_free_words(p);
+		return;
+	}
+	free_lists[cls].push_back(p);
+	pooled_bytes += cls*BLOOMAP_ALIGN;
+}
+
+void BloomapArena::setLimit(size_t bytes) {
+	max_bytes = bytes;
+	/* Free the largest arrays first, the small ones are cheap to keep */
+	while (pooled_bytes > max_bytes) {
+		std::map< size_t, std::vector<uint64_t*> >::iterator it = --free_lists.end();
+		while (!it->second.empty() && pooled_bytes > max_bytes) {
+			bloomap_free_words(it->second.back());
+			it->second.pop_back();
+			pooled_bytes -= it->first*BLOOMAP_ALIGN;
+		}
+		if (it->second.empty())
+			free_lists.erase(it);
+	}
+}
+
+BloomapSnapshot* bloomap_snapshot(const uint64_t* words, size_t n) {
+#ifdef MFD_CLOEXEC
+	const size_t bytes = n*sizeof(uint64_t);
+	int fd = memfd_create("bloomap", MFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	const char* p = (const char*) words;
+	size_t done = 0;
+	while (done < bytes) {
+		ssize_t w = write(fd, p + done, bytes - done);
+		if (w <= 0) {
+			close(fd);
+			return NULL;
+		}
+		done += w;
+	}
+	BloomapSnapshot* s = new BloomapSnapshot;
+	s->fd = fd;
+	s->bytes = bytes;
+	s->refs = 1;
+	return s;
+#else
+	(void) words;
+	(void) n;
+	return NULL;
+#endif
+}
+
+void bloomap_snapshot_ref(BloomapSnapshot* s) {
+	__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+}
+
+void bloomap_snapshot_release(BloomapSnapshot* s) {
+	if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	/* The pages stay while mapped */
+	close(s->fd);
+	delete s;
+}
+
+uint64_t* bloomap_snapshot_map(const BloomapSnapshot* s) {
+	void* p = mmap(NULL, s->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, s->fd, 0);
+	return (p == MAP_FAILED) ? NULL : (uint64_t*) p;
+}
+
+void bloomap_unmap_words(uint64_t* p, size_t n) {
+	munmap(p, n*sizeof(uint64_t));
+}
@@ -0,0 +1,89 @@
+/******************************************************************************
+ * Filename: bloomaparena.h
+ *
+ * Created: 2026/10/17 09:40
+ *
+ ******************************************************************************/
+
+#ifndef __BLOOMAPARENA_H__
+#define __BLOOMAPARENA_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <map>
+#include <vector>
+
+/* Bit arrays are aligned to a cache line, and their sizes rounded up to
+ * classes of a cache line. */
+#define BLOOMAP_ALIGN 64
+/* Bytes of free arrays an arena keeps for reuse by default */
+#define BLOOMAP_ARENA_POOL (64UL << 20)
+
+/* An array of n words, aligned to BLOOMAP_ALIGN and uninitialized. Throws
+ * std::bad_alloc. Free it with bloomap_free_words(). */
+uint64_t* bloomap_alloc_words(size_t n);
+static inline void bloomap_free_words(uint64_t* p) { free(p); }
+
+/* Bit arrays shared copy-on-write by the clones of a map (see
+ * Bloomap::Bloomap(Bloomap*)). The bits are written once into an in-memory
+ * file, which the clones then map privately: they all read the same pages,
+ * and the kernel copies the 4KB pages a clone writes to, for that clone
+ * only. Maps hold a reference while their bits are unchanged, and further
+ * clones map the same file; the pages live as long as they are mapped.
+ * Linux only (memfd), bloomap_snapshot() returns NULL elsewhere, and when
+ * out of file descriptors. */
+struct BloomapSnapshot {
+	int fd;
+	size_t bytes;
+	unsigned refs;
+};
+
+/* A snapshot of n words, with a single reference */
+BloomapSnapshot* bloomap_snapshot(const uint64_t* words, size_t n);
+void bloomap_snapshot_ref(BloomapSnapshot* s);
+void bloomap_snapshot_release(BloomapSnapshot* s);
+/* A private mapping of the words of a snapshot, or NULL. Unmap it with
+ * bloomap_unmap_words(). */
+uint64_t* bloomap_snapshot_map(const BloomapSnapshot* s);
+void bloomap_unmap_words(uint64_t* p, size_t n);
+
+/* Allocator of the bit arrays of the maps of a family. Released arrays are
+ * kept in a free list per size class, up to limit() bytes in total, and
+ * alloc() hands them out again before asking the system. Queries creating
+ * and deleting many temporary maps thus reuse the same few arrays, whose
+ * pages are already mapped and cached.
+ *
+ * The arrays are allocated one by one with bloomap_alloc_words(), so any of
+ * them may also be freed directly, like the bits of maps split from their
+ * family. Deleting the arena frees the pooled arrays only. Not thread-safe. */
+class BloomapArena {
+	public:
+		BloomapArena(size_t limit = BLOOMAP_ARENA_POOL);
+		~BloomapArena();
+
+		/* An array of at least n words, uninitialized */
+		uint64_t* alloc(size_t n);
+		/* Returns an array of n words from alloc() */
+		void release(uint64_t* p, size_t n);
+
+		/* Bytes kept in the free lists, and their maximum. Lowering the
+		 * limit frees the arrays over it, zero turns pooling off. */
+		size_t pooled(void) const { return pooled_bytes; }
+		size_t limit(void) const { return max_bytes; }
+		void setLimit(size_t bytes);
+
+	private:
+		/* Free arrays by their size class, in units of BLOOMAP_ALIGN */
+		std::map< size_t, std::vector<uint64_t*> > free_lists;
+		size_t pooled_bytes;
+		size_t max_bytes;
+
+		static size_t sizeClass(size_t n) { return (n*sizeof(uint64_t) + BLOOMAP_ALIGN - 1) / BLOOMAP_ALIGN; }
+
+		/* Not copyable */
+		BloomapArena(const BloomapArena&);
+		BloomapArena& operator=(const BloomapArena&);
+};
+
+#endif
@@ -0,0 +1,158 @@
+#include <cassert>
+#include <cstring>
+
+#include "bloomapexpr.h"
+#include "bitkernels.h"
+
+BloomapExpr::BloomapExpr(Bloomap* map)
+	: depth(1)
+{
+	assert(map);
+	Op op;
+	op.code = Op::LEAF;
+	op.map = map;
+	prog.push_back(op);
+}
+
+BloomapExpr BloomapExpr::combine(const BloomapExpr& rhs, int code) const {
+	assert(family() == rhs.family());
+	BloomapExpr e;
+	e.prog = prog;
+	e.prog.insert(e.prog.end(), rhs.prog.begin(), rhs.prog.end());
+	Op op;
+	op.code = (code == Op::AND) ? Op::AND : Op::OR;
+	op.map = NULL;
+	e.prog.push_back(op);
+	/* The left operand is kept on the stack while the right one is evaluated. */
+	e.depth = (depth > rhs.depth + 1) ? depth : rhs.depth + 1;
+	return e;
+}
+
+BloomapExpr BloomapExpr::operator&(const BloomapExpr& rhs) const {
+	return combine(rhs, Op::AND);
+}
+
+BloomapExpr BloomapExpr::operator|(const BloomapExpr& rhs) const {
+	return combine(rhs, Op::OR);
+}
+
+SPECIALS_TYPE BloomapExpr::evalSpecials(void) const {
+	std::vector<SPECIALS_TYPE> stack;
+	for (unsigned i = 0; i < prog.size(); i++) {
+		if (prog[i].code == Op::LEAF) {
+			stack.push_back(prog[i].map->specials);
+			continue;
+		}
+		SPECIALS_TYPE b = stack.back();
+		stack.pop_back();
+		if (prog[i].code == Op::AND) stack.back() &= b;
+		else stack.back() |= b;
+	}
+	return stack.back();
+}
+
+const BITS_TYPE* BloomapExpr::evalBlock(unsigned offset, unsigned len, Scratch& scratch) const {
+	/* Leaves are referenced in place (packed ones are unpacked into the
+	 * scratch block of their stack position), results of operations are
+	 * written into the scratch block of the stack position they end up at. */
+	const BITS_TYPE** stack = &scratch.stack[0];
+	unsigned sp = 0;
+	for (unsigned i = 0; i < prog.size(); i++) {
+		const Op& op = prog[i];
+		if (op.code == Op::LEAF) {
+			stack[sp] = op.map->words(offset, len, &scratch.blocks[sp*BLOOMAP_EXPR_BLOCK]);
+			sp++;
+			continue;
+		}
+		const BITS_TYPE* a = stack[sp-2];
+		const BITS_TYPE* b = stack[sp-1];
+		BITS_TYPE* out = &scratch.blocks[(sp-2)*BLOOMAP_EXPR_BLOCK];
+		if (op.code == Op::AND) {
+			for (unsigned w = 0; w < len; w++)
+				out[w] = a[w] & b[w];
+		} else {
+			for (unsigned w = 0; w < len; w++)
+				out[w] = a[w] | b[w];
+		}
+		stack[sp-2] = out;
+		sp--;
+	}
+	assert(sp == 1);
+	return stack[0];
+}
+
+Bloomap* BloomapExpr::evaluate(Bloomap* dst) const {
+	Bloomap* g = geometry();
+	assert(dst->family() == family());
+	assert(dst->bits_size == g->bits_size);
+	Scratch scratch(depth);
+
+	dst->unpack();
+	dst->unshare();
+	dst->specials = evalSpecials();
+	/* Blocks are computed completely before written, so dst may be an operand. */
+	for (unsigned i = 0; i < g->bits_size; i += BLOOMAP_EXPR_BLOCK) {
+		unsigned len = (g->bits_size - i < BLOOMAP_EXPR_BLOCK) ? g->bits_size - i : BLOOMAP_EXPR_BLOCK;
+		const BITS_TYPE* res = evalBlock(i, len, scratch);
+		if (res != dst->bits + i)
+			memcpy(dst->bits + i, res, len*sizeof(BITS_TYPE));
+	}
+	dst->adapt();
+	dst->touchAll();
+	return dst;
+}
+
+bool BloomapExpr::isEmpty(void) const {
+	Bloomap* g = geometry();
+	Scratch scratch(depth);
+
+	if (evalSpecials()) return false;
+	/* Empty if any compartment is empty, skip the rest of a compartment as
+	 * soon as a bit shows up in it. */
+	for (unsigned comp = 0; comp < g->ncomp; comp++) {
+		bool empty = true;
+		for (unsigned i = 0; empty && i < g->bits_segsize; i += BLOOMAP_EXPR_BLOCK) {
+			unsigned len = (g->bits_segsize - i < BLOOMAP_EXPR_BLOCK) ? g->bits_segsize - i : BLOOMAP_EXPR_BLOCK;
+			const BITS_TYPE* res = evalBlock(comp*g->bits_segsize + i, len, scratch);
+			BITS_TYPE any = 0;
+			for (unsigned w = 0; w < len; w++)
+				any |= res[w];
+			if (any) empty = false;
+		}
+		if (empty) return true;
+	}
+	return false;
+}
+
+unsigned BloomapExpr::popcount(void) const {
+	Bloomap* g = geometry();
+	Scratch scratch(depth);
+	unsigned data_size = g->ncomp*g->bits_segsize;
+
+	unsigned count = __builtin_popcount(evalSpecials());
+	for (unsigned i = 0; i < data_size; i += BLOOMAP_EXPR_BLOCK) {
+		unsigned len = (data_size - i < BLOOMAP_EXPR_BLOCK) ? data_size - i : BLOOMAP_EXPR_BLOCK;
+		count += bitkernels()->popcount(evalBlock(i, len, scratch), len);
+	}
+	return count;
+}
+
+bool BloomapExpr::isSubsetOf(Bloomap* map) const {
+	Bloomap* g = geometry();
+	assert(map->family() == family());
+	Scratch scratch(depth);
+	unsigned data_size = g->ncomp*g->bits_segsize;
+
+	if (evalSpecials() & ~map->specials) return false;
+	BITS_TYPE buf[BLOOMAP_EXPR_BLOCK];
+	for (unsigned i = 0; i < data_size; i += BLOOMAP_EXPR_BLOCK) {
+		unsigned len = (data_size - i < BLOOMAP_EXPR_BLOCK) ? data_size - i : BLOOMAP_EXPR_BLOCK;
+		const BITS_TYPE* res = evalBlock(i, len, scratch);
+		const BITS_TYPE* have = map->words(i, len, buf);
+		BITS_TYPE extra = 0;
+		for (unsigned w = 0; w < len; w++)
+			extra |= res[w] & ~have[w];
+		if (extra) return false;
+	}
+	return true;
+}
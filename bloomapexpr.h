@@ -0,0 +1,70 @@
+/******************************************************************************
+ * Filename: bloomapexpr.h
+ *
+ * Created: 2026/10/16 11:02
+ *
+ ******************************************************************************/
+
+#ifndef __BLOOMAPEXPR_H__
+#define __BLOOMAPEXPR_H__
+
+#include <vector>
+
+#include "bloomap.h"
+
+/* Number of words evaluated at once. A few cache lines, so the scratch stack
+ * comfortably fits into L1. */
+#define BLOOMAP_EXPR_BLOCK 64
+
+/* A lazily evaluated set expression over maps of one family, e.g.
+ *
+ *   BloomapExpr e = (BloomapExpr(a) & b) | (BloomapExpr(c) & d);
+ *   e.evaluate(dst);
+ *
+ * Nothing is computed until one of the terminals is called. Each terminal
+ * makes a single pass over all the operands, block by block, and only the
+ * evaluate() terminal writes anything (into dst, which may be one of the
+ * operands). */
+class BloomapExpr {
+	public:
+		BloomapExpr(Bloomap* map);
+
+		BloomapExpr operator&(const BloomapExpr& rhs) const;
+		BloomapExpr operator|(const BloomapExpr& rhs) const;
+
+		/* Terminals */
+		Bloomap* evaluate(Bloomap* dst) const;
+		bool isEmpty(void) const;
+		unsigned popcount(void) const;
+		bool isSubsetOf(Bloomap* map) const;
+
+		BloomapFamily* family() const { return prog[0].map->family(); }
+
+	protected:
+		struct Op {
+			enum { LEAF, AND, OR } code;
+			Bloomap* map;
+		};
+		/* The expression in postfix form. */
+		std::vector<Op> prog;
+		unsigned depth;
+
+		/* Per-terminal evaluation state, the operand stack and a block of
+		 * words for each of its positions. */
+		struct Scratch {
+			Scratch(unsigned depth) : stack(depth), blocks(depth*BLOOMAP_EXPR_BLOCK) {};
+			std::vector<const BITS_TYPE*> stack;
+			std::vector<BITS_TYPE> blocks;
+		};
+
+		BloomapExpr() : depth(0) {};
+		BloomapExpr combine(const BloomapExpr& rhs, int code) const;
+		Bloomap* geometry(void) const { return prog[0].map; }
+
+		SPECIALS_TYPE evalSpecials(void) const;
+		/* Computes len words of the result starting at offset. The returned
+		 * pointer points either into scratch, or directly into an operand. */
+		const BITS_TYPE* evalBlock(unsigned offset, unsigned len, Scratch& scratch) const;
+};
+
+#endif
@@ -1,9 +1,15 @@
 #include <cmath>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
 #include <iostream>
+#include <sys/mman.h>
 
 #include "bloomapfamily.h"
 #include "bloomap.h"
+#include "murmur.h"
+#include "threadpool.h"
 
 unsigned round_to_log(unsigned x) {
 	unsigned il = 0;
@@ -11,30 +17,168 @@ unsigned round_to_log(unsigned x) {
 	return il;
 }
 
-BloomapFamily::BloomapFamily(unsigned m, unsigned k)
-	: m(m), k(k), index_logsize(round_to_log(m))
+/* Words of a hash stored together in the bucketed index, limited by the
+ * tile size. Zero (the dense layout) if even a single word per hash would
+ * overflow a tile. */
+static unsigned bucketed_run_log(unsigned index_logsize) {
+	if (index_logsize + BLOOMAP_INDEX_RUN_LOG <= BLOOMAP_INDEX_TILE_MAX_LOG)
+		return BLOOMAP_INDEX_RUN_LOG;
+	if (index_logsize < BLOOMAP_INDEX_TILE_MAX_LOG)
+		return BLOOMAP_INDEX_TILE_MAX_LOG - index_logsize;
+	return 0;
+}
+
+BloomapFamily::BloomapFamily(unsigned m, unsigned k, Layout layout, uint64_t seed, IndexMode index_mode)
+	: m(m), k(k), layout(layout), seed(seed), index_mode(index_mode), map_holes(0), index_chunks(NULL), sparse_index(NULL),
+	  sparse_lock(false), index_words(0), index_logsize(round_to_log(m)),
+	  index_run_log(index_mode == INDEX_BUCKETED ? bucketed_run_log(index_logsize) : 0), concurrent(false),
+	  compression(true), copy_on_write(true), design_n(round(log(2.0) * m / k)), design_p(pow(0.5, k)),
+	  pool(NULL), mapping(NULL), mapping_size(0), index_dirty(NULL), changes_lost(false)
 {
+	if (index_mode == INDEX_SPARSE) {
+		sparse_index = new SparseIndex();
+	} else {
+		index_chunks = (uint64_t**) calloc(BLOOMAP_INDEX_CHUNKS, sizeof(uint64_t*));
+		if (!index_chunks)
+			throw std::bad_alloc();
+	}
+
+	/* Derive all the seeds from the family seed, so the maps are the same
+	 * bit for bit in every process using it. Odd multipliers make
+	 * a*x + b a permutation of 32-bit numbers. */
+	void* mem = NULL;
+	if (posix_memalign(&mem, 64, 2*nseeds()*sizeof(uint32_t)))
+		throw std::bad_alloc();
+	hash_seeds = (uint32_t*) mem;
+	uint64_t state = seed;
+	for (unsigned i = 0; i < nseeds(); i++) {
+		uint64_t r = SplitMix64(&state);
+		hash_seeds[2*i] = ((uint32_t) r) | 1;
+		hash_seeds[2*i+1] = (uint32_t) (r >> 32);
+	}
+}
+
+BloomapFamily::~BloomapFamily() {
+	/* The maps outlive the family, on their own, and without the mapping */
+	compactMaps();
+	while (!bloomaps.empty()) {
+		if (bloomaps.back()->external_bits)
+			bloomaps.back()->ownBits();
+		bloomaps.back()->splitFamily();
+	}
+	for (unsigned i = 0; i < layers.size(); i++)
+		delete layers[i];
+	if (index_chunks) {
+		for (unsigned i = 0; i < BLOOMAP_INDEX_CHUNKS; i++)
+			freeChunk(index_chunks[i]);
+		free(index_chunks);
+	}
+	delete sparse_index;
+	delete pool;
+	free(index_dirty);
+	free(hash_seeds);
+	if (mapping)
+		munmap(mapping, mapping_size);
+}
+
+void BloomapFamily::setThreads(unsigned n) {
+	delete pool;
+	pool = (n > 1) ? new ThreadPool(n) : NULL;
+}
+
+unsigned BloomapFamily::threads(void) const {
+	return pool ? pool->size() : 1;
+}
+
+void BloomapFamily::setConcurrent(bool on) {
+	concurrent = on;
+	compactMaps();
+	for (unsigned i = 0; i < bloomaps.size(); i++)
+		bloomaps[i]->adapt();
+}
+
+void BloomapFamily::setCompression(bool on) {
+	compression = on;
+	compactMaps();
+	for (unsigned i = 0; i < bloomaps.size(); i++)
+		bloomaps[i]->adapt();
+	for (unsigned i = 0; i < layers.size(); i++)
+		layers[i]->setCompression(on);
+}
+
+BloomapFamily* BloomapFamily::layer(unsigned i) {
+	if (!i) return this;
+	while (layers.size() < i) {
+		const unsigned l = layers.size() + 1;
+		/* Hash functions independent of the other layers, so false
+		 * positives of one layer are not likely in the next one too */
+		uint64_t state = seed + l;
+		BloomapFamily* f = forElementsAndProb(design_n * pow(BLOOMAP_LAYER_GROWTH, l),
+				design_p * pow(BLOOMAP_LAYER_TIGHTEN, l), layout, SplitMix64(&state), index_mode);
+		f->compression = compression;
+		f->copy_on_write = copy_on_write;
+		f->arena.setLimit(arena.limit());
+		layers.push_back(f);
+	}
+	return layers[i - 1];
+}
+
+void BloomapFamily::trackChanges(bool on) {
+	if (on == isTrackingChanges()) return;
+	if (on) {
+		index_dirty = (uint64_t*) calloc(BLOOMAP_INDEX_DIRTY_SIZE, sizeof(uint64_t));
+		if (!index_dirty)
+			throw std::bad_alloc();
+	} else {
+		free(index_dirty);
+		index_dirty = NULL;
+	}
+	compactMaps();
+	for (unsigned i = 0; i < bloomaps.size(); i++)
+		bloomaps[i]->trackChanges(on);
+	resetChanges();
+}
+
+void BloomapFamily::resetChanges(void) {
+	changes_lost = false;
+	removed_maps.clear();
+	compactMaps();
+	for (unsigned i = 0; i < bloomaps.size(); i++)
+		bloomaps[i]->saved_slot = index_dirty ? i : ~0U;
+	if (!index_dirty) return;
+	memset(index_dirty, 0, BLOOMAP_INDEX_DIRTY_SIZE*sizeof(uint64_t));
+	for (unsigned i = 0; i < bloomaps.size(); i++)
+		bloomaps[i]->resetChanges();
 }
 
 /* Convenience functions to create right families depending on the needs */
-BloomapFamily* BloomapFamily::forElementsAndProb(unsigned n, double p) {
+BloomapFamily* BloomapFamily::forElementsAndProb(unsigned n, double p, Layout layout, uint64_t seed,
+		IndexMode index_mode) {
 	unsigned m = ceil((n * log(p)) / log(1.0 / (pow(2.0, log(2.0)))));
 	unsigned k = round(log(2.0) * m / n);
 	assert(m);
 	assert(k);
 
-	return new BloomapFamily(m, k);
+	BloomapFamily* f = new BloomapFamily(m, k, layout, seed, index_mode);
+	f->design_n = n;
+	f->design_p = p;
+	return f;
+}
+
+BloomapFamily* BloomapFamily::forSizeAndFunctions(unsigned m, unsigned k, Layout layout, uint64_t seed,
+		IndexMode index_mode) {
+	return new BloomapFamily(m, k, layout, seed, index_mode);
 }
 
-BloomapFamily* BloomapFamily::forSizeAndFunctions(unsigned m, unsigned k) {
-	return new BloomapFamily(m, k);
+BloomapFamily* BloomapFamily::forCompartments(unsigned k, unsigned log_compsize, uint64_t seed) {
+	/* Maps round m/k up to the next power of two strictly above it. */
+	assert(log_compsize > 0);
+	return new BloomapFamily(k << (log_compsize - 1), k, LAYOUT_COMPARTMENTS, seed);
 }
 
 /* Create and return a new map from this family */
 Bloomap* BloomapFamily::newMap(void) {
-	Bloomap* nm = new Bloomap(this, m, k, index_logsize);
-	bloomaps.push_back(nm);
-	return nm;
+	return new Bloomap(this, m, k, index_logsize);
 }
 
 unsigned BloomapFamily::newElement(unsigned e) {
@@ -52,13 +196,242 @@ unsigned BloomapFamily::newElement(unsigned e) {
 	unsigned hash = (e >> bits_condensed) & hash_mask;
 	assert(hash < (1U << index_logsize));
 	unsigned ip = e >> (bits_condensed);
-	if (ip >= index_data.size()) {
-		index_data.resize(ip+1, 0); /* TODO: Possibly check if the vector reserves a lot more space */
+	indexOr(ip, 1ULL << (e & condensed_mask));
+	return hash;
+}
+
+uint64_t* BloomapFamily::indexChunk(unsigned c) {
+	assert(c < BLOOMAP_INDEX_CHUNKS);
+	uint64_t* chunk = __atomic_load_n(&index_chunks[c], __ATOMIC_ACQUIRE);
+	if (chunk) return chunk;
+
+	/* Install a fresh chunk. If another thread was faster, use its one. */
+	uint64_t* fresh = (uint64_t*) calloc(BLOOMAP_INDEX_CHUNK_WORDS, sizeof(uint64_t));
+	if (!fresh)
+		throw std::bad_alloc();
+	if (__atomic_compare_exchange_n(&index_chunks[c], &chunk, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return fresh;
+	free(fresh);
+	return chunk;
+}
+
+void BloomapFamily::indexOr(unsigned ip, uint64_t mask) {
+	if (sparse_index) {
+		/* The containers move around as they grow, so concurrent updates
+		 * of the sparse index are serialized. */
+		if (concurrent)
+			while (__atomic_test_and_set(&sparse_lock, __ATOMIC_ACQUIRE))
+				;
+		if (index_dirty && (sparse_index->word(ip) & mask) != mask)
+			bloomap_mark_dirty(index_dirty, ip, false);
+		sparse_index->orWord(ip, mask);
+		if (ip >= index_words) index_words = ip + 1;
+		if (concurrent)
+			__atomic_clear(&sparse_lock, __ATOMIC_RELEASE);
+		return;
+	}
+	const unsigned pos = indexPos(ip);
+	uint64_t* word = indexChunk(pos >> BLOOMAP_INDEX_CHUNK_LOG) + (pos & (BLOOMAP_INDEX_CHUNK_WORDS - 1));
+	if (!concurrent) {
+		if (index_dirty && (*word & mask) != mask)
+			bloomap_mark_dirty(index_dirty, pos, false);
+		*word |= mask;
+		if (ip >= index_words) index_words = ip + 1;
+		return;
 	}
+	if (bloomap_fetch_or(word, mask) && index_dirty)
+		bloomap_mark_dirty(index_dirty, pos, true);
+	unsigned size = __atomic_load_n(&index_words, __ATOMIC_RELAXED);
+	while (ip >= size && !__atomic_compare_exchange_n(&index_words, &size, ip + 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
 
-	index_data[ip] |= (1ULL << (e & condensed_mask));
-	//std::cerr << "index_data[" << ip << "] |= " << (1ULL << (e & condensed_mask)) << std::endl;
-	return hash;
+void BloomapFamily::newElements(const uint32_t* e, size_t n, unsigned* hashes) {
+	/* Same as newElement() for each of the elements, but merges consecutive
+	 * updates of the same word into a single write. This is very common
+	 * with sequential IDs. */
+	if (!n) return;
+	const unsigned bits_condensed = 6;
+	const unsigned hash_mask = (1 << index_logsize) - 1;
+	const unsigned condensed_mask = (1 << bits_condensed) - 1;
+
+	unsigned ip = e[0] >> bits_condensed;
+	uint64_t mask = 0;
+	for (size_t i = 0; i < n; i++) {
+		unsigned cur = e[i] >> bits_condensed;
+		if (cur != ip) {
+			indexOr(ip, mask);
+			ip = cur;
+			mask = 0;
+		}
+		mask |= 1ULL << (e[i] & condensed_mask);
+		hashes[i] = cur & hash_mask;
+	}
+	indexOr(ip, mask);
+}
+
+unsigned BloomapFamily::nextIndexWord(unsigned ip, unsigned stride_log) const {
+	const unsigned stride = 1U << stride_log;
+	if (sparse_index) {
+		unsigned next = sparse_index->nextWord(ip, stride_log);
+		return (next < index_words) ? next : index_words;
+	}
+	if (index_run_log)
+		return nextBucketedWord(ip, stride_log);
+	while (ip < index_words) {
+		const uint64_t* chunk = __atomic_load_n(&index_chunks[ip >> BLOOMAP_INDEX_CHUNK_LOG], __ATOMIC_ACQUIRE);
+		if (!chunk) {
+			/* Skip to the first word of the hash in the next chunk */
+			unsigned next = ((ip >> BLOOMAP_INDEX_CHUNK_LOG) + 1) << BLOOMAP_INDEX_CHUNK_LOG;
+			ip += (next - ip + stride - 1) & ~(stride - 1);
+			continue;
+		}
+		/* Scan the rest of the chunk */
+		unsigned end = ((ip >> BLOOMAP_INDEX_CHUNK_LOG) + 1) << BLOOMAP_INDEX_CHUNK_LOG;
+		if (end > index_words) end = index_words;
+		for (; ip < end; ip += stride)
+			if (chunk[ip & (BLOOMAP_INDEX_CHUNK_WORDS - 1)])
+				return ip;
+	}
+	return index_words;
+}
+
+unsigned BloomapFamily::nextBucketedWord(unsigned ip, unsigned stride_log) const {
+	const unsigned stride = 1U << stride_log;
+	if (stride_log != index_logsize) {
+		/* Neighbouring words are far apart, test them one by one */
+		for (; ip < index_words; ip += stride)
+			if (indexWord(ip)) return ip;
+		return index_words;
+	}
+	/* The words of a hash are consecutive up to the end of the run, and
+	 * a run never crosses a chunk. */
+	const unsigned run_mask = (1U << index_run_log) - 1;
+	while (ip < index_words) {
+		const unsigned pos = indexPos(ip);
+		unsigned len = (1U << index_run_log) - ((ip >> index_logsize) & run_mask);
+		const uint64_t* chunk = __atomic_load_n(&index_chunks[pos >> BLOOMAP_INDEX_CHUNK_LOG], __ATOMIC_ACQUIRE);
+		if (chunk) {
+			const uint64_t* run = chunk + (pos & (BLOOMAP_INDEX_CHUNK_WORDS - 1));
+			unsigned avail = ((index_words - ip - 1) >> index_logsize) + 1;
+			if (len > avail) len = avail;
+			for (unsigned i = 0; i < len; i++)
+				if (run[i]) return ip + (i << index_logsize);
+		}
+		ip += len << index_logsize;
+	}
+	return index_words;
+}
+
+size_t BloomapFamily::indexScanCost(void) const {
+	if (sparse_index)
+		return sparse_index->cardinality();
+	size_t words = 0;
+	for (unsigned i = 0; i < BLOOMAP_INDEX_CHUNKS; i++)
+		if (index_chunks[i]) words += BLOOMAP_INDEX_CHUNK_WORDS;
+	/* Consecutive words are in different runs in the bucketed layout */
+	return index_run_log ? words : words / 8;
+}
+
+size_t BloomapFamily::indexMemory(void) const {
+	if (sparse_index)
+		return sparse_index->memoryUsage();
+	size_t size = BLOOMAP_INDEX_CHUNKS*sizeof(uint64_t*);
+	for (unsigned i = 0; i < BLOOMAP_INDEX_CHUNKS; i++)
+		if (index_chunks[i]) size += BLOOMAP_INDEX_CHUNK_WORDS*sizeof(uint64_t);
+	return size;
+}
+
+void BloomapFamily::optimizeIndex(void) {
+	if (sparse_index)
+		sparse_index->optimize();
+}
+
+size_t BloomapFamily::indexCardinality(void) const {
+	if (sparse_index)
+		return sparse_index->cardinality();
+	size_t n = 0;
+	for (unsigned c = 0; c < BLOOMAP_INDEX_CHUNKS; c++) {
+		const uint64_t* chunk = index_chunks[c];
+		if (!chunk) continue;
+		for (unsigned i = 0; i < BLOOMAP_INDEX_CHUNK_WORDS; i++)
+			n += __builtin_popcountll(chunk[i]);
+	}
+	return n;
+}
+
+void BloomapFamily::clearIndex(void) {
+	if (sparse_index) {
+		delete sparse_index;
+		sparse_index = new SparseIndex();
+	} else {
+		for (unsigned c = 0; c < BLOOMAP_INDEX_CHUNKS; c++) {
+			freeChunk(index_chunks[c]);
+			index_chunks[c] = NULL;
+		}
+	}
+	index_words = 0;
+	changes_lost = true;
+}
+
+size_t BloomapFamily::prune(bool purge_maps) {
+	assert(!concurrent);
+	size_t before = indexCardinality();
+	/* Find the live elements in a single pass over the old index, then
+	 * build a new one of them. */
+	std::vector< std::vector<uint32_t> > live;
+	compactMaps();
+	std::vector<Bloomap*> maps(bloomaps);
+	if (!maps.empty())
+		Bloomap::sweep(&maps[0], maps.size(), purge_maps, NULL, &live);
+
+	clearIndex();
+	size_t after = 0;
+	std::vector<unsigned> hashes;
+	for (unsigned i = 0; i < live.size(); i++) {
+		hashes.resize(live[i].size());
+		if (!live[i].empty())
+			newElements(&live[i][0], live[i].size(), &hashes[0]);
+		after += live[i].size();
+		std::vector<uint32_t>().swap(live[i]);
+	}
+	optimizeIndex();
+	return before - after;
+}
+
+void BloomapFamily::addMap(Bloomap* map) {
+	map->slot = bloomaps.size();
+	map->saved_slot = ~0U;
+	bloomaps.push_back(map);
+}
+
+void BloomapFamily::removeMap(Bloomap* map) {
+	assert(map->slot < bloomaps.size() && bloomaps[map->slot] == map);
+	bloomaps[map->slot] = NULL;
+	map_holes++;
+	/* Temporary maps never reach the log */
+	if (map->saved_slot != ~0U)
+		removed_maps.push_back(map->saved_slot);
+	/* Maps deleted in reverse order leave no holes, and the others are
+	 * closed once they take half of the slots */
+	while (!bloomaps.empty() && !bloomaps.back()) {
+		bloomaps.pop_back();
+		map_holes--;
+	}
+	if (map_holes > bloomaps.size() / 2)
+		compactMaps();
+}
+
+void BloomapFamily::compactMaps(void) const {
+	if (!map_holes) return;
+	unsigned n = 0;
+	for (unsigned i = 0; i < bloomaps.size(); i++) {
+		if (!bloomaps[i]) continue;
+		bloomaps[i]->slot = n;
+		bloomaps[n++] = bloomaps[i];
+	}
+	bloomaps.resize(n);
+	map_holes = 0;
 }
 
 void BloomapFamily::dumpCandidates(void) {
@@ -70,7 +443,7 @@ BloomapFamilyIterator::BloomapFamilyIterator(BloomapFamily *family, unsigned has
 {
 	//std::cerr << "New iterator. hash=" << hash << std::endl;
 	/* If the first element isn't in the family, call the ++() to find one */
-	if ((family->index_data[hash] & 1) == 0)
+	if ((family->indexWord(hash) & 1) == 0)
 		operator++();
 }
 
@@ -79,31 +452,23 @@ bool BloomapFamilyIterator::atEnd(void) {
 }
 
 BloomapFamilyIterator& BloomapFamilyIterator::operator++() {
-	//std::cerr << "++" << std::endl;
 	/* If we are past the end */
-	if (pmajor >= family->index_data.size()) {
+	if (pmajor >= family->index_words) {
 		flagAtEnd = true;
 		return *this;
 	}
-	uint64_t current_data = family->index_data[pmajor] >> pminor;
-	//std::cerr << "index_data[" << pmajor << "] = " << current_data << std::endl;
-	do {
-		if (!current_data) {
-			pminor = 0;
-			/* Let's break out if this was the last place */
-			pmajor += (1 << family->index_logsize);
-			if (pmajor >= family->index_data.size()) {
-				flagAtEnd = true;
-				break;
-			}
-			current_data = family->index_data[pmajor];
-			//if (current_data)
-				//std::cerr << "index_data[" << pmajor << "] = " << current_data << std::endl;
-		} else {
-			current_data >>= 1;
-			pminor++;
+	/* Next bit in this word, or the first one in the next word of the hash */
+	uint64_t current_data = (pminor == 63) ? 0 : family->indexWord(pmajor) & (~0ULL << (pminor + 1));
+	while (!current_data) {
+		pminor = 0;
+		pmajor = family->nextIndexWord(pmajor + (1 << family->index_logsize));
+		if (pmajor >= family->index_words) {
+			flagAtEnd = true;
+			return *this;
 		}
-	} while (0 == (current_data & 1));
+		current_data = family->indexWord(pmajor);
+	}
+	pminor = __builtin_ctzll(current_data);
 	return *this;
 }
 
@@ -132,7 +497,7 @@ bool BloomapFamilyIterator::operator!=(const BloomapFamilyIterator& rhs) {
 unsigned BloomapFamilyIterator::operator*() {
 	if (flagAtEnd) return 0xdeadbeef;
 	assert(pminor < 64);
-	assert(pmajor < family->index_data.size());
+	assert(pmajor < family->index_words);
 	/* Stak the data together: pmajor . hash . pminor */
 	unsigned val = (pmajor << 6) | pminor;
 	//std::cerr << "Candidate: " << val << std::endl;
@@ -11,11 +11,69 @@
 #define __BLOOMAPFAMILY_H__
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <vector>
 #include <iterator>
 
+#include "sparseindex.h"
+#include "bloomaparena.h"
+
+/* Seed used when none is given. Families created with the same seed and
+ * parameters have identical hash functions, in any process. */
+#define BLOOMAP_DEFAULT_SEED 0x426c6f6f6d6170ULL
+
+/* Layers of scalable maps (see ScalableBloomap): layer i is designed for
+ * GROWTH^i times the elements of the family, at TIGHTEN^i times its false
+ * positive rate, so the rates of all the layers sum up to less than twice
+ * the one of the family. */
+#define BLOOMAP_LAYER_GROWTH 2
+#define BLOOMAP_LAYER_TIGHTEN 0.5
+
+/* The family index is stored in chunks of 2^BLOOMAP_INDEX_CHUNK_LOG words,
+ * allocated on first use and never moved, so it can grow while other threads
+ * update it. 32-bit elements, 64 of them per word, need at most
+ * BLOOMAP_INDEX_CHUNKS chunks. */
+#define BLOOMAP_INDEX_CHUNK_LOG 13
+#define BLOOMAP_INDEX_CHUNK_WORDS (1U << BLOOMAP_INDEX_CHUNK_LOG)
+#define BLOOMAP_INDEX_CHUNKS (1U << (32 - 6 - BLOOMAP_INDEX_CHUNK_LOG))
+
+/* The bucketed index stores 2^BLOOMAP_INDEX_RUN_LOG consecutive words of each
+ * hash together (4KB), in tiles of at most 2^BLOOMAP_INDEX_TILE_MAX_LOG words
+ * (32MB). Families with too many hashes for that fall back to the dense
+ * layout. */
+#define BLOOMAP_INDEX_RUN_LOG 9
+#define BLOOMAP_INDEX_TILE_MAX_LOG 22
+
+/* Atomically sets mask in *word, returns the bits which were not set before.
+ * The locked instruction is skipped if all the bits are set already, which
+ * is the common case once a map fills up. */
+static inline uint64_t bloomap_fetch_or(uint64_t* word, uint64_t mask) {
+	if ((__atomic_load_n(word, __ATOMIC_RELAXED) & mask) == mask) return 0;
+	return mask & ~__atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+}
+
+/* Changes of the maps and of the family index are tracked in blocks of
+ * 2^BLOOMAP_DIRTY_LOG words (4KB), see BloomapFamily::trackChanges(). */
+#define BLOOMAP_DIRTY_LOG 9
+#define BLOOMAP_DIRTY_WORDS (1U << BLOOMAP_DIRTY_LOG)
+/* Words of the bitmap of dirty index blocks, for the largest index */
+#define BLOOMAP_INDEX_DIRTY_SIZE ((BLOOMAP_INDEX_CHUNKS << BLOOMAP_INDEX_CHUNK_LOG >> BLOOMAP_DIRTY_LOG) / 64)
+
+/* Marks the block of word as dirty in a bitmap of blocks */
+static inline void bloomap_mark_dirty(uint64_t* dirty, size_t word, bool atomic) {
+	const size_t block = word >> BLOOMAP_DIRTY_LOG;
+	const uint64_t mask = 1ULL << (block & 63);
+	if (atomic) bloomap_fetch_or(&dirty[block / 64], mask);
+	else dirty[block / 64] |= mask;
+}
+
 class Bloomap;
 class BloomapFamily;
+class ThreadPool;
+template<unsigned K, unsigned LogCompSize> class StaticBloomap;
+class CountingBloomap;
+class ScalableBloomap;
 
 class BloomapFamilyIterator : public std::iterator<std::input_iterator_tag, unsigned > {
 	public:
@@ -38,17 +96,159 @@ class BloomapFamilyIterator : public std::iterator<std::input_iterator_tag, unsi
 
 class BloomapFamily {
 	public:
-		BloomapFamily(unsigned m, unsigned k);
+		/* How the maps of the family place their bits:
+		 *  LAYOUT_COMPARTMENTS	k compartments, one bit in each (k cache lines)
+		 *  LAYOUT_BLOCKED	all k bits in one 64-byte block (one cache line),
+		 *  			for the price of somewhat higher FP rate
+		 */
+		enum Layout { LAYOUT_COMPARTMENTS, LAYOUT_BLOCKED };
+
+		/* How the family index (all the elements ever inserted) is stored:
+		 *  INDEX_DENSE		a bit per possible element, in chunks allocated
+		 *  			on first use. Fast, good for dense IDs.
+		 *  INDEX_SPARSE	roaring-style containers per 64K range (see
+		 *  			SparseIndex), for sparse IDs like hashes.
+		 *  INDEX_BUCKETED	like INDEX_DENSE, but the words of each hash
+		 *  			are stored together, so enumerating a map is a
+		 *  			sequential scan. For families with many
+		 *  			elements per hash; the index is allocated a
+		 *  			whole tile at a time.
+		 */
+		enum IndexMode { INDEX_DENSE, INDEX_SPARSE, INDEX_BUCKETED };
 
-		static BloomapFamily* forElementsAndProb(unsigned n, double p);
-		static BloomapFamily* forSizeAndFunctions(unsigned m, unsigned k);
+		BloomapFamily(unsigned m, unsigned k, Layout layout = LAYOUT_COMPARTMENTS,
+				uint64_t seed = BLOOMAP_DEFAULT_SEED, IndexMode index_mode = INDEX_DENSE);
+		~BloomapFamily();
+
+		static BloomapFamily* forElementsAndProb(unsigned n, double p, Layout layout = LAYOUT_COMPARTMENTS,
+				uint64_t seed = BLOOMAP_DEFAULT_SEED, IndexMode index_mode = INDEX_DENSE);
+		static BloomapFamily* forSizeAndFunctions(unsigned m, unsigned k, Layout layout = LAYOUT_COMPARTMENTS,
+				uint64_t seed = BLOOMAP_DEFAULT_SEED, IndexMode index_mode = INDEX_DENSE);
+		/* Maps of this family have exactly k compartments of 2^log_compsize
+		 * bits, as StaticBloomap<k, log_compsize> requires. */
+		static BloomapFamily* forCompartments(unsigned k, unsigned log_compsize,
+				uint64_t seed = BLOOMAP_DEFAULT_SEED);
 
 		Bloomap* newMap(void);
+		/* Defined in staticbloomap.h */
+		template<unsigned K, unsigned LogCompSize>
+		StaticBloomap<K, LogCompSize>* newStaticMap(void);
+		/* Defined in countingbloomap.cpp */
+		CountingBloomap* newCountingMap(void);
+		/* Defined in scalablebloomap.cpp */
+		ScalableBloomap* newScalableMap(void);
 
 		unsigned m, k;
+		const Layout layout;
+		const uint64_t seed;
+		const IndexMode index_mode;
+
+		/* The number of elements the maps are designed for, and their false
+		 * positive rate at that fill. Given to forElementsAndProb(), and
+		 * derived from m and k by the other factories. */
+		unsigned capacity(void) const { return design_n; }
+		double falsePositiveRate(void) const { return design_p; }
+		/* Layer i of scalable maps, a family with the same layout and index
+		 * mode, a seed of its own, and BLOOMAP_LAYER_GROWTH^i times the
+		 * capacity at BLOOMAP_LAYER_TIGHTEN^i times the rate. Layer zero is
+		 * the family itself. Created on first use, and deleted with the
+		 * family. */
+		BloomapFamily* layer(unsigned i);
+
+		/* Seeds of the hash functions, as (a, b) pairs: function i is
+		 * a_i*x + b_i with a_i = seeds()[2*i], b_i = seeds()[2*i+1]. There
+		 * are nseeds() of them, k for the compartments and one to pick
+		 * the block in the blocked layout. */
+		const uint32_t* seeds(void) const { return hash_seeds; }
+		unsigned nseeds(void) const { return k + 1; }
+
+		/* Concurrent ingestion. While enabled, add() and addBatch() may be
+		 * called from many threads at once, on the same or different maps
+		 * of the family, and all shared words are updated atomically. Other
+		 * operations (set operations, purge(), iteration, newMap()) still
+		 * have to be serialized with the writers. Only switch it while no
+		 * thread is adding. Maps are never packed meanwhile (see
+		 * setCompression()), switching it on unpacks them all. */
+		void setConcurrent(bool on);
+		bool isConcurrent(void) const { return concurrent; }
+
+		/* Threads used by the parallel operations of the maps (count(),
+		 * enumerateAll(), purge()), including the calling one. One by
+		 * default, which runs everything in the calling thread. */
+		void setThreads(unsigned n);
+		unsigned threads(void) const;
+
+		/* Compressed maps, on by default. Maps with few elements keep their
+		 * bits packed, see Bloomap::isCompressed(). Switching it off
+		 * unpacks all the maps. */
+		void setCompression(bool on);
+		bool isCompressing(void) const { return compression; }
+
+		/* The bits of the maps come from an arena of the family (see
+		 * BloomapArena), which keeps the arrays of deleted maps for the
+		 * new ones, up to BLOOMAP_ARENA_POOL bytes by default. Zero turns
+		 * the pool off. pooledMemory() is the memory kept, in bytes. */
+		void setPoolLimit(size_t bytes) { arena.setLimit(bytes); }
+		size_t pooledMemory(void) const { return arena.pooled(); }
+
+		/* Copy-on-write clones of large maps, on by default, see
+		 * Bloomap::Bloomap(Bloomap*). Off, clones are copied. */
+		void setCopyOnWrite(bool on) { copy_on_write = on; }
+		bool isCopyOnWrite(void) const { return copy_on_write; }
 
 		/* Inserts a new element and returns it's hash */
 		unsigned newElement(unsigned ele);
+		/* Inserts n elements and stores their hashes into hashes[] */
+		void newElements(const uint32_t* ele, size_t n, unsigned* hashes);
+
+		/* Memory taken by the family index, in bytes */
+		size_t indexMemory(void) const;
+		/* Compacts the sparse index once (mostly) built, converting long
+		 * runs of elements into run containers. Nothing in the dense mode. */
+		void optimizeIndex(void);
+		/* Number of elements in the family index */
+		size_t indexCardinality(void) const;
+		/* Whether ele was ever inserted into the family */
+		bool hasElement(unsigned ele) const { return (indexWord(ele >> 6) >> (ele & 63)) & 1; }
+		/* Removes the elements which no map of the family contains any
+		 * more from the index, and frees the storage they took. With
+		 * purge_maps, the maps are purged (see Bloomap::purge()) in the
+		 * same pass, all but the counting ones. Returns the number of
+		 * elements removed. Needs memory for the elements kept, and no
+		 * writers active. */
+		size_t prune(bool purge_maps = false);
+
+		/* Saves the family, its index and all its maps into a file, returns
+		 * false on I/O errors. The maps are stored in the order of map().
+		 * The file is replaced atomically, even the one the family was
+		 * loaded from. Its delta log (see checkpoint()) is removed. */
+		bool save(const char* path);
+		/* Loads a saved family. The file is mapped into memory and the
+		 * index and the maps use it in place, so loading only costs page
+		 * faults. Changes are private to the process (copy on write) and
+		 * never reach the file. The file must not be changed while the
+		 * family or its maps use it. Returns NULL if the file can't be read or
+		 * isn't a valid family. */
+		static BloomapFamily* load(const char* path);
+
+		/* Incremental saving. While tracking changes, the family notes the
+		 * 4KB blocks of its index and of its maps which change, and
+		 * checkpoint(path) appends only those to the delta log of a file
+		 * written by save() (path + ".log"). The blocks are tracked since
+		 * the last save() or checkpoint(), or since trackChanges(true).
+		 * load() applies the log, compact() folds it into the file. Maps
+		 * created since come whole, deleted ones as their position. The
+		 * log can't express prune(), checkpoint() returns false after it
+		 * and the family has to be saved as a whole. */
+		void trackChanges(bool on);
+		bool isTrackingChanges(void) const { return index_dirty != NULL; }
+		bool checkpoint(const char* path);
+		static bool compact(const char* path);
+
+		/* The maps of the family, in the order they were created (or
+		 * loaded). Deleted maps leave the others in order. */
+		unsigned nmaps(void) const { compactMaps(); return bloomaps.size(); }
+		Bloomap* map(unsigned i) const { compactMaps(); return bloomaps[i]; }
 
 		void dumpCandidates(void);
 
@@ -57,13 +257,108 @@ class BloomapFamily {
 
 
 	private:
-		std::vector< Bloomap* > bloomaps;
+		/* The maps by Bloomap::slot, NULL for the deleted ones until
+		 * compactMaps() */
+		mutable std::vector< Bloomap* > bloomaps;
+		mutable unsigned map_holes;
+		uint32_t* hash_seeds; /* Cache line aligned */
+
+		/* Not copyable */
+		BloomapFamily(const BloomapFamily&);
+		BloomapFamily& operator=(const BloomapFamily&);
 
 		/* Global storage for inserted elements. Let h_1 be the first hash
 		 * function, then element e is found in set h_1(e). */
 	protected:
-		std::vector< uint64_t > index_data;
+		/* Directory of BLOOMAP_INDEX_CHUNKS chunk pointers, NULL until
+		 * the chunk is used (dense mode). */
+		uint64_t** index_chunks;
+		/* The index in the sparse mode, NULL otherwise */
+		SparseIndex* sparse_index;
+		/* Serializes updates of the sparse index in the concurrent mode */
+		bool sparse_lock;
+		/* Words up to the last one used, i.e. the size of the index */
+		unsigned index_words;
 		const unsigned index_logsize;
+		/* Words of a hash stored together, as log_2. Zero in the dense
+		 * layout, where word ip is simply stored at position ip. */
+		const unsigned index_run_log;
+		bool concurrent;
+		bool compression;
+		bool copy_on_write;
+		/* See capacity() and layer() */
+		unsigned design_n;
+		double design_p;
+		std::vector< BloomapFamily* > layers;
+		/* Bit arrays of the maps */
+		BloomapArena arena;
+		/* Workers of the parallel operations, NULL with a single thread */
+		ThreadPool* pool;
+		/* The file the family was loaded from, see load() */
+		void* mapping;
+		size_t mapping_size;
+		bool isMapped(const void* p) const {
+			return mapping && p >= mapping && p < (const char*) mapping + mapping_size;
+		}
+		/* Frees a chunk, unless it is in the mapping */
+		void freeChunk(uint64_t* chunk) { if (!isMapped(chunk)) free(chunk); }
+		/* Dirty blocks of the index (of its chunks, or of the words in the
+		 * sparse mode), NULL unless tracking changes */
+		uint64_t* index_dirty;
+		/* The index was pruned, see checkpoint() */
+		bool changes_lost;
+		/* Bloomap::saved_slot of the maps deleted since */
+		std::vector< uint32_t > removed_maps;
+		/* Starts tracking from the current state */
+		void resetChanges(void);
+		/* Applies a delta log of the file of file_id, see checkpoint().
+		 * committed is set to the end of the last checkpoint applied, zero
+		 * if the log is not of the file. */
+		bool applyLog(const char* path, uint64_t file_id, long& committed);
+
+		/* The hash of an element, which picks its bit in the side index */
+		unsigned elementHash(unsigned ele) const { return (ele >> 6) & ((1U << index_logsize) - 1); }
+
+		/* Position of word ip in the chunks. Word ip belongs to hash
+		 * h = ip mod 2^index_logsize, as its row-th word. Rows are grouped
+		 * by 2^index_run_log into tiles, and inside a tile the rows of
+		 * each hash are consecutive. */
+		unsigned indexPos(unsigned ip) const {
+			if (!index_run_log) return ip;
+			const unsigned h = ip & ((1U << index_logsize) - 1);
+			const unsigned row = ip >> index_logsize;
+			const unsigned run_mask = (1U << index_run_log) - 1;
+			return ((row & ~run_mask) << index_logsize) | (h << index_run_log) | (row & run_mask);
+		}
+		/* Word ip of the index, zero if it was not used yet */
+		uint64_t indexWord(unsigned ip) const {
+			if (ip >= index_words) return 0;
+			if (sparse_index) return sparse_index->word(ip);
+			const unsigned pos = indexPos(ip);
+			const uint64_t* chunk = __atomic_load_n(&index_chunks[pos >> BLOOMAP_INDEX_CHUNK_LOG], __ATOMIC_ACQUIRE);
+			return chunk ? chunk[pos & (BLOOMAP_INDEX_CHUNK_WORDS - 1)] : 0;
+		}
+		/* Smallest ip2 >= ip with ip2 == ip (mod 2^stride_log) and a
+		 * non-zero word, or index_words if there is none. With the default
+		 * stride, this is the next word of the same hash. */
+		unsigned nextIndexWord(unsigned ip) const { return nextIndexWord(ip, index_logsize); }
+		unsigned nextIndexWord(unsigned ip, unsigned stride_log) const;
+		unsigned nextBucketedWord(unsigned ip, unsigned stride_log) const;
+		/* Rough number of cache lines read by a scan over the whole index,
+		 * in word order */
+		size_t indexScanCost(void) const;
+		/* index[ip] |= mask, allocating the chunk and growing the index as
+		 * needed. */
+		void indexOr(unsigned ip, uint64_t mask);
+		uint64_t* indexChunk(unsigned chunk);
+		/* Frees the whole index */
+		void clearIndex(void);
+		/* Registers a new map, and forgets one being deleted or split from
+		 * the family, in O(1) */
+		void addMap(Bloomap* map);
+		void removeMap(Bloomap* map);
+		/* Closes the holes left by removeMap(), keeping the order */
+		void compactMaps(void) const;
 
 	friend class Bloomap;
 	friend class BloomapIterator;
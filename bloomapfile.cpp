@@ -0,0 +1,526 @@
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bloomapfamily.h"
+#include "bloomap.h"
+#include "murmur.h"
+
+/* The file format of BloomapFamily::save(). All numbers are in the byte order
+ * of the machine, the sections are aligned to 64 bytes:
+ *
+ *   FileHeader
+ *   hash seeds		2*nseeds uint32_t, to verify the seed derivation
+ *   index		dense: nchunks chunk numbers (uint32_t), then the
+ *   			chunks (BLOOMAP_INDEX_CHUNK_WORDS words each)
+ *   			sparse: nchunks word numbers (uint32_t), then the
+ *   			words (uint64_t)
+ *   maps		for each, FileMap followed by bits_size words of bits
+ *   			(the side index included)
+ *
+ * The delta log of BloomapFamily::checkpoint() (path + ".log") is a LogHeader
+ * with the id of the file, followed by checkpoints, each of them:
+ *
+ *   DeltaHeader
+ *   removed		nremoved positions of deleted maps (uint32_t), in
+ *   			increasing order, padded to 8 bytes. They are dropped
+ *   			first, the maps after them move down.
+ *   specials		of all nmaps maps, padded to 8 bytes
+ *   blocks		nblocks of DeltaBlock followed by the words of the
+ *   			block (BLOOMAP_DIRTY_WORDS, less at the end of a map)
+ *   commit		BLOOMAP_DELTA_COMMIT, a checkpoint without it was
+ *   			cut short and is ignored
+ *
+ * A log of another id was left over by a crash in save(), and is ignored.
+ * Logs are truncated to the last committed checkpoint before more are
+ * appended.
+ */
+#define BLOOMAP_FILE_MAGIC "BLOOMAP"
+#define BLOOMAP_FILE_VERSION 2
+#define BLOOMAP_FILE_ALIGN 64
+#define BLOOMAP_LOG_MAGIC "BLOOMLOG"
+#define BLOOMAP_DELTA_MAGIC "BLMDELTA"
+#define BLOOMAP_DELTA_COMMIT 0x74696d6d6f43ULL
+/* DeltaBlock::map of index blocks */
+#define BLOOMAP_DELTA_INDEX (~0U)
+
+struct FileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t m, k, layout, index_mode, index_logsize;
+	uint32_t index_words;
+	uint32_t nchunks;
+	uint32_t nmaps;
+	uint32_t nseeds;
+	uint64_t seed;
+	/* Of the whole file, to detect truncated ones */
+	uint64_t size;
+	/* Random, new for each save(), the delta log must match it */
+	uint64_t file_id;
+	uint8_t pad[BLOOMAP_FILE_ALIGN - 8];
+};
+
+struct FileMap {
+	uint32_t bits_size, index_size;
+	uint32_t ncomp, compsize, nfunc;
+	uint32_t specials;
+	uint8_t pad[BLOOMAP_FILE_ALIGN - 24];
+};
+
+struct LogHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	/* FileHeader::file_id of the file the log belongs to */
+	uint64_t file_id;
+};
+
+struct DeltaHeader {
+	char magic[8];
+	uint32_t nmaps;
+	uint32_t index_words;
+	uint32_t nblocks;
+	uint32_t nremoved;
+};
+
+struct DeltaBlock {
+	uint32_t map;
+	uint32_t block;
+};
+
+static std::string log_path(const char* path) {
+	return std::string(path) + ".log";
+}
+
+/* A random id for a new file */
+static uint64_t new_file_id(void) {
+	uint64_t id = 0;
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, &id, sizeof(id)) != sizeof(id)) id = 0;
+		close(fd);
+	}
+	if (!id) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		uint64_t state = ((uint64_t) ts.tv_sec << 32) ^ ts.tv_nsec ^ ((uint64_t) getpid() << 40);
+		id = SplitMix64(&state);
+	}
+	return id;
+}
+
+static size_t file_align(size_t off) {
+	return (off + BLOOMAP_FILE_ALIGN - 1) & ~((size_t) BLOOMAP_FILE_ALIGN - 1);
+}
+
+/* Writes data at offset off of the file, padding the gap from the current
+ * position with zeros. Returns the offset past the data. */
+static size_t file_write(FILE* fp, size_t pos, size_t off, const void* data, size_t len, bool& ok) {
+	static const char zeros[BLOOMAP_FILE_ALIGN] = { 0 };
+	assert(off >= pos && off - pos <= BLOOMAP_FILE_ALIGN);
+	if (off > pos && fwrite(zeros, 1, off - pos, fp) != off - pos) ok = false;
+	if (len && fwrite(data, 1, len, fp) != len) ok = false;
+	return off + len;
+}
+
+bool BloomapFamily::save(const char* path) {
+	assert(sizeof(FileHeader) % BLOOMAP_FILE_ALIGN == 0);
+	assert(sizeof(FileMap) == BLOOMAP_FILE_ALIGN);
+	compactMaps();
+
+	/* The index, as the non-empty chunks or words */
+	std::vector<uint32_t> index_pos;
+	std::vector<uint64_t> index_sparse;
+	if (sparse_index) {
+		for (unsigned ip = nextIndexWord(0, 0); ip < index_words; ip = nextIndexWord(ip + 1, 0)) {
+			index_pos.push_back(ip);
+			index_sparse.push_back(indexWord(ip));
+		}
+	} else {
+		for (unsigned c = 0; c < BLOOMAP_INDEX_CHUNKS; c++)
+			if (index_chunks[c]) index_pos.push_back(c);
+	}
+	const size_t index_item = sparse_index ? sizeof(uint64_t) : BLOOMAP_INDEX_CHUNK_WORDS*sizeof(uint64_t);
+
+	FileHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BLOOMAP_FILE_MAGIC, sizeof(BLOOMAP_FILE_MAGIC));
+	h.version = BLOOMAP_FILE_VERSION;
+	h.m = m;
+	h.k = k;
+	h.layout = layout;
+	h.index_mode = index_mode;
+	h.index_logsize = index_logsize;
+	h.index_words = index_words;
+	h.nchunks = index_pos.size();
+	h.nmaps = bloomaps.size();
+	h.nseeds = nseeds();
+	h.seed = seed;
+	h.file_id = new_file_id();
+	size_t size = sizeof(h);
+	size = file_align(size + 2*nseeds()*sizeof(uint32_t));
+	size = file_align(size + index_pos.size()*sizeof(uint32_t));
+	size = file_align(size + index_pos.size()*index_item);
+	for (unsigned i = 0; i < bloomaps.size(); i++)
+		size = file_align(size + sizeof(FileMap) + bloomaps[i]->bits_size*sizeof(BITS_TYPE));
+	h.size = size;
+
+	/* Written aside and renamed, the old file may still be mapped */
+	const std::string tmp = std::string(path) + ".tmp";
+	FILE* fp = fopen(tmp.c_str(), "wb");
+	if (!fp) return false;
+	bool ok = true;
+	size_t pos = file_write(fp, 0, 0, &h, sizeof(h), ok);
+	pos = file_write(fp, pos, pos, hash_seeds, 2*nseeds()*sizeof(uint32_t), ok);
+	pos = file_write(fp, pos, file_align(pos), index_pos.empty() ? NULL : &index_pos[0],
+			index_pos.size()*sizeof(uint32_t), ok);
+	for (unsigned i = 0; i < index_pos.size(); i++) {
+		const void* data = sparse_index ? (const void*) &index_sparse[i] : (const void*) index_chunks[index_pos[i]];
+		pos = file_write(fp, pos, i ? pos : file_align(pos), data, index_item, ok);
+	}
+	BITS_TYPE buf[BLOOMAP_DIRTY_WORDS];
+	for (unsigned i = 0; i < bloomaps.size(); i++) {
+		const Bloomap* map = bloomaps[i];
+		FileMap fm;
+		memset(&fm, 0, sizeof(fm));
+		fm.bits_size = map->bits_size;
+		fm.index_size = map->index_size;
+		fm.ncomp = map->ncomp;
+		fm.compsize = map->compsize;
+		fm.nfunc = map->nfunc;
+		fm.specials = map->specials;
+		pos = file_write(fp, pos, file_align(pos), &fm, sizeof(fm), ok);
+		/* Packed maps are written out plain */
+		for (unsigned w = 0; w < map->bits_size; w += BLOOMAP_DIRTY_WORDS) {
+			const unsigned len = std::min(BLOOMAP_DIRTY_WORDS, map->bits_size - w);
+			pos = file_write(fp, pos, pos, map->words(w, len, buf), len*sizeof(BITS_TYPE), ok);
+		}
+	}
+	pos = file_write(fp, pos, file_align(pos), NULL, 0, ok);
+	assert(!ok || pos == size);
+	/* On the disk before it replaces the old file */
+	if (fflush(fp) || fsync(fileno(fp))) ok = false;
+	if (fclose(fp)) ok = false;
+	if (!ok || rename(tmp.c_str(), path)) {
+		unlink(tmp.c_str());
+		return false;
+	}
+	/* The log belongs to the old file, and is ignored if this is cut
+	 * short */
+	unlink(log_path(path).c_str());
+	resetChanges();
+	return true;
+}
+
+BloomapFamily* BloomapFamily::load(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) || (size_t) st.st_size < sizeof(FileHeader)) {
+		close(fd);
+		return NULL;
+	}
+	/* Private and writable, the maps and the index can be changed as usual,
+	 * the touched pages are copied. */
+	void* mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) return NULL;
+	const char* base = (const char*) mem;
+	size_t size = st.st_size;
+
+	const FileHeader* h = (const FileHeader*) base;
+	if (memcmp(h->magic, BLOOMAP_FILE_MAGIC, sizeof(BLOOMAP_FILE_MAGIC)) || h->version != BLOOMAP_FILE_VERSION ||
+			h->size != size || h->layout > LAYOUT_BLOCKED || h->index_mode > INDEX_BUCKETED ||
+			!h->m || !h->k) {
+		munmap(mem, size);
+		return NULL;
+	}
+
+	BloomapFamily* f = new BloomapFamily(h->m, h->k, (Layout) h->layout, h->seed, (IndexMode) h->index_mode);
+	f->mapping = mem;
+	f->mapping_size = size;
+	const bool sparse = f->sparse_index;
+	const size_t index_item = sparse ? sizeof(uint64_t) : BLOOMAP_INDEX_CHUNK_WORDS*sizeof(uint64_t);
+
+	size_t off = sizeof(FileHeader);
+	bool valid = h->index_logsize == f->index_logsize && h->nseeds == f->nseeds() &&
+		!memcmp(base + off, f->hash_seeds, 2*f->nseeds()*sizeof(uint32_t));
+	off = file_align(off + 2*h->nseeds*sizeof(uint32_t));
+	const uint32_t* index_pos = (const uint32_t*) (base + off);
+	off = file_align(off + h->nchunks*sizeof(uint32_t));
+	const char* index_data = base + off;
+	off = file_align(off + h->nchunks*index_item);
+	valid = valid && off <= size;
+
+	/* The index, in place */
+	for (unsigned i = 0; valid && i < h->nchunks; i++) {
+		if (sparse) {
+			valid = index_pos[i] < h->index_words;
+			if (valid) f->sparse_index->orWord(index_pos[i], ((const uint64_t*) index_data)[i]);
+		} else {
+			valid = index_pos[i] < BLOOMAP_INDEX_CHUNKS && !f->index_chunks[index_pos[i]];
+			if (valid) f->index_chunks[index_pos[i]] = (uint64_t*) (index_data + i*index_item);
+		}
+	}
+	f->index_words = h->index_words;
+
+	/* The maps, in place */
+	for (unsigned i = 0; valid && i < h->nmaps; i++) {
+		const FileMap* fm = (const FileMap*) (base + off);
+		valid = off + sizeof(FileMap) <= size;
+		if (!valid) break;
+		Bloomap* map = f->newMap();
+		off += sizeof(FileMap);
+		valid = fm->bits_size == map->bits_size && fm->index_size == map->index_size && fm->ncomp == map->ncomp &&
+			fm->compsize == map->compsize && fm->nfunc == map->nfunc &&
+			off + map->bits_size*sizeof(BITS_TYPE) <= size;
+		if (!valid) break;
+		map->useBits((BITS_TYPE*) (base + off));
+		map->specials = fm->specials;
+		off = file_align(off + map->bits_size*sizeof(BITS_TYPE));
+	}
+
+	/* Changes checkpointed since. A checkpoint cut short is dropped, so
+	 * the next one is appended right after the last committed one. */
+	if (valid) {
+		const std::string log = log_path(path);
+		long committed = 0;
+		valid = f->applyLog(log.c_str(), h->file_id, committed);
+		struct stat log_st;
+		/* A log which can't be cut can't be appended to either */
+		if (valid && !stat(log.c_str(), &log_st) && log_st.st_size > committed)
+			(void) !truncate(log.c_str(), committed);
+	}
+
+	if (!valid) {
+		/* Deleting the family splits the maps created so far, delete them
+		 * first. */
+		while (f->nmaps())
+			delete f->map(f->nmaps() - 1);
+		delete f;
+		return NULL;
+	}
+	return f;
+}
+
+bool BloomapFamily::checkpoint(const char* path) {
+	if (!isTrackingChanges() || changes_lost) return false;
+	FileHeader h;
+	FILE* base = fopen(path, "rb");
+	if (!base) return false;
+	bool ok = fread(&h, sizeof(h), 1, base) == 1 && !memcmp(h.magic, BLOOMAP_FILE_MAGIC, sizeof(BLOOMAP_FILE_MAGIC)) &&
+		h.version == BLOOMAP_FILE_VERSION;
+	fclose(base);
+	if (!ok) return false;
+
+	const std::string log = log_path(path);
+	FILE* fp = fopen(log.c_str(), "r+b");
+	if (!fp) fp = fopen(log.c_str(), "w+b");
+	if (!fp) return false;
+	LogHeader lh;
+	if (fread(&lh, sizeof(lh), 1, fp) != 1 || memcmp(lh.magic, BLOOMAP_LOG_MAGIC, sizeof(lh.magic)) ||
+			lh.version != BLOOMAP_FILE_VERSION || lh.file_id != h.file_id) {
+		/* A new log, or one of an older file */
+		memset(&lh, 0, sizeof(lh));
+		memcpy(lh.magic, BLOOMAP_LOG_MAGIC, sizeof(lh.magic));
+		lh.version = BLOOMAP_FILE_VERSION;
+		lh.file_id = h.file_id;
+		ok = !ftruncate(fileno(fp), 0) && !fseek(fp, 0, SEEK_SET) && fwrite(&lh, sizeof(lh), 1, fp) == 1;
+	}
+	ok = ok && !fseek(fp, 0, SEEK_END);
+	/* Where the log is cut back to if this fails */
+	const long start = ok ? ftell(fp) : -1;
+	ok = ok && start >= 0;
+
+	compactMaps();
+	DeltaHeader dh;
+	memset(&dh, 0, sizeof(dh));
+	memcpy(dh.magic, BLOOMAP_DELTA_MAGIC, sizeof(dh.magic));
+	dh.nmaps = bloomaps.size();
+	dh.index_words = index_words;
+	dh.nremoved = removed_maps.size();
+	for (unsigned i = 0; i < BLOOMAP_INDEX_DIRTY_SIZE; i++)
+		dh.nblocks += __builtin_popcountll(index_dirty[i]);
+	for (unsigned m = 0; m < bloomaps.size(); m++) {
+		const Bloomap* map = bloomaps[m];
+		for (unsigned i = 0; i < (map->dirtyBlocks() + 63) / 64; i++)
+			dh.nblocks += __builtin_popcountll(map->dirty[i]);
+	}
+	ok = ok && fwrite(&dh, sizeof(dh), 1, fp) == 1;
+
+	std::vector<uint32_t> removed(removed_maps);
+	std::sort(removed.begin(), removed.end());
+	removed.resize((removed.size() + 1) & ~1U, 0);
+	ok = ok && (removed.empty() || fwrite(&removed[0], sizeof(uint32_t), removed.size(), fp) == removed.size());
+
+	std::vector<SPECIALS_TYPE> specials((bloomaps.size() + 7) & ~7U, 0);
+	for (unsigned m = 0; m < bloomaps.size(); m++)
+		specials[m] = bloomaps[m]->specials;
+	ok = ok && fwrite(&specials[0], sizeof(SPECIALS_TYPE), specials.size(), fp) == specials.size();
+
+	/* The index blocks, of the chunks or of the sparse words */
+	std::vector<uint64_t> buf(BLOOMAP_DIRTY_WORDS);
+	for (unsigned i = 0; ok && i < BLOOMAP_INDEX_DIRTY_SIZE; i++) {
+		for (uint64_t w = index_dirty[i]; w; w &= w - 1) {
+			DeltaBlock b = { BLOOMAP_DELTA_INDEX, i*64 + __builtin_ctzll(w) };
+			const unsigned first = b.block << BLOOMAP_DIRTY_LOG;
+			if (sparse_index) {
+				for (unsigned j = 0; j < BLOOMAP_DIRTY_WORDS; j++)
+					buf[j] = indexWord(first + j);
+			} else {
+				const uint64_t* chunk = index_chunks[first >> BLOOMAP_INDEX_CHUNK_LOG];
+				assert(chunk);
+				memcpy(&buf[0], chunk + (first & (BLOOMAP_INDEX_CHUNK_WORDS - 1)), BLOOMAP_DIRTY_WORDS*sizeof(uint64_t));
+			}
+			ok = ok && fwrite(&b, sizeof(b), 1, fp) == 1 && fwrite(&buf[0], sizeof(uint64_t), BLOOMAP_DIRTY_WORDS, fp) == BLOOMAP_DIRTY_WORDS;
+		}
+	}
+	/* The map blocks, in place or unpacked */
+	for (unsigned m = 0; ok && m < bloomaps.size(); m++) {
+		const Bloomap* map = bloomaps[m];
+		for (unsigned i = 0; ok && i < (map->dirtyBlocks() + 63) / 64; i++) {
+			for (uint64_t w = map->dirty[i]; w; w &= w - 1) {
+				DeltaBlock b = { m, i*64 + __builtin_ctzll(w) };
+				const unsigned first = b.block << BLOOMAP_DIRTY_LOG;
+				const unsigned len = std::min(BLOOMAP_DIRTY_WORDS, map->bits_size - first);
+				ok = ok && fwrite(&b, sizeof(b), 1, fp) == 1 && fwrite(map->words(first, len, &buf[0]), sizeof(BITS_TYPE), len, fp) == len;
+			}
+		}
+	}
+
+	const uint64_t commit = BLOOMAP_DELTA_COMMIT;
+	ok = ok && fwrite(&commit, sizeof(commit), 1, fp) == 1;
+	/* Committed once on the disk */
+	ok = ok && !fflush(fp) && !fsync(fileno(fp));
+	if (!ok && start >= 0) {
+		fflush(fp);
+		(void) !ftruncate(fileno(fp), start);
+	}
+	if (fclose(fp)) ok = false;
+	if (ok) resetChanges();
+	return ok;
+}
+
+bool BloomapFamily::applyLog(const char* path, uint64_t file_id, long& committed) {
+	committed = 0;
+	FILE* fp = fopen(path, "rb");
+	if (!fp) return true; /* No changes */
+	LogHeader lh;
+	if (fread(&lh, sizeof(lh), 1, fp) != 1 || memcmp(lh.magic, BLOOMAP_LOG_MAGIC, sizeof(lh.magic)) ||
+			lh.version != BLOOMAP_FILE_VERSION || lh.file_id != file_id) {
+		/* Cut short before the first checkpoint, or of another file */
+		fclose(fp);
+		return true;
+	}
+	committed = ftell(fp);
+	compactMaps();
+	bool ok = true;
+
+	/* Checkpoints are read whole before applied, the last one may be cut
+	 * short */
+	std::vector<uint32_t> removed;
+	std::vector<Bloomap*> maps, gone;
+	std::vector<SPECIALS_TYPE> specials;
+	std::vector<DeltaBlock> blocks;
+	std::vector<uint64_t> data;
+	DeltaHeader dh;
+	while (ok && fread(&dh, sizeof(dh), 1, fp) == 1) {
+		ok = !memcmp(dh.magic, BLOOMAP_DELTA_MAGIC, sizeof(dh.magic)) && dh.nremoved <= bloomaps.size();
+		if (!ok) break;
+		removed.resize((dh.nremoved + 1) & ~1U);
+		if (!removed.empty() && fread(&removed[0], sizeof(uint32_t), removed.size(), fp) != removed.size()) break;
+		/* The maps once the deleted ones are dropped, which waits for the
+		 * commit */
+		maps.clear();
+		unsigned r = 0;
+		for (unsigned m = 0; m < bloomaps.size(); m++) {
+			if (r < dh.nremoved && removed[r] == m)
+				r++;
+			else
+				maps.push_back(bloomaps[m]);
+		}
+		/* All found, so in increasing order and none twice */
+		ok = r == dh.nremoved && dh.nmaps >= maps.size();
+		if (!ok) break;
+		specials.resize((dh.nmaps + 7) & ~7U);
+		if (fread(&specials[0], sizeof(SPECIALS_TYPE), specials.size(), fp) != specials.size()) break;
+		/* Maps created after the file was saved come whole */
+		const unsigned had = bloomaps.size();
+		while (maps.size() < dh.nmaps)
+			maps.push_back(newMap());
+
+		blocks.resize(dh.nblocks);
+		data.resize((size_t) dh.nblocks*BLOOMAP_DIRTY_WORDS);
+		bool whole = true;
+		for (unsigned i = 0; ok && whole && i < dh.nblocks; i++) {
+			DeltaBlock& b = blocks[i];
+			whole = fread(&b, sizeof(b), 1, fp) == 1;
+			if (!whole) break;
+			size_t len = BLOOMAP_DIRTY_WORDS;
+			if (b.map == BLOOMAP_DELTA_INDEX) {
+				ok = b.block < BLOOMAP_INDEX_DIRTY_SIZE*64;
+			} else {
+				ok = b.map < maps.size() && ((size_t) b.block << BLOOMAP_DIRTY_LOG) < maps[b.map]->bits_size;
+				if (ok) len = std::min((size_t) BLOOMAP_DIRTY_WORDS, maps[b.map]->bits_size - ((size_t) b.block << BLOOMAP_DIRTY_LOG));
+			}
+			whole = ok && fread(&data[(size_t) i*BLOOMAP_DIRTY_WORDS], sizeof(uint64_t), len, fp) == len;
+		}
+		uint64_t commit;
+		if (!ok) break;
+		if (!whole || fread(&commit, sizeof(commit), 1, fp) != 1 || commit != BLOOMAP_DELTA_COMMIT) {
+			while (bloomaps.size() > had)
+				delete bloomaps.back();
+			break;
+		}
+
+		gone.clear();
+		for (r = 0; r < dh.nremoved; r++)
+			gone.push_back(bloomaps[removed[r]]);
+		for (r = 0; r < gone.size(); r++)
+			delete gone[r];
+		compactMaps();
+		assert(bloomaps == maps);
+		for (unsigned m = 0; m < dh.nmaps; m++)
+			bloomaps[m]->specials = specials[m];
+		for (unsigned i = 0; i < dh.nblocks; i++) {
+			const DeltaBlock& b = blocks[i];
+			const uint64_t* src = &data[(size_t) i*BLOOMAP_DIRTY_WORDS];
+			const unsigned first = b.block << BLOOMAP_DIRTY_LOG;
+			if (b.map != BLOOMAP_DELTA_INDEX) {
+				Bloomap* map = bloomaps[b.map];
+				map->unpack();
+				memcpy(map->bits + first, src, std::min(BLOOMAP_DIRTY_WORDS, map->bits_size - first)*sizeof(BITS_TYPE));
+			} else if (sparse_index) {
+				/* The index only grows between checkpoints */
+				for (unsigned j = 0; j < BLOOMAP_DIRTY_WORDS; j++)
+					sparse_index->orWord(first + j, src[j]);
+			} else {
+				uint64_t* chunk = indexChunk(first >> BLOOMAP_INDEX_CHUNK_LOG);
+				memcpy(chunk + (first & (BLOOMAP_INDEX_CHUNK_WORDS - 1)), src, BLOOMAP_DIRTY_WORDS*sizeof(uint64_t));
+			}
+		}
+		if (dh.index_words > index_words)
+			index_words = dh.index_words;
+		committed = ftell(fp);
+	}
+	fclose(fp);
+	return ok;
+}
+
+bool BloomapFamily::compact(const char* path) {
+	BloomapFamily* f = load(path);
+	if (!f) return false;
+	bool ok = f->save(path);
+	while (f->nmaps())
+		delete f->map(f->nmaps() - 1);
+	delete f;
+	return ok;
+}
@@ -0,0 +1,176 @@
+/******************************************************************************
+ * Filename: bloomapkeys.h
+ *
+ * Created: 2026/10/17 16:05
+ *
+ ******************************************************************************/
+
+#ifndef __BLOOMAPKEYS_H__
+#define __BLOOMAPKEYS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "bloomap.h"
+#include "bloomapfamily.h"
+#include "murmur.h"
+
+/* Slots of the key table at first, a power of two */
+#define BLOOMAP_KEYS_MIN_SLOTS 1024
+
+/* The 64-bit hash of a key. Specialize it for other key types. */
+template<typename Key>
+struct BloomapKeyHash;
+
+template<>
+struct BloomapKeyHash<uint64_t> {
+	static uint64_t hash(const uint64_t& key, uint64_t seed) { return MurmurHash64(key, seed); }
+};
+
+template<>
+struct BloomapKeyHash<std::string> {
+	static uint64_t hash(const std::string& key, uint64_t seed) { return MurmurHash64A(key.data(), key.size(), seed); }
+};
+
+/* Keys wider than 32 bits (64-bit IDs, strings, ...) for the maps of a
+ * family. Each key is hashed once, into a strong 64-bit hash folded to the
+ * 32-bit element standing for it in the maps, and the k probes are derived
+ * from that element as usual. Two keys of the same element are the same to
+ * the maps, which adds about n/2^32 to the false positive rate of a map
+ * holding n keys.
+ *
+ * The elements are spread over all of the 32 bits, so the family should use
+ * BloomapFamily::INDEX_SPARSE. The hash is seeded by the family seed, so
+ * families of the same seed agree on the elements.
+ *
+ * The key table remembers the keys added through it by their element, and
+ * turns the elements the maps enumerate back into keys, every key of an
+ * element included. Like the family index it only grows. Map is any map
+ * type with the add(), contains() and enumerate() of Bloomap
+ * (CountingBloomap, ScalableBloomap, ...). Not for the concurrent mode. */
+template<typename Key, typename Hash = BloomapKeyHash<Key> >
+class BloomapKeys {
+	public:
+		BloomapKeys(BloomapFamily* f) : seed(f->seed), slots(BLOOMAP_KEYS_MIN_SLOTS) {}
+
+		/* The element standing for key in the maps */
+		uint32_t element(const Key& key) const {
+			const uint64_t h = Hash::hash(key, seed);
+			return (uint32_t) (h >> 32) ^ (uint32_t) h;
+		}
+
+		template<typename Map>
+		bool add(Map* map, const Key& key) {
+			const uint32_t ele = element(key);
+			record(ele, key);
+			return map->add(ele);
+		}
+		template<typename Map>
+		bool contains(Map* map, const Key& key) { return map->contains(element(key)); }
+
+		/* Same as Map::addBatch() and Map::containsBatch() */
+		template<typename Map>
+		bool addBatch(Map* map, const Key* keys, size_t n) {
+			uint32_t ele[BLOOMAP_BATCH];
+			bool any = false;
+			for (size_t i = 0; i < n; i += BLOOMAP_BATCH) {
+				const size_t len = (n - i < BLOOMAP_BATCH) ? n - i : BLOOMAP_BATCH;
+				for (size_t j = 0; j < len; j++) {
+					ele[j] = element(keys[i + j]);
+					record(ele[j], keys[i + j]);
+				}
+				any |= map->addBatch(ele, len);
+			}
+			return any;
+		}
+		template<typename Map>
+		void containsBatch(Map* map, const Key* keys, size_t n, uint64_t* result_bitmask) {
+			uint32_t ele[BLOOMAP_BATCH];
+			for (size_t i = 0; i < n; i += BLOOMAP_BATCH) {
+				const size_t len = (n - i < BLOOMAP_BATCH) ? n - i : BLOOMAP_BATCH;
+				for (size_t j = 0; j < len; j++)
+					ele[j] = element(keys[i + j]);
+				map->containsBatch(ele, len, result_bitmask + i / 64);
+			}
+		}
+
+		/* Calls fn(key) for each key of the table in the map, in the order
+		 * of Map::enumerate(). */
+		template<typename Map, typename F>
+		void forEach(Map* map, F fn) {
+			uint32_t buf[BLOOMAP_BATCH];
+			uint64_t cursor = 0;
+			while (cursor != BLOOMAP_ENUM_END) {
+				size_t n = map->enumerate(buf, BLOOMAP_BATCH, cursor);
+				for (size_t i = 0; i < n; i++)
+					visit(buf[i], fn);
+			}
+			/* Specials are not enumerated */
+			for (uint32_t e = 0; e < sizeof(SPECIALS_TYPE)*CHAR_BIT; e++)
+				if (map->contains(e))
+					visit(e, fn);
+		}
+		template<typename Map>
+		void enumerateAll(Map* map, std::vector<Key>& out) {
+			Append append = { &out };
+			forEach(map, append);
+		}
+
+		/* Keys in the table, and the memory it takes (not counting memory
+		 * the keys point to) in bytes */
+		size_t size(void) const { return keys.size(); }
+		size_t memoryUsage(void) const {
+			return keys.capacity()*sizeof(Key) + elements.capacity()*sizeof(uint32_t) +
+				slots.capacity()*sizeof(uint32_t);
+		}
+
+	private:
+		const uint64_t seed;
+		/* The keys and their elements, in the order added */
+		std::vector<Key> keys;
+		std::vector<uint32_t> elements;
+		/* Open addressing by the element, one plus the position of a key,
+		 * or zero for an empty slot. At most half full. */
+		std::vector<uint32_t> slots;
+
+		struct Append {
+			std::vector<Key>* out;
+			void operator()(const Key& key) { out->push_back(key); }
+		};
+
+		size_t slot(uint32_t ele) const { return ele & (slots.size() - 1); }
+		size_t next(size_t s) const { return (s + 1) & (slots.size() - 1); }
+
+		template<typename F>
+		void visit(uint32_t ele, F& fn) {
+			for (size_t s = slot(ele); slots[s]; s = next(s))
+				if (elements[slots[s] - 1] == ele)
+					fn(keys[slots[s] - 1]);
+		}
+
+		void record(uint32_t ele, const Key& key) {
+			size_t s = slot(ele);
+			for (; slots[s]; s = next(s))
+				if (elements[slots[s] - 1] == ele && keys[slots[s] - 1] == key)
+					return;
+			keys.push_back(key);
+			elements.push_back(ele);
+			slots[s] = keys.size();
+			if (2*keys.size() > slots.size())
+				rehash();
+		}
+
+		void rehash(void) {
+			std::vector<uint32_t> old(2*slots.size());
+			old.swap(slots);
+			for (size_t i = 0; i < elements.size(); i++) {
+				size_t s = slot(elements[i]);
+				while (slots[s]) s = next(s);
+				slots[s] = i + 1;
+			}
+		}
+};
+
+#endif
@@ -9,42 +9,41 @@
 #include "murmur.h"
 #include "bloomfilter.h"
 
-/* This is static vector of hash functions. There are in fact seeds for the
- * murmur hash function, and are generated in constructor randomly, as needed */
-static std::vector<uint32_t> hashfn_a;
-static std::vector<uint32_t> hashfn_b;
-
 /*
  * Create a simple instance, with k compartments, each with it's own hash
  * function, and split m bits into all components.
  */
-BloomFilter::BloomFilter(unsigned m, unsigned k) {
-	_init(k, m/k, 1);
+BloomFilter::BloomFilter(unsigned m, unsigned k, uint64_t seed) {
+	_init(k, m/k, 1, seed);
 }
 
 BloomFilter::BloomFilter(BloomFilter *orig) {
 
-	_init(orig->ncomp, orig->compsize, orig->nfunc);
-
-	for (unsigned comp = 0; comp < ncomp; comp++) {
-		for (unsigned pos = 0; pos < orig->compsize; pos++) {
-			bits[comp*bits_segsize + pos] = orig->bits[comp*bits_segsize + pos];
-		}
-	}
+	_init(orig->ncomp, orig->compsize, orig->nfunc, orig->seed);
+	/* _init() rounds the (already rounded) compartment size once more, take
+	 * the geometry as is. Whole segments are copied, compsize is in bits. */
+	compsize = orig->compsize;
+	compsize_shiftbits = orig->compsize_shiftbits;
+	bits_segsize = orig->bits_segsize;
+	bits_size = orig->bits_size;
+	delete[] bits;
+	bits = new BITS_TYPE[bits_size];
+	memcpy(bits, orig->bits, bits_size*sizeof(BITS_TYPE));
 }
 
 /*
  * Create rather convoluted instance, parametrized with number of components,
  * component size, and number of hash functions for EACH component.
  */
-BloomFilter::BloomFilter(unsigned ncomp, unsigned compsize, unsigned nfunc) {
-	_init(ncomp, compsize, nfunc);
+BloomFilter::BloomFilter(unsigned ncomp, unsigned compsize, unsigned nfunc, uint64_t seed) {
+	_init(ncomp, compsize, nfunc, seed);
 }
 
-void BloomFilter::_init(unsigned _ncomp, unsigned _compsize, unsigned _nfunc) {
+void BloomFilter::_init(unsigned _ncomp, unsigned _compsize, unsigned _nfunc, uint64_t _seed) {
 	ncomp = _ncomp;
 	compsize = _compsize;
 	nfunc = _nfunc;
+	seed = _seed;
 
 	assert(ncomp);
 	assert(compsize);
@@ -59,13 +58,14 @@ void BloomFilter::_init(unsigned _ncomp, unsigned _compsize, unsigned _nfunc) {
 		}
 	}
 
-	/* Generate seeds for all the hash functions */
-	while (hashfn_a.size() < nfunc*ncomp) {
-		/* TODO: Possibly ensure different functions */
-		unsigned a = rand();
-		while (a == 0) a = rand();
-		hashfn_a.push_back(a);
-		hashfn_b.push_back(rand());
+	/* Derive seeds for all the hash functions from the filter seed */
+	uint64_t state = seed;
+	hashfn_a.resize(nfunc*ncomp);
+	hashfn_b.resize(nfunc*ncomp);
+	for (unsigned i = 0; i < nfunc*ncomp; i++) {
+		uint64_t r = SplitMix64(&state);
+		hashfn_a[i] = ((uint32_t) r) | 1;
+		hashfn_b[i] = (uint32_t) (r >> 32);
 	}
 
 	/* Generate compartments */
@@ -76,7 +76,7 @@ void BloomFilter::_init(unsigned _ncomp, unsigned _compsize, unsigned _nfunc) {
 }
 
 BloomFilter::~BloomFilter() {
-
+	delete[] bits;
 }
 
 void BloomFilter::clear(void) {
@@ -128,12 +128,11 @@ void BloomFilter::dump(void) {
 }
 
 unsigned BloomFilter::popcount(void) {
+	/* Bits are only ever set through set(), so counting whole words gives
+	 * the same result as testing every bit with get(). */
 	unsigned count = 0;
-	for (unsigned comp = 0; comp < ncomp; comp++) {
-		for (unsigned i = 0; i < compsize; i++) {
-			if (get(comp,i)) count++;
-		}
-	}
+	for (unsigned i = 0; i < bits_size; i++)
+		count += __builtin_popcount(bits[i]);
 	return count;
 }
 
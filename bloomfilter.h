@@ -16,16 +16,20 @@
 
 #define BITS_TYPE unsigned
 
+/* Seed of the hash functions used when none is given */
+#define BLOOMFILTER_DEFAULT_SEED 0x426c6f6f6d6170ULL
+
 class BloomFilter {
 	public:
-		BloomFilter(unsigned m, unsigned k);
+		BloomFilter(unsigned m, unsigned k, uint64_t seed = BLOOMFILTER_DEFAULT_SEED);
 		/* Constructor takes arguments:
 		 * 	ncomp		number of compartments in the bloom filter
 		 * 	compsize	size of each compartment, in bits
 		 * 	nfunc		number of hash functions used in each compartment
+		 * 	seed		seed the hash functions are derived from
 		 */
-		BloomFilter(unsigned ncomp, unsigned compsize, unsigned _nfunc);
-		void _init(unsigned _ncomp, unsigned _compsize, unsigned _nfunc);
+		BloomFilter(unsigned ncomp, unsigned compsize, unsigned _nfunc, uint64_t seed = BLOOMFILTER_DEFAULT_SEED);
+		void _init(unsigned _ncomp, unsigned _compsize, unsigned _nfunc, uint64_t seed);
 		BloomFilter(BloomFilter *orig);
 		~BloomFilter();
 
@@ -56,6 +60,9 @@ class BloomFilter {
 	protected:
 		unsigned nfunc, compsize, compsize_shiftbits, ncomp, bits_segsize, bits_size;
 		BITS_TYPE* bits;
+		/* Seeds of the hash functions, same seed gives same functions */
+		uint64_t seed;
+		std::vector<uint32_t> hashfn_a, hashfn_b;
 
 		/* The data manipulation functions. The class-wide changed flag is
 		 * used, and has to be reset by it's user. */
@@ -1,11 +1,23 @@
 #include <catch/catch.hpp>
 #include <vector>
 #include <map>
+#include <set>
+#include <algorithm>
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "bloomap.h"
 #include "bloomapfamily.h"
+#include "bitkernels.h"
+#include "bloomapexpr.h"
+#include "staticbloomap.h"
+#include "countingbloomap.h"
+#include "scalablebloomap.h"
+#include "bloomapkeys.h"
 
 #define ELE 100
 #define ELE_BENCH 1000000
@@ -224,6 +236,2034 @@ TEST_CASE( "***** Bloomap intersection.", "[intersection]" ) {
 	delete f;
 }
 
+TEST_CASE( "***** Blocked layout.", "[blocked]" ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(ELE, 0.01, BloomapFamily::LAYOUT_BLOCKED);
+	Bloomap* map1 = f->newMap();
+	Bloomap* map2 = f->newMap();
+	Bloomap* mapi = f->newMap();
+
+	REQUIRE( map1->popcount() == 0 );
+	REQUIRE( map1->isEmpty() );
+
+	SECTION("--> fill with random elements and check them") {
+		for (unsigned i = 0; i < ITER; i++) {
+			map1->clear();
+			Contents c = bloomap_fill(map1, ELE);
+			REQUIRE( bloomap_count_elements(map1, c) == ELE );
+		}
+	}
+
+	SECTION("--> FP rate is acceptable") {
+		/* Blocked filters trade some FP rate for locality, be more lenient. */
+		for (unsigned i = 0; i < ITER; i++) {
+			Contents c = bloomap_fill(map1, ELE);
+			REQUIRE( bloomap_check_fp_rate(map1, c, 0.02*SLACK) );
+			map1->clear();
+		}
+	}
+
+	SECTION("--> Union and intersection") {
+		Contents c1 = bloomap_fill(map1, ELE/2);
+		Contents c2 = bloomap_fill(map2, ELE/2);
+		map1->add(666);
+		map2->add(666);
+		unsigned non_intersecting = gen_element(map2);
+		map1->add(non_intersecting);
+
+		mapi->add(map1);
+		REQUIRE( bloomap_count_elements(mapi, c1) == c1.size() );
+		mapi->intersect(map2);
+		REQUIRE( mapi->contains(666) );
+		REQUIRE( !mapi->contains(non_intersecting) );
+		REQUIRE( !mapi->isEmpty() );
+		REQUIRE( !Bloomap::isIntersectionEmpty(&map1, 1) );
+
+		mapi->or_from(map1);
+		REQUIRE( bloomap_count_elements(mapi, c1) == c1.size() );
+	}
+
+	SECTION("--> Enumeration finds all elements") {
+		Contents c = bloomap_fill(map1, ELE);
+		unsigned found_from_c = 0, found_not_in_map = 0, e;
+		BLOOMAP_FOR_EACH(e, map1) {
+			if (c.count(e)) found_from_c++;
+			if (!map1->contains(e)) found_not_in_map++;
+		}
+		REQUIRE( found_from_c == c.size() );
+		REQUIRE( found_not_in_map == 0 );
+	}
+
+	SECTION("--> Batch operations agree") {
+		vector<uint32_t> ele;
+		for (unsigned i = 0; i < 10*ELE; i++)
+			ele.push_back(rand());
+		for (unsigned i = 0; i < ELE; i++)
+			map1->add(ele[i]);
+		map2->addBatch(&ele[0], ELE);
+		REQUIRE( *map1 == map2 );
+
+		vector<uint64_t> result((ele.size() + 63) / 64);
+		map1->containsBatch(&ele[0], ele.size(), &result[0]);
+		unsigned mismatches = 0;
+		for (unsigned i = 0; i < ele.size(); i++) {
+			if ((bool) ((result[i / 64] >> (i % 64)) & 1) != map1->contains(ele[i])) mismatches++;
+		}
+		REQUIRE( mismatches == 0 );
+	}
+
+	delete map1;
+	delete map2;
+	delete mapi;
+	delete f;
+}
+
+TEST_CASE( "***** Compile-time specialised maps.", "[static]" ) {
+	BloomapFamily *f = BloomapFamily::forCompartments(7, 10);
+	StaticBloomap<7, 10>* smap = f->newStaticMap<7, 10>();
+	Bloomap* dmap = f->newMap();
+
+	REQUIRE( smap->popcount() == 0 );
+
+	SECTION("--> Same bits as a dynamic map") {
+		for (unsigned i = 0; i < ELE; i++) {
+			unsigned e = (i % 10) ? rand() : i;
+			REQUIRE( smap->add(e) == dmap->add(e) );
+		}
+		REQUIRE( *smap == dmap );
+		for (unsigned i = 0; i < 10*ELE; i++) {
+			unsigned e = rand();
+			REQUIRE( smap->contains(e) == dmap->contains(e) );
+		}
+	}
+
+	SECTION("--> Works with the dynamic interface") {
+		Contents c;
+		for (unsigned i = 0; i < ELE; i++) {
+			unsigned e = rand();
+			smap->add(e);
+			c[e] = true;
+		}
+		REQUIRE( bloomap_count_elements(smap, c) == c.size() );
+
+		unsigned found_from_c = 0, e;
+		BLOOMAP_FOR_EACH(e, smap) {
+			if (c.count(e)) found_from_c++;
+		}
+		REQUIRE( found_from_c == c.size() );
+
+		dmap->add(smap);
+		dmap->intersect(smap);
+		REQUIRE( *dmap == smap );
+	}
+
+	delete smap;
+	delete dmap;
+	delete f;
+}
+
+TEST_CASE( "***** Hash seeds are per family.", "[seed]" ) {
+	BloomapFamily *f1 = BloomapFamily::forElementsAndProb(ELE, 0.01, BloomapFamily::LAYOUT_COMPARTMENTS, 42);
+	BloomapFamily *f2 = BloomapFamily::forElementsAndProb(ELE, 0.01, BloomapFamily::LAYOUT_COMPARTMENTS, 42);
+	BloomapFamily *f3 = BloomapFamily::forElementsAndProb(ELE, 0.01, BloomapFamily::LAYOUT_COMPARTMENTS, 43);
+	Bloomap* map1 = f1->newMap();
+	Bloomap* map2 = f2->newMap();
+	Bloomap* map3 = f3->newMap();
+
+	REQUIRE( memcmp(f1->seeds(), f2->seeds(), 2*f1->nseeds()*sizeof(uint32_t)) == 0 );
+	REQUIRE( memcmp(f1->seeds(), f3->seeds(), 2*f1->nseeds()*sizeof(uint32_t)) != 0 );
+
+	/* Overfill the maps, so that false positives are common enough to
+	 * tell the hash functions apart. */
+	for (unsigned i = 0; i < 4*ELE; i++) {
+		unsigned e = rand();
+		map1->add(e);
+		map2->add(e);
+		map3->add(e);
+	}
+
+	SECTION("--> Same seed gives the same maps") {
+		REQUIRE( map1->popcount() == map2->popcount() );
+		for (unsigned i = 0; i < 10*ELE; i++) {
+			unsigned e = rand();
+			REQUIRE( map1->contains(e) == map2->contains(e) );
+		}
+	}
+
+	SECTION("--> Different seed gives different maps") {
+		unsigned differ = 0;
+		for (unsigned i = 0; i < 10*ELE; i++) {
+			unsigned e = rand();
+			if (map1->contains(e) != map3->contains(e)) differ++;
+		}
+		REQUIRE( differ > 0 );
+	}
+
+	SECTION("--> Split maps keep hashing") {
+		Bloomap* copy = new Bloomap(map1);
+		copy->splitFamily();
+		for (unsigned i = 0; i < 10*ELE; i++) {
+			unsigned e = rand();
+			REQUIRE( copy->contains(e) == map1->contains(e) );
+		}
+		delete copy;
+	}
+
+	delete map1;
+	delete map2;
+	delete map3;
+	delete f1;
+	delete f2;
+	delete f3;
+}
+
+TEST_CASE( "***** Batch insertion.", "[batch]" ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(ELE, 0.01);
+	Bloomap* map1 = f->newMap();
+	Bloomap* map2 = f->newMap();
+
+	vector<uint32_t> ele;
+	SECTION("--> Sequential elements, including specials") {
+		for (unsigned i = 0; i < 10*ELE; i++)
+			ele.push_back(i);
+	}
+	SECTION("--> Random elements") {
+		for (unsigned i = 0; i < 10*ELE; i++)
+			ele.push_back(rand());
+	}
+
+	for (unsigned i = 0; i < ele.size(); i++)
+		map1->add(ele[i]);
+	REQUIRE( map2->addBatch(&ele[0], ele.size()) );
+	REQUIRE( *map1 == map2 );
+	REQUIRE( !map2->addBatch(&ele[0], ele.size()) ); /* Nothing new */
+
+	/* The family index got the same elements, so enumeration must work. */
+	unsigned found = 0, e;
+	BLOOMAP_FOR_EACH(e, map2) {
+		if (map1->contains(e)) found++;
+	}
+	REQUIRE( found >= ele.size() );
+
+	delete map1;
+	delete map2;
+	delete f;
+}
+
+struct ConcurrentSlice {
+	Bloomap* map;
+	const uint32_t* ele;
+	size_t n;
+	bool batch;
+};
+
+void* concurrent_add(void* arg) {
+	ConcurrentSlice* s = (ConcurrentSlice*) arg;
+	if (s->batch) {
+		s->map->addBatch(s->ele, s->n);
+	} else {
+		for (size_t i = 0; i < s->n; i++)
+			s->map->add(s->ele[i]);
+	}
+	return NULL;
+}
+
+TEST_CASE( "***** Concurrent insertion.", "[concurrent]" ) {
+	const unsigned nthreads = 4;
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(10*ELE, 0.01);
+	Bloomap* ref = f->newMap();
+	Bloomap* shared = f->newMap();
+
+	/* Sequential ones share index words between threads, random ones
+	 * spread over many index chunks. */
+	vector<uint32_t> ele;
+	for (unsigned i = 0; i < 10*ELE; i++)
+		ele.push_back(i);
+	for (unsigned i = 0; i < 10*ELE; i++)
+		ele.push_back(rand());
+	random_shuffle(ele.begin(), ele.end());
+
+	f->setConcurrent(true);
+	pthread_t threads[nthreads];
+	ConcurrentSlice slices[nthreads];
+	size_t per_thread = ele.size() / nthreads;
+	for (unsigned t = 0; t < nthreads; t++) {
+		slices[t].map = shared;
+		slices[t].ele = &ele[t*per_thread];
+		slices[t].n = (t == nthreads - 1) ? ele.size() - t*per_thread : per_thread;
+		slices[t].batch = t % 2;
+		REQUIRE( pthread_create(&threads[t], NULL, concurrent_add, &slices[t]) == 0 );
+	}
+	for (unsigned t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	f->setConcurrent(false);
+
+	for (unsigned i = 0; i < ele.size(); i++)
+		ref->add(ele[i]);
+
+	SECTION("--> Same map as sequential insertion") {
+		REQUIRE( *ref == shared );
+		REQUIRE( !shared->add(ele[0]) );
+	}
+
+	SECTION("--> Enumeration finds all elements") {
+		set<unsigned> found;
+		unsigned e;
+		BLOOMAP_FOR_EACH(e, shared) {
+			found.insert(e);
+		}
+		unsigned missing = 0;
+		for (unsigned i = 0; i < ele.size(); i++)
+			if (!found.count(ele[i])) missing++;
+		REQUIRE( missing == 0 );
+	}
+
+	delete ref;
+	delete shared;
+	delete f;
+}
+
+set<unsigned> bloomap_enumerate(Bloomap* map) {
+	set<unsigned> found;
+	unsigned e;
+	BLOOMAP_FOR_EACH(e, map) {
+		found.insert(e);
+	}
+	return found;
+}
+
+vector<uint32_t> bloomap_enumerate_bulk(Bloomap* map, size_t cap) {
+	vector<uint32_t> res;
+	vector<uint32_t> buf(cap);
+	uint64_t cursor = 0;
+	while (cursor != BLOOMAP_ENUM_END) {
+		size_t n = map->enumerate(&buf[0], cap, cursor);
+		assert(n <= cap);
+		res.insert(res.end(), buf.begin(), buf.begin() + n);
+	}
+	return res;
+}
+
+struct CollectElements {
+	vector<uint32_t>* res;
+	void operator()(uint32_t e) { res->push_back(e); }
+};
+
+TEST_CASE( "***** Bulk enumeration.", "[enumerate]" ) {
+	BloomapFamily::Layout layout = BloomapFamily::LAYOUT_COMPARTMENTS;
+	BloomapFamily::IndexMode index_mode = BloomapFamily::INDEX_DENSE;
+	bool sequential = false;
+	/* Random IDs get a linear scan of the index, sequential ones walk the
+	 * words hash by hash. */
+	SECTION("--> Dense index") {}
+	SECTION("--> Dense index, sequential IDs") { sequential = true; }
+	SECTION("--> Blocked layout") { layout = BloomapFamily::LAYOUT_BLOCKED; }
+	SECTION("--> Sparse index") { index_mode = BloomapFamily::INDEX_SPARSE; }
+	SECTION("--> Sparse index, sequential IDs") { index_mode = BloomapFamily::INDEX_SPARSE; sequential = true; }
+	SECTION("--> Bucketed index") { index_mode = BloomapFamily::INDEX_BUCKETED; }
+	SECTION("--> Bucketed index, sequential IDs") { index_mode = BloomapFamily::INDEX_BUCKETED; sequential = true; }
+
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(10*ELE, 0.01, layout, BLOOMAP_DEFAULT_SEED, index_mode);
+	Bloomap* map1 = f->newMap();
+	Bloomap* map2 = f->newMap();
+	for (unsigned i = 0; i < 10*ELE; i++) {
+		map1->add((i % 3 && !sequential) ? rand() : i);
+		map2->add(sequential ? 10*ELE + i : rand());
+	}
+
+	/* Same elements as the iterator, in the same order for all caps */
+	vector<uint32_t> ref;
+	unsigned e;
+	BLOOMAP_FOR_EACH(e, map1) {
+		ref.push_back(e);
+	}
+	REQUIRE( ref.size() >= 10*ELE );
+
+	vector<uint32_t> bulk = bloomap_enumerate_bulk(map1, 1 << 16);
+	REQUIRE( bloomap_enumerate_bulk(map1, BLOOMAP_BATCH) == bulk );
+	REQUIRE( bloomap_enumerate_bulk(map1, 7) == bulk );
+	REQUIRE( bloomap_enumerate_bulk(map1, 1) == bulk );
+
+	vector<uint32_t> each;
+	CollectElements collect;
+	collect.res = &each;
+	map1->forEach(collect);
+	REQUIRE( each == bulk );
+
+	sort(ref.begin(), ref.end());
+	sort(bulk.begin(), bulk.end());
+	REQUIRE( bulk == ref );
+
+	delete map1;
+	delete map2;
+	delete f;
+}
+
+TEST_CASE( "***** Parallel enumeration and purge.", "[enumerate]" ) {
+	BloomapFamily::IndexMode index_mode = BloomapFamily::INDEX_DENSE;
+	bool sequential = false;
+	SECTION("--> Dense index") {}
+	SECTION("--> Dense index, sequential IDs") { sequential = true; }
+	SECTION("--> Sparse index") { index_mode = BloomapFamily::INDEX_SPARSE; }
+	SECTION("--> Bucketed index, sequential IDs") { index_mode = BloomapFamily::INDEX_BUCKETED; sequential = true; }
+
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(10*ELE, 0.01, BloomapFamily::LAYOUT_COMPARTMENTS,
+			BLOOMAP_DEFAULT_SEED, index_mode);
+	Bloomap* map1 = f->newMap();
+	Bloomap* map2 = f->newMap();
+	vector<uint32_t> ele;
+	for (unsigned i = 0; i < 10*ELE; i++) {
+		ele.push_back(sequential ? i : rand());
+		map1->add(ele.back());
+		map2->add(sequential ? 10*ELE + i : rand());
+	}
+
+	vector<uint32_t> ref = bloomap_enumerate_bulk(map1, BLOOMAP_BATCH);
+	REQUIRE( f->threads() == 1 );
+	f->setThreads(4);
+	REQUIRE( f->threads() == 4 );
+
+	SECTION("--> Same elements and order as enumerate()") {
+		vector<uint32_t> all;
+		map1->enumerateAll(all);
+		REQUIRE( all == ref );
+		REQUIRE( map1->count() == ref.size() );
+	}
+
+	SECTION("--> Purge keeps the elements, and matches the serial one") {
+		Bloomap* serial = f->newMap();
+		serial->add(map1);
+		serial->add(map2);
+		Bloomap* parallel = f->newMap();
+		parallel->add(map1);
+		parallel->add(map2);
+		Bloomap* orig = f->newMap();
+		orig->add(parallel);
+
+		unsigned dropped = parallel->purge();
+		f->setThreads(1);
+		REQUIRE( serial->purge() == dropped );
+		REQUIRE( *parallel == serial );
+		REQUIRE( orig->popcount() - parallel->popcount() == dropped );
+		for (unsigned i = 0; i < ele.size(); i++)
+			REQUIRE( parallel->contains(ele[i]) );
+		REQUIRE( parallel->popcount() <= orig->popcount() );
+
+		/* The intersection only keeps the common false positives */
+		map1->intersect(map2);
+		unsigned before = map1->popcount();
+		map1->purge();
+		REQUIRE( map1->popcount() <= before );
+		REQUIRE( map1->count() == bloomap_enumerate_bulk(map1, BLOOMAP_BATCH).size() );
+
+		delete serial;
+		delete parallel;
+		delete orig;
+	}
+
+	SECTION("--> Batch purge matches purging one by one") {
+		Bloomap* maps[3];
+		Bloomap* single[3];
+		for (unsigned m = 0; m < 3; m++) {
+			maps[m] = f->newMap();
+			single[m] = f->newMap();
+		}
+		/* A small map, an intersection, and a map with a disjoint set of hashes */
+		maps[0]->add(map1);
+		maps[1]->add(map1);
+		maps[1]->intersect(map2);
+		maps[2]->add(12345);
+		for (unsigned m = 0; m < 3; m++)
+			single[m]->add(maps[m]);
+
+		unsigned dropped[3];
+		Bloomap::purge(maps, 3, dropped);
+		for (unsigned m = 0; m < 3; m++) {
+			REQUIRE( single[m]->purge() == dropped[m] );
+			REQUIRE( *maps[m] == single[m] );
+		}
+		REQUIRE( maps[2]->contains(12345) );
+
+		for (unsigned m = 0; m < 3; m++) {
+			delete maps[m];
+			delete single[m];
+		}
+	}
+
+	delete map1;
+	delete map2;
+	delete f;
+}
+
+TEST_CASE( "***** Pruning the family index.", "[index]" ) {
+	BloomapFamily::IndexMode index_mode = BloomapFamily::INDEX_DENSE;
+	SECTION("--> Dense index") {}
+	SECTION("--> Sparse index") { index_mode = BloomapFamily::INDEX_SPARSE; }
+	SECTION("--> Bucketed index") { index_mode = BloomapFamily::INDEX_BUCKETED; }
+
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(10*ELE, 0.01, BloomapFamily::LAYOUT_COMPARTMENTS,
+			BLOOMAP_DEFAULT_SEED, index_mode);
+	Bloomap* kept = f->newMap();
+	Bloomap* gone = f->newMap();
+	Bloomap* copy;
+	vector<uint32_t> ele;
+	for (unsigned i = 0; i < 10*ELE; i++) {
+		ele.push_back(((uint32_t) rand() << 16) ^ rand());
+		kept->add(ele.back());
+		gone->add(((uint32_t) rand() << 16) ^ rand());
+	}
+	kept->add(5);
+	REQUIRE( f->indexCardinality() <= 20*ELE + 1 );
+	REQUIRE( f->indexCardinality() > 19*ELE );
+
+	SECTION("--> Elements of deleted maps are removed") {
+		vector<uint32_t> before = bloomap_enumerate_bulk(kept, BLOOMAP_BATCH);
+		delete gone;
+		gone = NULL;
+		size_t removed = f->prune();
+		/* Some of them are false positives of the kept map */
+		REQUIRE( removed > 9*ELE );
+		REQUIRE( removed <= 10*ELE );
+		REQUIRE( f->indexCardinality() == before.size() );
+		REQUIRE( bloomap_enumerate(kept) == set<unsigned>(before.begin(), before.end()) );
+		for (unsigned i = 0; i < ele.size(); i++)
+			REQUIRE( kept->contains(ele[i]) );
+		REQUIRE( f->prune() == 0 );
+	}
+
+	SECTION("--> Copies and split maps") {
+		copy = new Bloomap(gone);
+		delete gone;
+		REQUIRE( f->prune() < ELE );
+		gone = copy;
+		gone->splitFamily();
+		REQUIRE( f->prune() > 9*ELE );
+	}
+
+	SECTION("--> Purging the maps in the same pass") {
+		Bloomap* ref = f->newMap();
+		kept->intersect(gone);
+		ref->add(kept);
+		ref->purge();
+		delete gone;
+		gone = NULL;
+		f->prune(true);
+		REQUIRE( *kept == ref );
+		REQUIRE( f->indexCardinality() == bloomap_enumerate(kept).size() );
+		delete ref;
+	}
+
+	SECTION("--> Maps outlive the family") {
+		delete gone;
+		gone = NULL;
+		delete f;
+		f = NULL;
+		REQUIRE( kept->family() == NULL );
+		for (unsigned i = 0; i < ele.size(); i++)
+			REQUIRE( kept->contains(ele[i]) );
+	}
+
+	delete gone;
+	delete kept;
+	delete f;
+}
+
+/* Loads path and checks it against f, map by map */
+bool bloomap_same_as_file(BloomapFamily* f, const char* path) {
+	BloomapFamily* g = BloomapFamily::load(path);
+	if (!g) return false;
+	bool same = g->nmaps() == f->nmaps() && g->indexCardinality() == f->indexCardinality();
+	for (unsigned i = 0; same && i < f->nmaps(); i++) {
+		same = g->map(i)->popcount() == f->map(i)->popcount() &&
+			bloomap_enumerate(g->map(i)) == bloomap_enumerate(f->map(i));
+	}
+	while (g->nmaps())
+		delete g->map(0);
+	delete g;
+	return same;
+}
+
+TEST_CASE( "***** Saving and loading families.", "[file]" ) {
+	BloomapFamily::IndexMode index_mode = BloomapFamily::INDEX_DENSE;
+	BloomapFamily::Layout layout = BloomapFamily::LAYOUT_COMPARTMENTS;
+	SECTION("--> Dense index") {}
+	SECTION("--> Sparse index") { index_mode = BloomapFamily::INDEX_SPARSE; }
+	SECTION("--> Bucketed index") { index_mode = BloomapFamily::INDEX_BUCKETED; }
+	SECTION("--> Blocked layout") { layout = BloomapFamily::LAYOUT_BLOCKED; }
+
+	char path[] = "/tmp/bloomap-test-XXXXXX";
+	int fd = mkstemp(path);
+	REQUIRE( fd >= 0 );
+	close(fd);
+
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(10*ELE, 0.01, layout, 42, index_mode);
+	Bloomap* m1 = f->newMap();
+	Bloomap* m2 = f->newMap();
+	bloomap_fill(m1, 5*ELE, 7);
+	bloomap_fill(m2, ELE, 8);
+	m2->add(1);
+	REQUIRE( f->save(path) );
+
+	BloomapFamily *g = BloomapFamily::load(path);
+	REQUIRE( g != NULL );
+	REQUIRE( g->nmaps() == 2 );
+	REQUIRE( g->index_mode == index_mode );
+	REQUIRE( g->layout == layout );
+	REQUIRE( g->indexCardinality() == f->indexCardinality() );
+	Bloomap* l1 = g->map(0);
+	Bloomap* l2 = g->map(1);
+	REQUIRE( l1->popcount() == m1->popcount() );
+	REQUIRE( l2->popcount() == m2->popcount() );
+	REQUIRE( bloomap_enumerate(l1) == bloomap_enumerate(m1) );
+	REQUIRE( bloomap_enumerate_bulk(l2, BLOOMAP_BATCH) == bloomap_enumerate_bulk(m2, BLOOMAP_BATCH) );
+	REQUIRE( l2->contains(1) );
+
+	SECTION("--> Changes stay in memory") {
+		unsigned e = gen_element(l1);
+		l1->add(e);
+		l2->clear();
+		REQUIRE( l1->contains(e) );
+		BloomapFamily *h = BloomapFamily::load(path);
+		REQUIRE( h != NULL );
+		REQUIRE( !h->map(0)->contains(e) );
+		REQUIRE( bloomap_enumerate(h->map(1)) == bloomap_enumerate(m2) );
+		while (h->nmaps())
+			delete h->map(0);
+		delete h;
+	}
+
+	SECTION("--> Maps outlive the loaded family") {
+		delete g;
+		g = NULL;
+		REQUIRE( l1->family() == NULL );
+		REQUIRE( l1->popcount() == m1->popcount() );
+		REQUIRE( l2->contains(1) );
+		delete l1;
+		delete l2;
+	}
+
+	SECTION("--> Deleted maps keep the order of the others") {
+		Bloomap* t[4];
+		for (unsigned i = 0; i < 4; i++) {
+			t[i] = f->newMap();
+			bloomap_fill(t[i], ELE, 20 + i);
+		}
+		delete t[0];
+		delete t[2];
+		REQUIRE( f->nmaps() == 4 );
+		REQUIRE( f->map(0) == m1 );
+		REQUIRE( f->map(1) == m2 );
+		REQUIRE( f->map(2) == t[1] );
+		REQUIRE( f->map(3) == t[3] );
+		REQUIRE( f->save(path) );
+		REQUIRE( bloomap_same_as_file(f, path) );
+		/* In reverse order, and from the front, as many at once */
+		for (unsigned i = 0; i < 1000; i++)
+			f->newMap();
+		for (unsigned i = 0; i < 500; i++)
+			delete f->map(f->nmaps() - 1);
+		while (f->nmaps() > 4)
+			delete f->map(4);
+		REQUIRE( f->map(3) == t[3] );
+		delete t[1];
+		delete t[3];
+		REQUIRE( f->nmaps() == 2 );
+		REQUIRE( f->map(1) == m2 );
+	}
+
+	SECTION("--> Truncated and corrupt files") {
+		/* Not while the file is mapped */
+		delete l1;
+		delete l2;
+		delete g;
+		g = NULL;
+		REQUIRE( truncate(path, 4096) == 0 );
+		REQUIRE( BloomapFamily::load(path) == NULL );
+		FILE* fp = fopen(path, "wb");
+		fputs("not a family", fp);
+		fclose(fp);
+		REQUIRE( BloomapFamily::load(path) == NULL );
+		REQUIRE( BloomapFamily::load("/nonexistent/bloomap") == NULL );
+	}
+
+	if (g) {
+		delete l1;
+		delete l2;
+		delete g;
+	}
+	delete m1;
+	delete m2;
+	delete f;
+	unlink(path);
+}
+
+size_t file_size(const char* path) {
+	struct stat st;
+	return stat(path, &st) ? 0 : st.st_size;
+}
+
+TEST_CASE( "***** Incremental saving.", "[file]" ) {
+	BloomapFamily::IndexMode index_mode = BloomapFamily::INDEX_DENSE;
+	SECTION("--> Dense index") {}
+	SECTION("--> Sparse index") { index_mode = BloomapFamily::INDEX_SPARSE; }
+	SECTION("--> Bucketed index") { index_mode = BloomapFamily::INDEX_BUCKETED; }
+
+	char path[] = "/tmp/bloomap-test-XXXXXX";
+	int fd = mkstemp(path);
+	REQUIRE( fd >= 0 );
+	close(fd);
+	const string log = string(path) + ".log";
+
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(100*ELE, 0.01, BloomapFamily::LAYOUT_COMPARTMENTS,
+			BLOOMAP_DEFAULT_SEED, index_mode);
+	vector<Bloomap*> maps;
+	for (unsigned m = 0; m < 8; m++) {
+		maps.push_back(f->newMap());
+		for (unsigned i = 0; i < 50*ELE; i++)
+			maps[m]->add(rand() & 0xffffff);
+	}
+	REQUIRE( !f->checkpoint(path) );
+	REQUIRE( f->save(path) );
+	f->trackChanges(true);
+	REQUIRE( f->isTrackingChanges() );
+
+	/* Nothing changed yet */
+	REQUIRE( f->checkpoint(path) );
+	REQUIRE( file_size(log.c_str()) < 1024 );
+	REQUIRE( bloomap_same_as_file(f, path) );
+
+	SECTION("--> Small changes write a few blocks") {
+		for (unsigned i = 0; i < 10; i++)
+			maps[3]->add(1000000 + i);
+		maps[5]->add(3);
+		REQUIRE( f->checkpoint(path) );
+		REQUIRE( file_size(log.c_str()) < file_size(path) / 10 );
+		REQUIRE( bloomap_same_as_file(f, path) );
+
+		/* Checkpoints pile up */
+		vector<uint32_t> batch;
+		for (unsigned i = 0; i < 100; i++)
+			batch.push_back(2000000 + 7*i);
+		maps[0]->addBatch(&batch[0], batch.size());
+		maps[1]->intersect(maps[2]);
+		REQUIRE( f->checkpoint(path) );
+		REQUIRE( bloomap_same_as_file(f, path) );
+	}
+
+	SECTION("--> New maps") {
+		maps.push_back(f->newMap());
+		maps.back()->add(42);
+		maps.push_back(new Bloomap(maps[0]));
+		REQUIRE( f->checkpoint(path) );
+		REQUIRE( bloomap_same_as_file(f, path) );
+	}
+
+	SECTION("--> A checkpoint cut short is ignored") {
+		maps[2]->add(77);
+		REQUIRE( f->checkpoint(path) );
+		size_t good = file_size(log.c_str());
+		unsigned pc = maps[2]->popcount();
+		maps.push_back(f->newMap());
+		maps[2]->add(78);
+		maps.back()->add(79);
+		REQUIRE( f->checkpoint(path) );
+		REQUIRE( truncate(log.c_str(), file_size(log.c_str()) - 8) == 0 );
+		BloomapFamily *g = BloomapFamily::load(path);
+		REQUIRE( g != NULL );
+		REQUIRE( g->nmaps() == 8 );
+		REQUIRE( g->map(2)->contains(77) );
+		REQUIRE( g->map(2)->popcount() == pc );
+		while (g->nmaps())
+			delete g->map(0);
+		delete g;
+		REQUIRE( truncate(log.c_str(), good) == 0 );
+		delete maps.back();
+		maps.pop_back();
+	}
+
+	SECTION("--> Checkpoints after one cut short") {
+		maps[2]->add(5000);
+		REQUIRE( f->checkpoint(path) );
+		REQUIRE( truncate(log.c_str(), file_size(log.c_str()) - 4) == 0 );
+		BloomapFamily *g = BloomapFamily::load(path);
+		REQUIRE( g != NULL );
+		g->trackChanges(true);
+		g->map(2)->add(7000);
+		REQUIRE( g->checkpoint(path) );
+		while (g->nmaps())
+			delete g->map(0);
+		delete g;
+		g = BloomapFamily::load(path);
+		REQUIRE( g != NULL );
+		REQUIRE( g->map(2)->contains(7000) );
+		while (g->nmaps())
+			delete g->map(0);
+		delete g;
+	}
+
+	SECTION("--> Logs of an older file are ignored") {
+		maps[7]->add(5000);
+		REQUIRE( f->checkpoint(path) );
+		const string stale = string(path) + ".stale";
+		REQUIRE( rename(log.c_str(), stale.c_str()) == 0 );
+		/* A file of the same size, and a crash before the old log was
+		 * removed */
+		const size_t size = file_size(path);
+		maps[7]->clear();
+		REQUIRE( f->save(path) );
+		REQUIRE( file_size(path) == size );
+		REQUIRE( rename(stale.c_str(), log.c_str()) == 0 );
+		BloomapFamily *g = BloomapFamily::load(path);
+		REQUIRE( g != NULL );
+		REQUIRE( g->map(7)->isEmpty() );
+		while (g->nmaps())
+			delete g->map(0);
+		delete g;
+		/* And started over by the next checkpoint */
+		REQUIRE( f->checkpoint(path) );
+		REQUIRE( bloomap_same_as_file(f, path) );
+	}
+
+	SECTION("--> Compaction") {
+		maps[6]->add(123456);
+		REQUIRE( f->checkpoint(path) );
+		REQUIRE( BloomapFamily::compact(path) );
+		REQUIRE( file_size(log.c_str()) == 0 );
+		REQUIRE( bloomap_same_as_file(f, path) );
+		/* The log starts over for the new file */
+		maps[6]->add(654321);
+		REQUIRE( f->checkpoint(path) );
+		REQUIRE( bloomap_same_as_file(f, path) );
+	}
+
+	SECTION("--> Deleted maps") {
+		delete maps[1];
+		maps.erase(maps.begin() + 1);
+		REQUIRE( f->checkpoint(path) );
+		REQUIRE( bloomap_same_as_file(f, path) );
+		maps.push_back(f->newMap());
+		maps.back()->add(4242);
+		REQUIRE( f->checkpoint(path) );
+		delete maps[0];
+		maps.erase(maps.begin());
+		delete maps[4];
+		maps.erase(maps.begin() + 4);
+		maps[2]->add(4343);
+		REQUIRE( f->checkpoint(path) );
+		REQUIRE( f->nmaps() == 6 );
+		REQUIRE( bloomap_same_as_file(f, path) );
+	}
+
+	SECTION("--> Temporary maps between checkpoints") {
+		const unsigned e = gen_element(maps[0]);
+		maps[0]->add(e);
+		Bloomap* t = new Bloomap(maps[0]);
+		t->intersect(maps[1]);
+		delete t;
+		maps[0]->add(e + 1);
+		REQUIRE( f->checkpoint(path) );
+		REQUIRE( bloomap_same_as_file(f, path) );
+		/* One alive at a checkpoint is logged, and dropped by the next */
+		t = f->newMap();
+		t->add(17);
+		REQUIRE( f->checkpoint(path) );
+		delete t;
+		maps[3]->add(e);
+		REQUIRE( f->checkpoint(path) );
+		BloomapFamily *g = BloomapFamily::load(path);
+		REQUIRE( g != NULL );
+		REQUIRE( g->nmaps() == 8 );
+		REQUIRE( g->map(0)->contains(e + 1) );
+		REQUIRE( g->map(3)->contains(e) );
+		while (g->nmaps())
+			delete g->map(0);
+		delete g;
+		REQUIRE( bloomap_same_as_file(f, path) );
+	}
+
+	SECTION("--> Pruning needs a full save") {
+		f->prune();
+		REQUIRE( !f->checkpoint(path) );
+		REQUIRE( f->save(path) );
+		REQUIRE( bloomap_same_as_file(f, path) );
+	}
+
+	SECTION("--> Loaded families keep tracking") {
+		BloomapFamily *g = BloomapFamily::load(path);
+		REQUIRE( g != NULL );
+		g->trackChanges(true);
+		g->map(4)->add(99);
+		REQUIRE( g->checkpoint(path) );
+		maps[4]->add(99);
+		REQUIRE( bloomap_same_as_file(f, path) );
+		while (g->nmaps())
+			delete g->map(0);
+		delete g;
+	}
+
+	for (unsigned m = 0; m < maps.size(); m++)
+		delete maps[m];
+	delete f;
+	unlink(log.c_str());
+	unlink(path);
+}
+
+TEST_CASE( "***** Bucketed family index.", "[index]" ) {
+	/* Few hashes and many words for each of them, over several tiles */
+	unsigned space = 100;
+	SECTION("--> Small family") {}
+	/* Too many hashes for a tile, falls back to the dense layout */
+	SECTION("--> Large family") { space = 1 << 22; }
+
+	BloomapFamily *fd = BloomapFamily::forElementsAndProb(space, 0.01, BloomapFamily::LAYOUT_COMPARTMENTS,
+			BLOOMAP_DEFAULT_SEED, BloomapFamily::INDEX_DENSE);
+	BloomapFamily *fb = BloomapFamily::forElementsAndProb(space, 0.01, BloomapFamily::LAYOUT_COMPARTMENTS,
+			BLOOMAP_DEFAULT_SEED, BloomapFamily::INDEX_BUCKETED);
+	Bloomap* prefill_d = fd->newMap();
+	Bloomap* prefill_b = fb->newMap();
+	for (unsigned i = 0; i < (1U << 20); i++) {
+		prefill_d->add(i);
+		prefill_b->add(i);
+	}
+
+	Bloomap* dense = fd->newMap();
+	Bloomap* bucketed = fb->newMap();
+	vector<uint32_t> ele;
+	for (unsigned i = 0; i < space && i < 200; i++)
+		ele.push_back(rand());
+	ele.push_back((1U << 20) + 5);
+	for (unsigned i = 0; i < ele.size(); i++) {
+		dense->add(ele[i]);
+		bucketed->add(ele[i]);
+	}
+
+	set<unsigned> found = bloomap_enumerate(bucketed);
+	REQUIRE( found == bloomap_enumerate(dense) );
+	for (unsigned i = 0; i < ele.size(); i++)
+		REQUIRE( found.count(ele[i]) );
+
+	vector<uint32_t> bulk = bloomap_enumerate_bulk(bucketed, BLOOMAP_BATCH);
+	REQUIRE( set<unsigned>(bulk.begin(), bulk.end()) == found );
+
+	bucketed->purge();
+	dense->purge();
+	REQUIRE( bloomap_enumerate(bucketed) == bloomap_enumerate(dense) );
+
+	delete prefill_d;
+	delete prefill_b;
+	delete dense;
+	delete bucketed;
+	delete fd;
+	delete fb;
+}
+
+TEST_CASE( "***** Sparse family index.", "[index]" ) {
+	BloomapFamily *fd = BloomapFamily::forElementsAndProb(10*ELE, 0.01, BloomapFamily::LAYOUT_COMPARTMENTS,
+			BLOOMAP_DEFAULT_SEED, BloomapFamily::INDEX_DENSE);
+	BloomapFamily *fs = BloomapFamily::forElementsAndProb(10*ELE, 0.01, BloomapFamily::LAYOUT_COMPARTMENTS,
+			BLOOMAP_DEFAULT_SEED, BloomapFamily::INDEX_SPARSE);
+	Bloomap* dense = fd->newMap();
+	Bloomap* sparse = fs->newMap();
+	Bloomap* other = fs->newMap();
+	/* Same in both indexes, so false positives of the maps agree */
+	Bloomap* other_dense = fd->newMap();
+
+	/* Sparse 32-bit IDs, including the very top of the range, and a run
+	 * of sequential ones long enough for bitmap containers. */
+	vector<uint32_t> ele;
+	for (unsigned i = 0; i < 10*ELE; i++)
+		ele.push_back(((uint32_t) rand() << 16) ^ rand());
+	ele.push_back(0xffffffff);
+	for (unsigned i = 0; i < 10000; i++)
+		ele.push_back(100000 + i);
+	for (unsigned i = 0; i < ele.size(); i++) {
+		dense->add(ele[i]);
+		if (i % 2) sparse->add(ele[i]);
+	}
+	sparse->addBatch(&ele[0], ele.size());
+	other->add(12345);
+	other_dense->add(12345);
+
+	SECTION("--> Enumerates the same elements as the dense index") {
+		set<unsigned> found = bloomap_enumerate(sparse);
+		REQUIRE( found == bloomap_enumerate(dense) );
+		unsigned missing = 0;
+		for (unsigned i = 0; i < ele.size(); i++)
+			if (!found.count(ele[i])) missing++;
+		REQUIRE( missing == 0 );
+	}
+
+	SECTION("--> Same after optimizing") {
+		size_t before = fs->indexMemory();
+		fs->optimizeIndex();
+		REQUIRE( fs->indexMemory() < before );
+		REQUIRE( bloomap_enumerate(sparse) == bloomap_enumerate(dense) );
+
+		/* Appending to the runs, and breaking them */
+		for (unsigned i = 0; i < 100; i++) {
+			dense->add(110000 + i);
+			sparse->add(110000 + i);
+		}
+		dense->add(100000 - 2);
+		sparse->add(100000 - 2);
+		REQUIRE( bloomap_enumerate(sparse) == bloomap_enumerate(dense) );
+	}
+
+	SECTION("--> Takes much less memory for sparse IDs") {
+		REQUIRE( fs->indexMemory() * 10 < fd->indexMemory() );
+	}
+
+	SECTION("--> Other maps of the family see only their elements") {
+		set<unsigned> found = bloomap_enumerate(other);
+		REQUIRE( found.count(12345) );
+	}
+
+	delete dense;
+	delete sparse;
+	delete other;
+	delete other_dense;
+	delete fd;
+	delete fs;
+}
+
+vector<uint32_t> bloomap_sorted_elements(Bloomap* map) {
+	vector<uint32_t> res = bloomap_enumerate_bulk(map, BLOOMAP_BATCH);
+	sort(res.begin(), res.end());
+	return res;
+}
+
+/* Same contents, in maps of different families */
+bool bloomap_same_contents(Bloomap* a, Bloomap* b) {
+	return a->popcount() == b->popcount() && a->isEmpty() == b->isEmpty() &&
+		a->estimateCardinality() == b->estimateCardinality() &&
+		bloomap_sorted_elements(a) == bloomap_sorted_elements(b);
+}
+
+TEST_CASE( "***** Compressed maps.", "[compressed]" ) {
+	BloomapFamily::Layout layout = BloomapFamily::LAYOUT_COMPARTMENTS;
+	SECTION("--> Compartments") {}
+	SECTION("--> Blocked layout") { layout = BloomapFamily::LAYOUT_BLOCKED; }
+
+	/* Same seeds, so the maps of both families get the same bits */
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(100*ELE, 0.01, layout);
+	BloomapFamily *g = BloomapFamily::forElementsAndProb(100*ELE, 0.01, layout);
+	g->setCompression(false);
+	REQUIRE( f->isCompressing() );
+	REQUIRE( !g->isCompressing() );
+
+	/* A long tail of maps with a few elements, and a full one */
+	const unsigned n = 8;
+	vector<Bloomap*> fm, gm;
+	srand(42);
+	for (unsigned m = 0; m < n; m++) {
+		fm.push_back(f->newMap());
+		gm.push_back(g->newMap());
+		unsigned count = (m == n-1) ? 100*ELE : 3*(m + 1);
+		for (unsigned i = 0; i < count; i++) {
+			unsigned e = (m == 1 && i == 0) ? 3 : rand() & 0xfffff;
+			fm[m]->add(e);
+			gm[m]->add(e);
+		}
+	}
+	/* Shares all of its elements with map 0 */
+	fm[n-1]->add(fm[0]);
+	gm[n-1]->add(gm[0]);
+
+	SECTION("--> Sparse maps are packed") {
+		for (unsigned m = 0; m < n-1; m++) {
+			CAPTURE( m );
+			REQUIRE( fm[m]->isCompressed() );
+			REQUIRE( !gm[m]->isCompressed() );
+			REQUIRE( fm[m]->memoryUsage()*10 < gm[m]->memoryUsage() );
+		}
+		REQUIRE( !fm[n-1]->isCompressed() );
+		REQUIRE( fm[n-1]->memoryUsage() == gm[n-1]->memoryUsage() );
+	}
+
+	SECTION("--> Same answers as plain maps") {
+		vector<uint32_t> keys;
+		for (unsigned i = 0; i < 10*ELE; i++)
+			keys.push_back(i % 3 ? rand() & 0xfffff : i);
+		vector<uint64_t> fres((keys.size() + 63) / 64), gres((keys.size() + 63) / 64);
+		for (unsigned m = 0; m < n; m++) {
+			CAPTURE( m );
+			REQUIRE( bloomap_same_contents(fm[m], gm[m]) );
+			fm[m]->containsBatch(&keys[0], keys.size(), &fres[0]);
+			gm[m]->containsBatch(&keys[0], keys.size(), &gres[0]);
+			REQUIRE( fres == gres );
+			for (unsigned i = 0; i < keys.size(); i++)
+				REQUIRE( fm[m]->contains(keys[i]) == gm[m]->contains(keys[i]) );
+
+			vector<uint32_t> each;
+			unsigned e;
+			BLOOMAP_FOR_EACH(e, fm[m]) {
+				each.push_back(e);
+			}
+			sort(each.begin(), each.end());
+			REQUIRE( each == bloomap_sorted_elements(gm[m]) );
+
+			Bloomap* copy = new Bloomap(fm[m]);
+			REQUIRE( copy->isCompressed() == fm[m]->isCompressed() );
+			REQUIRE( *copy == fm[m] );
+			delete copy;
+		}
+	}
+
+	SECTION("--> Set operations across the forms") {
+		for (unsigned a = 0; a < n; a++) {
+			for (unsigned b = 0; b < n; b++) {
+				CAPTURE( a );
+				CAPTURE( b );
+				REQUIRE( fm[a]->isIntersectionEmpty(fm[b]) == gm[a]->isIntersectionEmpty(gm[b]) );
+				REQUIRE( fm[a]->estimateIntersectionCardinality(fm[b]) ==
+						gm[a]->estimateIntersectionCardinality(gm[b]) );
+				REQUIRE( fm[a]->estimateUnionCardinality(fm[b]) == gm[a]->estimateUnionCardinality(gm[b]) );
+
+				Bloomap* fx = new Bloomap(fm[a]);
+				Bloomap* gx = new Bloomap(gm[a]);
+				REQUIRE( fx->add(fm[b]) == gx->add(gm[b]) );
+				REQUIRE( bloomap_same_contents(fx, gx) );
+				fx->intersect(fm[b]);
+				gx->intersect(gm[b]);
+				REQUIRE( bloomap_same_contents(fx, gx) );
+				fx->clear();
+				REQUIRE( fx->isEmpty() );
+				fx->or_from(fm[a]);
+				gx->clear();
+				gx->or_from(gm[a]);
+				REQUIRE( bloomap_same_contents(fx, gx) );
+
+				BloomapExpr fe = BloomapExpr(fm[a]) & BloomapExpr(fm[b]);
+				BloomapExpr ge = BloomapExpr(gm[a]) & BloomapExpr(gm[b]);
+				REQUIRE( fe.popcount() == ge.popcount() );
+				REQUIRE( fe.isSubsetOf(fm[b]) );
+				REQUIRE( (BloomapExpr(fm[a]) | BloomapExpr(fm[b])).isSubsetOf(fm[n-1]) ==
+						(BloomapExpr(gm[a]) | BloomapExpr(gm[b])).isSubsetOf(gm[n-1]) );
+				fe.evaluate(fx);
+				ge.evaluate(gx);
+				REQUIRE( bloomap_same_contents(fx, gx) );
+				delete fx;
+				delete gx;
+			}
+		}
+		Bloomap* fm0[] = { fm[0], fm[1], fm[n-1] };
+		Bloomap* gm0[] = { gm[0], gm[1], gm[n-1] };
+		REQUIRE( Bloomap::isIntersectionEmpty(fm0, 3) == Bloomap::isIntersectionEmpty(gm0, 3) );
+	}
+
+	SECTION("--> Intersection with a sparse map packs") {
+		Bloomap* x = new Bloomap(fm[n-1]);
+		REQUIRE( !x->isCompressed() );
+		x->intersect(fm[0]);
+		REQUIRE( x->isCompressed() );
+		REQUIRE( bloomap_sorted_elements(x) == bloomap_sorted_elements(gm[0]) );
+		delete x;
+	}
+
+	SECTION("--> Purging keeps the form") {
+		Bloomap::purge(&fm[0], n);
+		Bloomap::purge(&gm[0], n);
+		for (unsigned m = 0; m < n; m++) {
+			REQUIRE( fm[m]->isCompressed() == (m < n-1) );
+			REQUIRE( bloomap_same_contents(fm[m], gm[m]) );
+		}
+	}
+
+	SECTION("--> Switching compression off and on") {
+		f->setCompression(false);
+		for (unsigned m = 0; m < n; m++) {
+			REQUIRE( !fm[m]->isCompressed() );
+			REQUIRE( bloomap_same_contents(fm[m], gm[m]) );
+		}
+		f->setCompression(true);
+		for (unsigned m = 0; m < n; m++)
+			REQUIRE( fm[m]->isCompressed() == (m < n-1) );
+		f->setConcurrent(true);
+		for (unsigned m = 0; m < n; m++)
+			REQUIRE( !fm[m]->isCompressed() );
+		f->setConcurrent(false);
+	}
+
+	for (unsigned m = 0; m < n; m++) {
+		delete fm[m];
+		delete gm[m];
+	}
+	delete f;
+	delete g;
+}
+
+TEST_CASE( "***** Bit array arena.", "[arena]" ) {
+	SECTION("--> Arrays are aligned and reused by size class") {
+		BloomapArena arena(1 << 20);
+		uint64_t* p = arena.alloc(100);
+		uint64_t* q = arena.alloc(3);
+		REQUIRE( (uintptr_t) p % BLOOMAP_ALIGN == 0 );
+		REQUIRE( (uintptr_t) q % BLOOMAP_ALIGN == 0 );
+		memset(p, 0xff, 100*sizeof(uint64_t));
+		arena.release(p, 100);
+		arena.release(q, 3);
+		REQUIRE( arena.pooled() == 13*BLOOMAP_ALIGN + BLOOMAP_ALIGN );
+		/* 100 and 97 words are both 13 cache lines */
+		REQUIRE( arena.alloc(97) == p );
+		uint64_t* r = arena.alloc(100);
+		REQUIRE( r != p );
+		bloomap_free_words(r);
+		REQUIRE( arena.pooled() == BLOOMAP_ALIGN );
+		REQUIRE( arena.alloc(8) == q );
+		arena.release(p, 100);
+		arena.release(q, 8);
+		arena.setLimit(BLOOMAP_ALIGN);
+		REQUIRE( arena.pooled() == BLOOMAP_ALIGN );
+		arena.setLimit(0);
+		REQUIRE( arena.pooled() == 0 );
+		/* Over the limit, released arrays are freed */
+		arena.release(arena.alloc(10), 10);
+		REQUIRE( arena.pooled() == 0 );
+		bloomap_free_words(bloomap_alloc_words(0));
+	}
+
+	SECTION("--> Deleted maps give their bits to new ones") {
+		BloomapFamily *f = BloomapFamily::forElementsAndProb(ELE, 0.01);
+		f->setCompression(false);
+		Bloomap* map = f->newMap();
+		Contents c = bloomap_fill(map, ELE);
+		Bloomap* copy = new Bloomap(map);
+		REQUIRE( f->pooledMemory() == 0 );
+		delete map;
+		REQUIRE( f->pooledMemory() >= copy->memoryUsage() );
+		map = f->newMap();
+		REQUIRE( f->pooledMemory() == 0 );
+		REQUIRE( map->isEmpty() );
+		REQUIRE( map->popcount() == 0 );
+		REQUIRE( bloomap_count_elements(map, c) == 0 );
+
+		/* purge() swaps in fresh bits, the old ones are kept */
+		copy->intersect(map);
+		copy->purge();
+		REQUIRE( f->pooledMemory() > 0 );
+		REQUIRE( copy->isEmpty() );
+
+		f->setPoolLimit(0);
+		REQUIRE( f->pooledMemory() == 0 );
+		delete copy;
+		REQUIRE( f->pooledMemory() == 0 );
+
+		/* Maps outliving the family free their bits themselves */
+		f->setPoolLimit(BLOOMAP_ARENA_POOL);
+		bloomap_fill(map, ELE);
+		delete f;
+		REQUIRE( map->popcount() > 0 );
+		delete map;
+	}
+}
+
+TEST_CASE( "***** Copy-on-write clones.", "[cow]" ) {
+	/* Maps of about 300KB, over BLOOMAP_SHARE_ABOVE */
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(1 << 18, 0.01);
+	f->setCompression(false);
+	Bloomap* map = f->newMap();
+	Bloomap* other = f->newMap();
+	Contents c = bloomap_fill(map, 20000, 42);
+	bloomap_fill(other, 20000);
+	REQUIRE( map->memoryUsage() >= BLOOMAP_SHARE_ABOVE );
+
+	f->setCopyOnWrite(false);
+	Bloomap* ref = new Bloomap(map);
+	REQUIRE( !ref->isShared() );
+	REQUIRE( !map->isShared() );
+	f->setCopyOnWrite(true);
+
+	Bloomap* clone = new Bloomap(map);
+	Bloomap* clone2 = new Bloomap(clone);
+	REQUIRE( clone->isShared() );
+	REQUIRE( clone2->isShared() );
+	REQUIRE( map->isShared() );
+	REQUIRE( *clone == ref );
+	REQUIRE( *clone2 == ref );
+	REQUIRE( bloomap_count_elements(clone2, c) == c.size() );
+
+	SECTION("--> Changes stay in the changed map") {
+		unsigned e = gen_element(map);
+		REQUIRE( clone->add(e) );
+		REQUIRE( !clone->isShared() );
+		REQUIRE( clone->contains(e) );
+		REQUIRE( !map->contains(e) );
+		REQUIRE( !clone2->contains(e) );
+		REQUIRE( map->isShared() );
+
+		unsigned e2 = gen_element(clone);
+		map->add(e2);
+		REQUIRE( !map->isShared() );
+		REQUIRE( *clone2 == ref );
+		REQUIRE( !clone->contains(e2) );
+
+		/* A changed map makes a new snapshot */
+		Bloomap* clone3 = new Bloomap(map);
+		REQUIRE( clone3->isShared() );
+		REQUIRE( *clone3 == map );
+		REQUIRE( clone3->contains(e2) );
+		delete clone3;
+	}
+
+	SECTION("--> Set operations on shared bits") {
+		ref->intersect(other);
+		clone->intersect(other);
+		REQUIRE( *clone == ref );
+		REQUIRE( *clone2 != ref );
+
+		/* A union that adds nothing keeps the bits shared */
+		REQUIRE( !clone2->add(map) );
+		REQUIRE( clone2->isShared() );
+		clone2->or_from(other);
+		REQUIRE( !clone2->isShared() );
+		REQUIRE( (BloomapExpr(map) | other).isSubsetOf(clone2) );
+
+		Bloomap* clone3 = new Bloomap(map);
+		(BloomapExpr(clone3) & other).evaluate(clone3);
+		REQUIRE( *clone3 == ref );
+		delete clone3;
+
+		Bloomap* clone4 = new Bloomap(map);
+		clone4->clear();
+		REQUIRE( clone4->isEmpty() );
+		REQUIRE( bloomap_count_elements(map, c) == c.size() );
+		delete clone4;
+
+		Bloomap* clone5 = new Bloomap(map);
+		clone5->intersect(other);
+		clone5->purge();
+		REQUIRE( !clone5->isShared() );
+		REQUIRE( bloomap_count_elements(map, c) == c.size() );
+		delete clone5;
+	}
+
+	SECTION("--> Clones outlive the original") {
+		delete map;
+		map = NULL;
+		REQUIRE( *clone == ref );
+		REQUIRE( bloomap_count_elements(clone2, c) == c.size() );
+		clone2->add(gen_element(clone2));
+		REQUIRE( *clone == ref );
+	}
+
+	SECTION("--> Small maps are copied") {
+		BloomapFamily *g = BloomapFamily::forElementsAndProb(ELE, 0.01);
+		g->setCompression(false);
+		Bloomap* small = g->newMap();
+		bloomap_fill(small, ELE);
+		Bloomap* copy = new Bloomap(small);
+		REQUIRE( !copy->isShared() );
+		REQUIRE( *copy == small );
+		delete copy;
+		delete small;
+		delete g;
+	}
+
+	delete clone2;
+	delete clone;
+	delete ref;
+	delete other;
+	delete map;
+	delete f;
+}
+
+TEST_CASE( "***** Batch membership queries.", "[batch]" ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(ELE, 0.01);
+	Bloomap* map1 = f->newMap();
+	bloomap_fill(map1, ELE);
+
+	vector<uint32_t> keys;
+	for (unsigned i = 0; i < 10*ELE; i++)
+		keys.push_back(i % 3 ? rand() : i); /* Mix in specials and small numbers */
+	vector<uint64_t> result((keys.size() + 63) / 64, ~0ULL);
+
+	unsigned dist[] = { 0, 1, 16, 1000 };
+	for (unsigned d = 0; d < sizeof(dist)/sizeof(dist[0]); d++) {
+		CAPTURE( dist[d] );
+		map1->containsBatch(&keys[0], keys.size(), &result[0], dist[d]);
+		unsigned mismatches = 0;
+		for (unsigned i = 0; i < keys.size(); i++) {
+			bool batch = (result[i / 64] >> (i % 64)) & 1;
+			if (batch != map1->contains(keys[i])) mismatches++;
+		}
+		REQUIRE( mismatches == 0 );
+	}
+
+	delete map1;
+	delete f;
+}
+
+TEST_CASE( "***** N-way intersection emptiness.", "[intersection]" ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(ELE, 0.01);
+	const unsigned n = 5;
+	Bloomap* maps[n];
+	for (unsigned i = 0; i < n; i++)
+		maps[i] = f->newMap();
+
+	SECTION("--> Agrees with intersect() + isEmpty()") {
+		for (unsigned it = 0; it < ITER; it++) {
+			for (unsigned i = 0; i < n; i++) {
+				maps[i]->clear();
+				bloomap_fill(maps[i], ELE/(it+1));
+			}
+			Bloomap* ref = f->newMap();
+			ref->add(maps[0]);
+			for (unsigned i = 1; i < n; i++) {
+				ref->intersect(maps[i]);
+				REQUIRE( Bloomap::isIntersectionEmpty(maps, i+1) == ref->isEmpty() );
+			}
+			delete ref;
+		}
+	}
+
+	SECTION("--> Common element makes the intersection non-empty") {
+		for (unsigned i = 0; i < n; i++) {
+			bloomap_fill(maps[i], ELE/2);
+			maps[i]->add(666);
+		}
+		REQUIRE( !Bloomap::isIntersectionEmpty(maps, n) );
+		REQUIRE( !maps[0]->isIntersectionEmpty(maps[1]) );
+	}
+
+	SECTION("--> Empty operand makes the intersection empty") {
+		for (unsigned i = 1; i < n; i++) {
+			bloomap_fill(maps[i], ELE/2);
+			maps[i]->add(666);
+		}
+		REQUIRE( Bloomap::isIntersectionEmpty(maps, n) );
+		REQUIRE( maps[1]->isIntersectionEmpty(maps[0]) );
+	}
+
+	for (unsigned i = 0; i < n; i++)
+		delete maps[i];
+	delete f;
+}
+
+TEST_CASE( "***** Lazy set expressions.", "[expr]" ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(ELE, 0.01);
+	Bloomap* a = f->newMap();
+	Bloomap* b = f->newMap();
+	Bloomap* c = f->newMap();
+	Bloomap* d = f->newMap();
+	Bloomap* e = f->newMap();
+	bloomap_fill(a, ELE/2);
+	bloomap_fill(b, ELE/2);
+	bloomap_fill(c, ELE/2);
+	bloomap_fill(d, ELE/2);
+	bloomap_fill(e, ELE);
+	a->add(666); b->add(666); e->add(666);
+
+	/* (a & b) | (c & d) & e, computed step by step */
+	Bloomap* ref = f->newMap();
+	Bloomap* tmp = f->newMap();
+	ref->add(a); ref->intersect(b);
+	tmp->add(c); tmp->intersect(d);
+	ref->or_from(tmp);
+	ref->intersect(e);
+
+	BloomapExpr expr = ((BloomapExpr(a) & b) | (BloomapExpr(c) & d)) & e;
+
+	SECTION("--> evaluate() matches step by step computation") {
+		Bloomap* res = f->newMap();
+		bloomap_fill(res, ELE); /* Garbage to be overwritten */
+		expr.evaluate(res);
+		REQUIRE( *res == ref );
+		REQUIRE( res->contains(666) );
+		delete res;
+	}
+
+	SECTION("--> evaluate() into one of the operands") {
+		expr.evaluate(a);
+		REQUIRE( *a == ref );
+	}
+
+	SECTION("--> Predicate terminals match") {
+		REQUIRE( expr.popcount() == ref->popcount() );
+		REQUIRE( expr.isEmpty() == ref->isEmpty() );
+		REQUIRE( !expr.isEmpty() );
+		REQUIRE( expr.isSubsetOf(e) );
+		REQUIRE( expr.isSubsetOf(ref) );
+		REQUIRE( (BloomapExpr(a) & b).isSubsetOf(a) );
+		REQUIRE( !(BloomapExpr(a) | e).isSubsetOf(a) );
+		tmp->clear();
+		REQUIRE( (BloomapExpr(a) & tmp).isEmpty() );
+		REQUIRE( (BloomapExpr(a) & tmp).popcount() == 0 );
+	}
+
+	delete a; delete b; delete c; delete d; delete e;
+	delete ref;
+	delete tmp;
+	delete f;
+}
+
+TEST_CASE( "***** Three-operand set operations.", "[into]" ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(100*ELE, 0.01);
+	Bloomap* a = f->newMap();
+	Bloomap* b = f->newMap();
+	Bloomap* few = f->newMap();
+	for (unsigned e = 0; e < 60*ELE; e++) {
+		if (e < 40*ELE) a->add(e);
+		if (e >= 20*ELE) b->add(e);
+	}
+	few->add(7);
+	few->add(20*ELE + 1);
+	few->add(10*ELE + 1);
+	REQUIRE( !a->isCompressed() );
+	REQUIRE( few->isCompressed() );
+	Bloomap* a_orig = new Bloomap(a);
+	Bloomap* b_orig = new Bloomap(b);
+
+	SECTION("--> Same as the in-place operations") {
+		Bloomap* pairs[3][2] = { { a, b }, { a, few }, { few, b } };
+		for (unsigned p = 0; p < 3; p++) {
+			Bloomap* x = pairs[p][0];
+			Bloomap* y = pairs[p][1];
+			CAPTURE( p );
+			Bloomap* ref = new Bloomap(x);
+			ref->intersect(y);
+			Bloomap* res = f->newMap();
+			bloomap_fill(res, ELE); /* Garbage to be overwritten */
+			REQUIRE( Bloomap::intersectInto(res, x, y) == res );
+			REQUIRE( *res == ref );
+			REQUIRE( res->isCompressed() == ref->isCompressed() );
+			delete ref;
+
+			ref = new Bloomap(x);
+			ref->or_from(y);
+			REQUIRE( Bloomap::unionInto(res, x, y) == res );
+			REQUIRE( *res == ref );
+			/* Commutative */
+			Bloomap::unionInto(res, y, x);
+			REQUIRE( *res == ref );
+			delete ref;
+			delete res;
+		}
+		REQUIRE( *a == a_orig );
+		REQUIRE( *b == b_orig );
+		REQUIRE( few->isCompressed() );
+	}
+
+	SECTION("--> Into one of the operands") {
+		Bloomap* ref = new Bloomap(a);
+		ref->intersect(b);
+		Bloomap::intersectInto(b, a, b);
+		REQUIRE( *b == ref );
+		REQUIRE( *a == a_orig );
+		ref->clear();
+		ref->add(a);
+		ref->add(few);
+		Bloomap::unionInto(a, a, few);
+		REQUIRE( *a == ref );
+		Bloomap::unionInto(a, a, a);
+		REQUIRE( *a == ref );
+		delete ref;
+	}
+
+	SECTION("--> Elements of one map not in another") {
+		Bloomap* res = f->newMap();
+		Bloomap::andNotInto(res, a, b);
+		unsigned extra = 0;
+		for (unsigned e = 0; e < 60*ELE; e++) {
+			if (a->contains(e) && !b->contains(e))
+				REQUIRE( res->contains(e) );
+			else if (res->contains(e))
+				extra++;
+		}
+		/* Only false positives of res itself */
+		REQUIRE( extra < 60*ELE/50 );
+		REQUIRE( *a == a_orig );
+		REQUIRE( *b == b_orig );
+
+		/* Into an operand */
+		Bloomap::andNotInto(a, a, b);
+		REQUIRE( *a == res );
+		Bloomap::andNotInto(res, few, a);
+		REQUIRE( !res->contains(7) );
+		REQUIRE( res->contains(20*ELE + 1) );
+		REQUIRE( !res->contains(10*ELE + 1) );
+		/* Specials too */
+		Bloomap::andNotInto(res, a, few);
+		REQUIRE( res->contains(5) );
+		REQUIRE( !res->contains(7) );
+		REQUIRE( !res->contains(10*ELE + 1) );
+		delete res;
+	}
+
+	delete a_orig; delete b_orig;
+	delete a; delete b; delete few;
+	delete f;
+}
+
+TEST_CASE( "***** Counting maps.", "[counting]" ) {
+	BloomapFamily::Layout layout = BloomapFamily::LAYOUT_COMPARTMENTS;
+	SECTION("--> Compartments") {}
+	SECTION("--> Blocked layout") { layout = BloomapFamily::LAYOUT_BLOCKED; }
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(10*ELE, 0.01, layout);
+	CountingBloomap* c = f->newCountingMap();
+	REQUIRE( !c->isCompressed() );
+	for (unsigned e = 0; e < 10*ELE; e++)
+		c->add(1000 + e);
+
+	/* Removed elements go away, the others stay */
+	for (unsigned e = 0; e < 10*ELE; e += 2)
+		REQUIRE( c->remove(1000 + e) );
+	unsigned fp = 0;
+	for (unsigned e = 0; e < 10*ELE; e++) {
+		if (e % 2)
+			REQUIRE( c->contains(1000 + e) );
+		else if (c->contains(1000 + e))
+			fp++;
+	}
+	REQUIRE( fp < 10*ELE/20 );
+	REQUIRE( !c->remove(gen_element(c)) );
+
+	/* Multiple adds, specials included */
+	for (unsigned i = 0; i < 3; i++) {
+		c->add(3);
+		c->add(77777);
+	}
+	REQUIRE( c->multiplicity(3) == 3 );
+	REQUIRE( c->multiplicity(77777) >= 3 );
+	REQUIRE( c->remove(3) );
+	REQUIRE( c->remove(77777) );
+	REQUIRE( c->contains(3) );
+	REQUIRE( c->contains(77777) );
+	REQUIRE( c->remove(3) );
+	REQUIRE( c->remove(3) );
+	REQUIRE( !c->contains(3) );
+
+	/* Saturated counters never go down */
+	for (unsigned i = 0; i < BLOOMAP_COUNTER_MAX + 5; i++)
+		c->add(55555);
+	for (unsigned i = 0; i < BLOOMAP_COUNTER_MAX + 5; i++)
+		c->remove(55555);
+	REQUIRE( c->contains(55555) );
+
+	SECTION("--> Plain copies and Bloomap queries") {
+		Bloomap* plain = c->toBloomap();
+		REQUIRE( *plain == c );
+		REQUIRE( plain->contains(77777) );
+		REQUIRE( plain->count() == c->count() );
+		vector<uint32_t> all;
+		c->enumerateAll(all);
+		for (unsigned i = 0; i < all.size(); i++)
+			REQUIRE( plain->contains(all[i]) );
+		delete plain;
+	}
+
+	SECTION("--> Union and intersection of the counters") {
+		CountingBloomap* d = f->newCountingMap();
+		for (unsigned e = 5*ELE; e < 15*ELE; e++)
+			d->add(1000 + e);
+		d->add(77777);
+		d->add(5);
+		Bloomap* plain_union = c->toBloomap();
+		plain_union->add(d);
+		Bloomap* plain_inter = c->toBloomap();
+		plain_inter->intersect(d);
+
+		CountingBloomap* u = new CountingBloomap(c);
+		REQUIRE( u->add(d) );
+		REQUIRE( *u == plain_union );
+		REQUIRE( u->multiplicity(5) == 1 );
+		REQUIRE( u->multiplicity(77777) >= 3 );
+		/* Removing the elements of d leaves those of c */
+		for (unsigned e = 5*ELE; e < 15*ELE; e++)
+			REQUIRE( u->remove(1000 + e) );
+		for (unsigned e = 1; e < 10*ELE; e += 2)
+			REQUIRE( u->contains(1000 + e) );
+
+		CountingBloomap* i = new CountingBloomap(c);
+		i->intersect(d);
+		REQUIRE( *i == plain_inter );
+		REQUIRE( i->contains(77777) );
+		REQUIRE( i->multiplicity(77777) >= 1 );
+		REQUIRE( !i->contains(5) );
+		REQUIRE( i->remove(77777) );
+
+		i->clear();
+		REQUIRE( i->isEmpty() );
+		REQUIRE( i->multiplicity(77777) == 0 );
+
+		delete i; delete u;
+		delete plain_union; delete plain_inter;
+		delete d;
+	}
+
+	delete c;
+	delete f;
+}
+
+TEST_CASE( "***** Counting maps survive pruning.", "[counting]" ) {
+	/* Saturated counters keep bits of removed elements, which purging
+	 * would drop under them */
+	BloomapFamily *f = BloomapFamily::forSizeAndFunctions(4096, 4);
+	CountingBloomap* c = f->newCountingMap();
+	Bloomap* plain = f->newMap();
+	for (unsigned e = 0; e < 30000; e++)
+		c->add(1000 + e);
+	for (unsigned e = 0; e < 30000; e++)
+		c->remove(1000 + e);
+	plain->add(7);
+	unsigned dropped[2] = { 1, 1 };
+	Bloomap* maps[2] = { c, plain };
+	Bloomap::purge(maps, 2, dropped);
+	REQUIRE( dropped[0] == 0 );
+	f->prune(true);
+	unsigned missing = 0;
+	for (unsigned e = 0; e < 200; e++)
+		c->add(100000 + e);
+	for (unsigned e = 0; e < 200; e++)
+		if (!c->contains(100000 + e)) missing++;
+	REQUIRE( missing == 0 );
+	REQUIRE( plain->contains(7) );
+
+	delete plain;
+	delete c;
+	delete f;
+}
+
+TEST_CASE( "***** Scalable maps.", "[scalable]" ) {
+	BloomapFamily::Layout layout = BloomapFamily::LAYOUT_COMPARTMENTS;
+	SECTION("--> Compartments") {}
+	SECTION("--> Blocked layout") { layout = BloomapFamily::LAYOUT_BLOCKED; }
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(10*ELE, 0.01, layout);
+	REQUIRE( f->capacity() == 10*ELE );
+	REQUIRE( f->layer(0) == f );
+	REQUIRE( f->layer(2)->capacity() == 40*ELE );
+	REQUIRE( f->layer(2)->falsePositiveRate() == Approx(0.0025) );
+
+	/* Twenty times the capacity, no false negatives */
+	ScalableBloomap* s = f->newScalableMap();
+	for (unsigned e = 0; e < 200*ELE; e++)
+		s->add(1000 + 3*e);
+	s->add(5);
+	REQUIRE( s->nlayers() == 5 );
+	for (unsigned e = 0; e < 200*ELE; e++)
+		REQUIRE( s->contains(1000 + 3*e) );
+	REQUIRE( s->contains(5) );
+
+	/* The false positive rate stays below twice the one of the family */
+	unsigned fp = 0;
+	for (unsigned e = 0; e < 100*ELE; e++)
+		if (s->contains(1000 + 3*e + 1)) fp++;
+	REQUIRE( fp < 100*ELE*0.03 );
+	REQUIRE( s->falsePositiveRate() < 0.025 );
+	/* A plain map of the family is full by now */
+	Bloomap* plain = f->newMap();
+	for (unsigned e = 0; e < 200*ELE; e++)
+		plain->add(1000 + 3*e);
+	unsigned plain_fp = 0;
+	for (unsigned e = 0; e < 100*ELE; e++)
+		if (plain->contains(1000 + 3*e + 1)) plain_fp++;
+	REQUIRE( plain_fp > 3*fp );
+	delete plain;
+
+	SECTION("--> Enumeration across the layers") {
+		set<unsigned> seen;
+		size_t n = 0;
+		s->forEach([&](unsigned e) { seen.insert(e); n++; });
+		REQUIRE( n == seen.size() );
+		REQUIRE( s->count() == n );
+		for (unsigned e = 0; e < 200*ELE; e++)
+			REQUIRE( seen.count(1000 + 3*e) );
+		for (set<unsigned>::iterator it = seen.begin(); it != seen.end(); ++it)
+			REQUIRE( s->contains(*it) );
+
+		/* Small batches resume in the right layer */
+		vector<uint32_t> all;
+		uint32_t buf[7];
+		uint64_t cursor = 0;
+		while (cursor != BLOOMAP_ENUM_END) {
+			size_t got = s->enumerate(buf, 7, cursor);
+			all.insert(all.end(), buf, buf + got);
+		}
+		vector<uint32_t> all2;
+		s->enumerateAll(all2);
+		REQUIRE( all == all2 );
+		REQUIRE( all.size() == n );
+	}
+
+	SECTION("--> Union and intersection") {
+		ScalableBloomap* t = f->newScalableMap();
+		for (unsigned e = 150*ELE; e < 250*ELE; e++)
+			t->add(1000 + 3*e);
+		REQUIRE( t->nlayers() == 4 );
+
+		ScalableBloomap* u = new ScalableBloomap(s);
+		REQUIRE( u->add(t) );
+		for (unsigned e = 0; e < 250*ELE; e++)
+			REQUIRE( u->contains(1000 + 3*e) );
+		REQUIRE( u->contains(5) );
+
+		ScalableBloomap* i = new ScalableBloomap(s);
+		i->intersect(t);
+		for (unsigned e = 150*ELE; e < 200*ELE; e++)
+			REQUIRE( i->contains(1000 + 3*e) );
+		REQUIRE( !i->contains(5) );
+		unsigned left = 0;
+		for (unsigned e = 0; e < 150*ELE; e++)
+			if (i->contains(1000 + 3*e)) left++;
+		REQUIRE( left < 150*ELE*0.03 );
+		delete i;
+
+		/* A single layer is intersected bit by bit */
+		ScalableBloomap* small = f->newScalableMap();
+		small->add(1000);
+		small->add(5);
+		i = new ScalableBloomap(s);
+		i->intersect(small);
+		REQUIRE( i->contains(1000) );
+		REQUIRE( i->contains(5) );
+		REQUIRE( i->count() < 10 );
+
+		i->clear();
+		REQUIRE( i->nlayers() == 1 );
+		REQUIRE( i->count() == 0 );
+		delete small; delete i; delete u; delete t;
+	}
+
+	delete s;
+	delete f;
+}
+
+TEST_CASE( "***** 64-bit and string keys.", "[keys]" ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(100*ELE, 0.01, BloomapFamily::LAYOUT_COMPARTMENTS,
+			BLOOMAP_DEFAULT_SEED, BloomapFamily::INDEX_SPARSE);
+
+	SECTION("--> 64-bit keys") {
+		BloomapKeys<uint64_t> keys(f);
+		/* Keys differing only in their upper halves */
+		vector<uint64_t> in, out;
+		for (uint64_t i = 0; i < 100*ELE; i++) {
+			in.push_back((i << 32) | 12345);
+			out.push_back(((i + 100*ELE) << 32) | 12345);
+		}
+		REQUIRE( keys.element(in[0]) != keys.element(in[1]) );
+		REQUIRE( BloomapKeys<uint64_t>(f).element(in[7]) == keys.element(in[7]) );
+
+		Bloomap* map = f->newMap();
+		for (unsigned i = 0; i < in.size(); i++)
+			keys.add(map, in[i]);
+		keys.add(map, in[0]);
+		REQUIRE( keys.size() == in.size() );
+		for (unsigned i = 0; i < in.size(); i++)
+			REQUIRE( keys.contains(map, in[i]) );
+		unsigned fp = 0;
+		for (unsigned i = 0; i < out.size(); i++)
+			if (keys.contains(map, out[i])) fp++;
+		REQUIRE( fp < out.size()*0.03 );
+
+		/* Batches agree */
+		vector<uint64_t> result((out.size() + 63) / 64);
+		keys.containsBatch(map, &out[0], out.size(), &result[0]);
+		for (unsigned i = 0; i < out.size(); i++)
+			REQUIRE( (bool) ((result[i / 64] >> (i % 64)) & 1) == keys.contains(map, out[i]) );
+		Bloomap* batched = f->newMap();
+		keys.addBatch(batched, &in[0], in.size());
+		REQUIRE( *batched == map );
+
+		/* Enumeration gives the keys back, each once */
+		vector<uint64_t> all;
+		keys.enumerateAll(map, all);
+		std::sort(all.begin(), all.end());
+		REQUIRE( all == in );
+
+		/* Only the keys of the map, give or take false positives */
+		Bloomap* half = f->newMap();
+		for (unsigned i = 0; i < in.size(); i += 2)
+			keys.add(half, in[i]);
+		all.clear();
+		keys.enumerateAll(half, all);
+		REQUIRE( all.size() >= in.size() / 2 );
+		REQUIRE( all.size() < in.size() / 2 * 1.03 );
+
+		/* Other kinds of maps */
+		BloomapFamily *g = BloomapFamily::forElementsAndProb(10*ELE, 0.01, BloomapFamily::LAYOUT_COMPARTMENTS,
+				BLOOMAP_DEFAULT_SEED, BloomapFamily::INDEX_SPARSE);
+		BloomapKeys<uint64_t> gkeys(g);
+		ScalableBloomap* s = g->newScalableMap();
+		for (unsigned i = 0; i < in.size(); i++)
+			gkeys.add(s, in[i]);
+		REQUIRE( s->nlayers() > 1 );
+		all.clear();
+		gkeys.enumerateAll(s, all);
+		std::sort(all.begin(), all.end());
+		REQUIRE( all == in );
+
+		delete s;
+		delete g;
+		delete half;
+		delete batched;
+		delete map;
+	}
+
+	SECTION("--> String keys") {
+		BloomapKeys<std::string> keys(f);
+		Bloomap* map = f->newMap();
+		set<std::string> in;
+		for (unsigned i = 0; i < 10*ELE; i++) {
+			char buf[32];
+			snprintf(buf, sizeof(buf), "user-%u@example.com", i);
+			in.insert(buf);
+			keys.add(map, std::string(buf));
+		}
+		keys.add(map, std::string());
+		in.insert(std::string());
+		for (set<std::string>::iterator it = in.begin(); it != in.end(); ++it)
+			REQUIRE( keys.contains(map, *it) );
+		REQUIRE( !keys.contains(map, std::string("nobody@example.com")) );
+		vector<std::string> all;
+		keys.enumerateAll(map, all);
+		REQUIRE( set<std::string>(all.begin(), all.end()) == in );
+		REQUIRE( all.size() == in.size() );
+		delete map;
+	}
+
+	delete f;
+}
+
+TEST_CASE( "***** Cardinality estimates.", "[estimate]" ) {
+	const unsigned n = 10000;
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(n, 0.01);
+	Bloomap* map1 = f->newMap();
+	Bloomap* map2 = f->newMap();
+
+	REQUIRE( map1->estimateCardinality() == 0 );
+
+	/* 3000 elements each, 1000 of them shared */
+	Contents c;
+	vector<unsigned> ele;
+	while (ele.size() < 5000) {
+		unsigned e = gen_element(map1);
+		if (c.count(e)) continue;
+		c[e] = true;
+		ele.push_back(e);
+	}
+	for (unsigned i = 0; i < 3000; i++) {
+		map1->add(ele[i]);
+		map2->add(ele[i < 1000 ? i : i + 2000]);
+	}
+
+	REQUIRE( map1->estimateCardinality() == Approx(3000).epsilon(0.05) );
+	REQUIRE( map2->estimateCardinality() == Approx(3000).epsilon(0.05) );
+	REQUIRE( map1->estimateUnionCardinality(map2) == Approx(5000).epsilon(0.05) );
+	REQUIRE( map1->estimateIntersectionCardinality(map2) == Approx(1000).epsilon(0.2) );
+
+	SECTION("--> Popcount is the same for all kernels") {
+		const BitKernels* prev = bitkernels();
+		REQUIRE( bitkernels_select("scalar") );
+		unsigned ref = map1->popcount();
+		REQUIRE( ref > 0 );
+		for (unsigned i = 0; bitkernels_names[i]; i++) {
+			if (!bitkernels_select(bitkernels_names[i])) continue;
+			CAPTURE( bitkernels_names[i] );
+			REQUIRE( map1->popcount() == ref );
+			REQUIRE( map1->estimateUnionCardinality(map2) == Approx(5000).epsilon(0.05) );
+		}
+		bitkernels_select(prev->name);
+	}
+
+	delete map1;
+	delete map2;
+	delete f;
+}
+
+TEST_CASE( "***** Bit kernels agree with scalar implementation.", "[kernels]" ) {
+	BloomapFamily *f = BloomapFamily::forElementsAndProb(ELE, 0.01);
+	Bloomap* map1 = f->newMap();
+	Bloomap* map2 = f->newMap();
+	bloomap_fill(map1, ELE);
+	bloomap_fill(map2, ELE);
+
+	const BitKernels* prev = bitkernels();
+	REQUIRE( bitkernels_select("scalar") );
+	Bloomap* ref_union = f->newMap();
+	Bloomap* ref_inter = f->newMap();
+	ref_union->add(map1);
+	ref_union->add(map2);
+	ref_inter->add(map1);
+	ref_inter->intersect(map2);
+
+	for (unsigned i = 0; bitkernels_names[i]; i++) {
+		if (!bitkernels_select(bitkernels_names[i])) continue;
+		CAPTURE( bitkernels_names[i] );
+
+		Bloomap* mapu = f->newMap();
+		REQUIRE( mapu->add(map1) );
+		REQUIRE( mapu->add(map2) );
+		REQUIRE( !mapu->add(map2) ); /* Nothing new, changed must be false. */
+		REQUIRE( *mapu == ref_union );
+
+		Bloomap* mapi = f->newMap();
+		mapi->or_from(map1);
+		mapi->intersect(map2);
+		REQUIRE( *mapi == ref_inter );
+
+		delete mapu;
+		delete mapi;
+	}
+	bitkernels_select(prev->name);
+
+	/* Any alignment of dst and src, and lengths around the vector widths */
+	vector<uint64_t> a(64), b(64);
+	for (unsigned i = 0; i < a.size(); i++) {
+		a[i] = ((uint64_t) rand() << 32) ^ rand();
+		b[i] = (i % 3) ? ((uint64_t) rand() << 32) ^ rand() : a[i];
+	}
+	const BitKernels* scalar = bitkernels_find("scalar");
+	for (unsigned i = 0; bitkernels_names[i]; i++) {
+		const BitKernels* k = bitkernels_find(bitkernels_names[i]);
+		if (!k) continue;
+		CAPTURE( bitkernels_names[i] );
+		for (unsigned da = 0; da < 8; da++) {
+			for (unsigned sa = 0; sa < 8; sa += 3) {
+				for (unsigned n = 0; n < 40; n += 7) {
+					vector<uint64_t> ref(a.begin() + da, a.begin() + da + n + 1), dst(ref);
+					scalar->and_to(&ref[0], &b[sa], n);
+					k->and_to(&dst[0], &b[sa], n);
+					REQUIRE( dst == ref );
+					scalar->or_to(&ref[0], &b[sa], n);
+					k->or_to(&dst[0], &b[sa], n);
+					REQUIRE( dst == ref );
+					REQUIRE( k->or_to_changed(&dst[0], &a[sa], n) == scalar->or_to_changed(&ref[0], &a[sa], n) );
+					REQUIRE( dst == ref );
+					REQUIRE( !k->or_to_changed(&dst[0], &a[sa], n) );
+					/* Counters: per nibble saturated sum and minimum */
+					vector<uint64_t> sum(a.begin() + da, a.begin() + da + n + 1), least(sum), expect_sum(sum), expect_min(sum);
+					for (unsigned w = 0; w < n; w++) {
+						expect_sum[w] = expect_min[w] = 0;
+						for (unsigned s = 0; s < 64; s += 4) {
+							uint64_t x = (sum[w] >> s) & 0xf, y = (b[sa + w] >> s) & 0xf;
+							expect_sum[w] |= (x + y > 15 ? 15 : x + y) << s;
+							expect_min[w] |= (x < y ? x : y) << s;
+						}
+					}
+					k->nibble_add_to(&sum[0], &b[sa], n);
+					k->nibble_min_to(&least[0], &b[sa], n);
+					REQUIRE( sum == expect_sum );
+					REQUIRE( least == expect_min );
+					/* Three-operand kernels into any alignment, streamed or not */
+					for (unsigned stream = 0; stream < 2; stream++) {
+						vector<uint64_t> ref_into(n + 8), into(n + 8);
+						scalar->and_into(&ref_into[da], &a[sa], &b[da], n, false);
+						k->and_into(&into[da], &a[sa], &b[da], n, stream);
+						REQUIRE( into == ref_into );
+						scalar->or_into(&ref_into[da], &a[sa], &b[da], n, false);
+						k->or_into(&into[da], &a[sa], &b[da], n, stream);
+						REQUIRE( into == ref_into );
+					}
+				}
+			}
+		}
+	}
+
+	delete ref_union;
+	delete ref_inter;
+	delete map1;
+	delete map2;
+	delete f;
+}
+
 TEST_CASE( "****** BloomapFamily iterator.", "[operators]" ) {
 	BloomapFamily *f = BloomapFamily::forElementsAndProb(ELE, 0.01);
 
@@ -0,0 +1,163 @@
+#include <cassert>
+#include <cstring>
+
+#include "countingbloomap.h"
+#include "bitkernels.h"
+
+CountingBloomap::CountingBloomap(BloomapFamily* f, unsigned index_logsize)
+	: Bloomap(f, f->m, f->k, index_logsize)
+{
+	/* The bits follow the counters one by one */
+	packable = false;
+	purgeable = false;
+	unpack();
+	ncounter_words = (bits_size - index_size)*4;
+	counters = bloomap_alloc_words(ncounter_words);
+	memset(counters, 0, ncounter_words*sizeof(BITS_TYPE));
+	memset(special_counts, 0, sizeof(special_counts));
+}
+
+CountingBloomap::CountingBloomap(CountingBloomap* orig)
+	: Bloomap(orig)
+{
+	ncounter_words = orig->ncounter_words;
+	counters = bloomap_alloc_words(ncounter_words);
+	memcpy(counters, orig->counters, ncounter_words*sizeof(BITS_TYPE));
+	memcpy(special_counts, orig->special_counts, sizeof(special_counts));
+}
+
+CountingBloomap::~CountingBloomap() {
+	bloomap_free_words(counters);
+}
+
+CountingBloomap* BloomapFamily::newCountingMap(void) {
+	return new CountingBloomap(this, index_logsize);
+}
+
+bool CountingBloomap::add(unsigned ele) {
+	assert(!f || !f->isConcurrent());
+	if (copiedMost()) unshare();
+#ifdef DEBUG_STATS
+	real_contents.insert(ele);
+#endif
+	if (f) orSide(f->newElement(ele));
+
+	changed = false;
+	if (ele < sizeof(specials)*CHAR_BIT) {
+		SPECIALS_TYPE mask = 0x1 << ele;
+		changed = !(specials & mask);
+		specials |= mask;
+		if (special_counts[ele] < BLOOMAP_COUNTER_MAX)
+			special_counts[ele]++;
+		return changed;
+	}
+	unsigned fn = 0;
+	for (unsigned comp = 0; comp < ncomp; comp++) {
+		for (unsigned i = 0; i < nfunc; i++) {
+			const unsigned bit = probe(ele, fn++);
+			const unsigned pos = comp*compsize + bit;
+			const unsigned c = counter(pos);
+			if (c < BLOOMAP_COUNTER_MAX)
+				setCounter(pos, c + 1);
+			if (!c) set(comp, bit);
+		}
+	}
+	return changed;
+}
+
+bool CountingBloomap::addBatch(const uint32_t* ele, size_t n) {
+	bool any = false;
+	for (size_t i = 0; i < n; i++)
+		any |= add(ele[i]);
+	return any;
+}
+
+bool CountingBloomap::remove(unsigned ele) {
+	assert(!f || !f->isConcurrent());
+	/* Counters of other elements would go down otherwise */
+	if (!contains(ele)) return false;
+	if (copiedMost()) unshare();
+#ifdef DEBUG_STATS
+	real_contents.erase(ele);
+#endif
+	/* The family index keeps the element, see BloomapFamily::prune() */
+	if (ele < sizeof(specials)*CHAR_BIT) {
+		if (special_counts[ele] < BLOOMAP_COUNTER_MAX && !--special_counts[ele])
+			specials &= ~(0x1 << ele);
+		return true;
+	}
+	changed = false;
+	unsigned fn = 0;
+	for (unsigned comp = 0; comp < ncomp; comp++) {
+		for (unsigned i = 0; i < nfunc; i++) {
+			const unsigned bit = probe(ele, fn++);
+			const unsigned pos = comp*compsize + bit;
+			const unsigned c = counter(pos);
+			assert(c);
+			if (c == BLOOMAP_COUNTER_MAX) continue;
+			setCounter(pos, c - 1);
+			if (c == 1) reset(comp, bit);
+		}
+	}
+	return true;
+}
+
+bool CountingBloomap::add(CountingBloomap* map) {
+	assert(map->ncounter_words == ncounter_words);
+	changed = false;
+	if (map == this) return changed;
+	unshare();
+	for (unsigned e = 0; e < sizeof(special_counts); e++) {
+		const unsigned c = special_counts[e] + map->special_counts[e];
+		special_counts[e] = (c < BLOOMAP_COUNTER_MAX) ? c : BLOOMAP_COUNTER_MAX;
+	}
+	changed = (specials | map->specials) != specials;
+	specials |= map->specials;
+	bitkernels()->nibble_add_to(counters, map->counters, ncounter_words);
+	/* A sum is non-zero where either counter is */
+	if (bitkernels()->or_to_changed(bits, map->bits, bits_size)) {
+		changed = true;
+		touchAll();
+	}
+	return changed;
+}
+
+CountingBloomap* CountingBloomap::intersect(CountingBloomap* map) {
+	assert(map->ncounter_words == ncounter_words);
+	if (map == this) return this;
+	unshare();
+	for (unsigned e = 0; e < sizeof(special_counts); e++) {
+		if (map->special_counts[e] < special_counts[e])
+			special_counts[e] = map->special_counts[e];
+	}
+	specials &= map->specials;
+	bitkernels()->nibble_min_to(counters, map->counters, ncounter_words);
+	/* A minimum is non-zero where both counters are */
+	bitkernels()->and_to(bits, map->bits, bits_size);
+	touchAll();
+	return this;
+}
+
+void CountingBloomap::clear(void) {
+	memset(counters, 0, ncounter_words*sizeof(BITS_TYPE));
+	memset(special_counts, 0, sizeof(special_counts));
+	Bloomap::clear();
+}
+
+unsigned CountingBloomap::multiplicity(unsigned ele) {
+	if (ele < sizeof(specials)*CHAR_BIT)
+		return special_counts[ele];
+	unsigned least = BLOOMAP_COUNTER_MAX;
+	unsigned fn = 0;
+	for (unsigned comp = 0; comp < ncomp; comp++) {
+		for (unsigned i = 0; i < nfunc; i++) {
+			const unsigned c = counter(comp*compsize + probe(ele, fn++));
+			if (c < least) least = c;
+		}
+	}
+	return least;
+}
+
+size_t CountingBloomap::memoryUsage(void) const {
+	return Bloomap::memoryUsage() + ncounter_words*sizeof(BITS_TYPE);
+}
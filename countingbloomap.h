@@ -0,0 +1,76 @@
+/******************************************************************************
+ * Filename: countingbloomap.h
+ *
+ * Created: 2026/10/17 12:10
+ *
+ ******************************************************************************/
+
+#ifndef __COUNTINGBLOOMAP_H__
+#define __COUNTINGBLOOMAP_H__
+
+#include "bloomap.h"
+#include "bloomapfamily.h"
+
+/* Counters saturate here, and never go down again */
+#define BLOOMAP_COUNTER_MAX 15
+/* 4-bit counters in a word */
+#define BLOOMAP_COUNTERS_WORD (BITS_WORD / 4)
+
+/* A Bloomap with a 4-bit counter for each of its bits, so elements can be
+ * removed again. Counter i counts the elements setting bit i, the counters
+ * are packed sixteen to a word in the order of the bits. The bits always
+ * tell which counters are non-zero, so all the queries of Bloomap
+ * (contains(), enumeration, isIntersectionEmpty(), BloomapExpr, ...) work on
+ * a CountingBloomap as they are, and toBloomap() is a plain copy of the bits.
+ *
+ * Counters saturate at BLOOMAP_COUNTER_MAX and stay there, removing
+ * elements never makes others disappear. Removing an element which was not
+ * added (a false positive) does, like in any counting bloom filter.
+ *
+ * Only the operations below keep the counters in sync, the other changing
+ * Bloomap operations (or_from(), purge(), ...) must not be used. The counters
+ * take four times the memory of the bits. Not for the concurrent mode.
+ * Saved families keep the bits only. Create the maps with
+ * BloomapFamily::newCountingMap(), and delete them as CountingBloomap. */
+class CountingBloomap : public Bloomap {
+	public:
+		CountingBloomap(BloomapFamily* f, unsigned index_logsize);
+		CountingBloomap(CountingBloomap* orig);
+		~CountingBloomap();
+
+		bool add(unsigned ele);
+		bool addBatch(const uint32_t* ele, size_t n);
+		/* Removes an element, returns false if it is not in the map */
+		bool remove(unsigned ele);
+		/* Union and intersection of the counters: their (saturated) sum,
+		 * and their minimum. */
+		bool add(CountingBloomap* map);
+		CountingBloomap* intersect(CountingBloomap* map);
+		void clear(void);
+
+		/* How many times ele was added, at most (the smallest of its
+		 * counters). */
+		unsigned multiplicity(unsigned ele);
+		/* A plain map of the same bits */
+		Bloomap* toBloomap(void) { return new Bloomap(this); }
+
+		/* Memory taken by the bits and the counters, in bytes */
+		size_t memoryUsage(void) const;
+
+	protected:
+		BITS_TYPE* counters;
+		unsigned ncounter_words;
+		unsigned char special_counts[sizeof(SPECIALS_TYPE)*CHAR_BIT];
+
+		/* Counter of bit pos of the compartments */
+		unsigned inline counter(unsigned pos) const {
+			return (counters[pos / BLOOMAP_COUNTERS_WORD] >> (pos % BLOOMAP_COUNTERS_WORD * 4)) & 0xf;
+		}
+		void inline setCounter(unsigned pos, unsigned value) {
+			const unsigned shift = pos % BLOOMAP_COUNTERS_WORD * 4;
+			BITS_TYPE& word = counters[pos / BLOOMAP_COUNTERS_WORD];
+			word = (word & ~(((BITS_TYPE) 0xf) << shift)) | (((BITS_TYPE) value) << shift);
+		}
+};
+
+#endif
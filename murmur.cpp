@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "murmur.h"
 
 uint32_t MurmurHash1 ( const void * key, int len, uint32_t seed )
@@ -30,8 +32,10 @@ uint32_t MurmurHash1 ( const void * key, int len, uint32_t seed )
   {
   case 3:
     h += data[2] << 16;
+    /* fall through */
   case 2:
     h += data[1] << 8;
+    /* fall through */
   case 1:
     h += data[0];
     h *= m;
@@ -51,3 +55,73 @@ uint32_t MurmurHash1 ( const void * key, int len, uint32_t seed )
 uint32_t MurmurHash1 ( uint64_t key, uint32_t seed ) {
 	return MurmurHash1( (void*) &key, sizeof(uint64_t), seed);
 }
+
+uint64_t MurmurHash64A ( const void * key, size_t len, uint64_t seed )
+{
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+
+  uint64_t h = seed ^ (len * m);
+
+  const unsigned char * data = (const unsigned char *)key;
+  const unsigned char * end = data + (len & ~(size_t) 7);
+
+  while(data != end)
+  {
+    uint64_t k;
+    memcpy(&k, data, sizeof(k));
+    data += 8;
+
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+
+    h ^= k;
+    h *= m;
+  }
+
+  switch(len & 7)
+  {
+  case 7:
+    h ^= uint64_t(data[6]) << 48;
+    /* fall through */
+  case 6:
+    h ^= uint64_t(data[5]) << 40;
+    /* fall through */
+  case 5:
+    h ^= uint64_t(data[4]) << 32;
+    /* fall through */
+  case 4:
+    h ^= uint64_t(data[3]) << 24;
+    /* fall through */
+  case 3:
+    h ^= uint64_t(data[2]) << 16;
+    /* fall through */
+  case 2:
+    h ^= uint64_t(data[1]) << 8;
+    /* fall through */
+  case 1:
+    h ^= uint64_t(data[0]);
+    h *= m;
+  };
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+
+  return h;
+}
+
+uint64_t MurmurHash64 ( uint64_t key, uint64_t seed ) {
+	uint64_t h = key ^ seed;
+	h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+	h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+	return h ^ (h >> 33);
+}
+
+uint64_t SplitMix64 ( uint64_t* state ) {
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
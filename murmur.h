@@ -11,9 +11,19 @@
 #define __MURMUR_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 uint32_t MurmurHash1 ( const void * key, int len, uint32_t seed );
 uint32_t MurmurHash1 ( uint64_t key, uint32_t seed );
 
+/* 64-bit hashes, see BloomapKeys. MurmurHash64A of len bytes, and the
+ * MurmurHash3 finalizer of a single word (a permutation for each seed). */
+uint64_t MurmurHash64A ( const void * key, size_t len, uint64_t seed );
+uint64_t MurmurHash64 ( uint64_t key, uint64_t seed );
+
+/* SplitMix64 generator, advances the state and returns next value. Used to
+ * derive hash seeds deterministically from a single number. */
+uint64_t SplitMix64 ( uint64_t* state );
+
 
 #endif
@@ -0,0 +1,209 @@
+#include <cassert>
+
+#include "scalablebloomap.h"
+
+/* The layer of an enumeration is kept in the cursor of Bloomap::enumerate(),
+ * above the element and below its flags. */
+#define BLOOMAP_LAYER_SHIFT 40
+#define BLOOMAP_LAYER_MASK (0xffULL << BLOOMAP_LAYER_SHIFT)
+#define BLOOMAP_LAYERS_MAX 256
+
+ScalableBloomap::ScalableBloomap(BloomapFamily* f)
+	: f(f), fill(0)
+{
+	layers.push_back(f->newMap());
+}
+
+ScalableBloomap::ScalableBloomap(ScalableBloomap* orig)
+	: f(orig->f), fill(orig->fill)
+{
+	for (unsigned i = 0; i < orig->layers.size(); i++)
+		layers.push_back(new Bloomap(orig->layers[i]));
+}
+
+ScalableBloomap::~ScalableBloomap() {
+	for (unsigned i = 0; i < layers.size(); i++)
+		delete layers[i];
+}
+
+ScalableBloomap* BloomapFamily::newScalableMap(void) {
+	return new ScalableBloomap(this);
+}
+
+void ScalableBloomap::grow(void) {
+	assert(layers.size() < BLOOMAP_LAYERS_MAX);
+	layers.push_back(f->layer(layers.size())->newMap());
+	fill = 0;
+}
+
+void ScalableBloomap::refill(void) {
+	const unsigned capacity = f->layer(layers.size() - 1)->capacity();
+	const double estimate = layers.back()->estimateCardinality();
+	fill = (estimate < capacity) ? estimate : capacity;
+	if (fill >= capacity)
+		grow();
+}
+
+bool ScalableBloomap::add(unsigned ele) {
+	/* Specials are exact, they never fill a layer */
+	if (ele < sizeof(SPECIALS_TYPE)*CHAR_BIT)
+		return layers[0]->add(ele);
+	for (unsigned i = 0; i < layers.size(); i++) {
+		if (layers[i]->contains(ele)) {
+			/* A false positive maybe, which the family index of the
+			 * layer has to list all the same. Sets no new bits. */
+			layers[i]->add(ele);
+			return false;
+		}
+	}
+	layers.back()->add(ele);
+	if (++fill >= f->layer(layers.size() - 1)->capacity())
+		grow();
+	return true;
+}
+
+bool ScalableBloomap::addBatch(const uint32_t* ele, size_t n) {
+	bool any = false;
+	for (size_t i = 0; i < n; i++)
+		any |= add(ele[i]);
+	return any;
+}
+
+bool ScalableBloomap::contains(unsigned ele) {
+	for (unsigned i = 0; i < layers.size(); i++)
+		if (layers[i]->contains(ele))
+			return true;
+	return false;
+}
+
+void ScalableBloomap::containsBatch(const uint32_t* keys, size_t n, uint64_t* result_bitmask) {
+	const size_t words = (n + 63) / 64;
+	layers[0]->containsBatch(keys, n, result_bitmask);
+	if (layers.size() == 1) return;
+	std::vector<uint64_t> found(words);
+	for (unsigned i = 1; i < layers.size(); i++) {
+		layers[i]->containsBatch(keys, n, &found[0]);
+		for (size_t w = 0; w < words; w++)
+			result_bitmask[w] |= found[w];
+	}
+}
+
+size_t ScalableBloomap::unique(unsigned layer, uint32_t* out, size_t n) {
+	size_t kept = 0;
+	for (size_t i = 0; i < n; i++) {
+		const uint32_t ele = out[i];
+		bool listed = false;
+		for (unsigned j = 0; j < layer && !listed; j++)
+			listed = layers[j]->enumerates(ele);
+		if (!listed)
+			out[kept++] = ele;
+	}
+	return kept;
+}
+
+size_t ScalableBloomap::enumerate(uint32_t* out, size_t cap, uint64_t& cursor) {
+	size_t n = 0;
+	while (n < cap && cursor != BLOOMAP_ENUM_END) {
+		const unsigned i = (cursor & BLOOMAP_LAYER_MASK) >> BLOOMAP_LAYER_SHIFT;
+		uint64_t inner = cursor & ~BLOOMAP_LAYER_MASK;
+		if (i >= layers.size()) {
+			cursor = BLOOMAP_ENUM_END;
+			break;
+		}
+		size_t got = layers[i]->enumerate(out + n, cap - n, inner);
+		n += unique(i, out + n, got);
+		if (inner != BLOOMAP_ENUM_END)
+			cursor = inner | ((uint64_t) i << BLOOMAP_LAYER_SHIFT);
+		else if (i + 1 < layers.size())
+			cursor = (uint64_t) (i + 1) << BLOOMAP_LAYER_SHIFT;
+		else
+			cursor = BLOOMAP_ENUM_END;
+	}
+	return n;
+}
+
+void ScalableBloomap::enumerateAll(std::vector<uint32_t>& out) {
+	for (unsigned i = 0; i < layers.size(); i++) {
+		const size_t start = out.size();
+		layers[i]->enumerateAll(out);
+		if (i && out.size() > start)
+			out.resize(start + unique(i, &out[start], out.size() - start));
+	}
+}
+
+size_t ScalableBloomap::count(void) {
+	if (layers.size() == 1)
+		return layers[0]->count();
+	std::vector<uint32_t> ele;
+	enumerateAll(ele);
+	return ele.size();
+}
+
+void ScalableBloomap::clear(void) {
+	for (unsigned i = 1; i < layers.size(); i++)
+		delete layers[i];
+	layers.resize(1);
+	layers[0]->clear();
+	fill = 0;
+}
+
+bool ScalableBloomap::add(ScalableBloomap* map) {
+	assert(map->f == f);
+	if (map == this) return false;
+	bool changed = false;
+	for (unsigned i = 0; i < map->layers.size(); i++) {
+		if (i == layers.size())
+			layers.push_back(f->layer(i)->newMap());
+		changed |= layers[i]->add(map->layers[i]);
+	}
+	refill();
+	return changed;
+}
+
+void ScalableBloomap::filter(unsigned i, ScalableBloomap* map) {
+	std::vector<uint32_t> ele;
+	layers[i]->enumerateAll(ele);
+	/* Specials are not enumerated, and only in the first layer */
+	if (!i)
+		for (unsigned e = 0; e < sizeof(SPECIALS_TYPE)*CHAR_BIT; e++)
+			if (layers[0]->contains(e))
+				ele.push_back(e);
+	std::vector<uint64_t> in_map((ele.size() + 63) / 64);
+	if (!ele.empty())
+		map->containsBatch(&ele[0], ele.size(), &in_map[0]);
+	size_t n = 0;
+	for (size_t j = 0; j < ele.size(); j++)
+		if ((in_map[j / 64] >> (j % 64)) & 1)
+			ele[n++] = ele[j];
+	layers[i]->clear();
+	if (n)
+		layers[i]->addBatch(&ele[0], n);
+}
+
+ScalableBloomap* ScalableBloomap::intersect(ScalableBloomap* map) {
+	assert(map->f == f);
+	if (map == this) return this;
+	for (unsigned i = 0; i < layers.size(); i++) {
+		if (!i && map->layers.size() == 1)
+			layers[0]->intersect(map->layers[0]);
+		else
+			filter(i, map);
+	}
+	refill();
+	return this;
+}
+
+double ScalableBloomap::falsePositiveRate(void) {
+	/* A key is negative if it is negative in every layer */
+	double negative = 1.0;
+	for (unsigned i = 0; i < layers.size(); i++)
+		negative *= 1.0 - layers[i]->falsePositiveRate();
+	return 1.0 - negative;
+}
+
+size_t ScalableBloomap::memoryUsage(void) const {
+	size_t total = 0;
+	for (unsigned i = 0; i < layers.size(); i++)
+		total += layers[i]->memoryUsage();
+	return total;
+}
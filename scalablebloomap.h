@@ -0,0 +1,93 @@
+/******************************************************************************
+ * Filename: scalablebloomap.h
+ *
+ * Created: 2026/10/17 14:30
+ *
+ ******************************************************************************/
+
+#ifndef __SCALABLEBLOOMAP_H__
+#define __SCALABLEBLOOMAP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "bloomap.h"
+#include "bloomapfamily.h"
+
+/* A map which grows past the capacity of its family. It is a chain of
+ * Bloomaps, one of each layer of the family (see BloomapFamily::layer()).
+ * New elements go into the last layer, and once it holds the capacity of its
+ * family, a new layer is started. Every layer is twice as large as the one
+ * before, at half the false positive rate, so the rate of the whole map stays
+ * below twice the rate of the family however many elements it holds, and
+ * lookups probe O(log n) layers.
+ *
+ * An element is in the map if it is in any layer. Enumeration walks the
+ * layers one after another, and skips the elements listed by an earlier
+ * layer already. Set operations work on maps of the same family, layer by
+ * layer where they can. The family must outlive its scalable maps. Create
+ * them with BloomapFamily::newScalableMap(). */
+class ScalableBloomap {
+	public:
+		ScalableBloomap(BloomapFamily* f);
+		ScalableBloomap(ScalableBloomap* orig);
+		~ScalableBloomap();
+
+		/* Returns true if ele was not in the map yet */
+		bool add(unsigned ele);
+		bool addBatch(const uint32_t* ele, size_t n);
+		bool contains(unsigned ele);
+		/* Same as Bloomap::containsBatch() */
+		void containsBatch(const uint32_t* keys, size_t n, uint64_t* result_bitmask);
+		/* Same as Bloomap::enumerate(), the cursor also tells the layer */
+		size_t enumerate(uint32_t* out, size_t cap, uint64_t& cursor);
+		template<typename F>
+		void forEach(F fn) {
+			uint32_t buf[BLOOMAP_BATCH];
+			uint64_t cursor = 0;
+			while (cursor != BLOOMAP_ENUM_END) {
+				size_t n = enumerate(buf, BLOOMAP_BATCH, cursor);
+				for (size_t i = 0; i < n; i++)
+					fn(buf[i]);
+			}
+		}
+		void enumerateAll(std::vector<uint32_t>& out);
+		size_t count(void);
+		void clear(void);
+
+		/* Union, layer by layer. Layers of map this one is missing are
+		 * added, and the union of two full layers is over capacity. */
+		bool add(ScalableBloomap* map);
+		/* Intersection. Against a map of a single layer, the first layer
+		 * is intersected bit by bit, other layers keep the elements map
+		 * contains, like Bloomap::andNotInto(). */
+		ScalableBloomap* intersect(ScalableBloomap* map);
+
+		unsigned nlayers(void) const { return layers.size(); }
+		Bloomap* layer(unsigned i) const { return layers[i]; }
+		/* Expected false positive rate, from those of the layers */
+		double falsePositiveRate(void);
+		/* Memory taken by the bits of all the layers, in bytes */
+		size_t memoryUsage(void) const;
+
+		BloomapFamily* family() { return f; }
+
+	protected:
+		BloomapFamily* f;
+		std::vector< Bloomap* > layers;
+		/* Elements added to the last layer */
+		unsigned fill;
+
+		/* Starts a new layer */
+		void grow(void);
+		/* Estimates the fill of the last layer after a set operation */
+		void refill(void);
+		/* Drops the elements of out[] found in an earlier layer than
+		 * layer, returns how many are kept */
+		size_t unique(unsigned layer, uint32_t* out, size_t n);
+		/* Keeps the elements of layer i which map contains */
+		void filter(unsigned i, ScalableBloomap* map);
+};
+
+#endif
@@ -0,0 +1,549 @@
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+#include "sparseindex.h"
+
+SparseIndex::SparseIndex()
+	: last(0), count(0)
+{
+}
+
+SparseIndex::SparseIndex(const SparseIndex& orig)
+	: keys(orig.keys), containers(orig.containers.size()), last(0), count(orig.count)
+{
+	for (unsigned i = 0; i < containers.size(); i++)
+		containers[i] = new Container(*orig.containers[i]);
+}
+
+SparseIndex::SparseIndex(const uint64_t* words, unsigned n)
+	: last(0), count(0)
+{
+	for (unsigned base = 0; base < n; base += SPARSEINDEX_CONTAINER_WORDS) {
+		const unsigned len = std::min(n - base, SPARSEINDEX_CONTAINER_WORDS);
+		unsigned card = 0;
+		for (unsigned i = 0; i < len; i++)
+			if (words[base + i]) card += __builtin_popcountll(words[base + i]);
+		if (!card) continue;
+		Container* c = new Container();
+		c->cardinality = card;
+		if (card > SPARSEINDEX_ARRAY_MAX) {
+			c->type = Container::BITMAP;
+			c->bitmap.assign(SPARSEINDEX_CONTAINER_WORDS, 0);
+			memcpy(&c->bitmap[0], words + base, len*sizeof(uint64_t));
+		} else {
+			c->data.reserve(card);
+			for (unsigned i = 0; i < len; i++)
+				for (uint64_t w = words[base + i]; w; w &= w - 1)
+					c->data.push_back((i << 6) + __builtin_ctzll(w));
+		}
+		keys.push_back(base / SPARSEINDEX_CONTAINER_WORDS);
+		containers.push_back(c);
+		count += card;
+	}
+}
+
+SparseIndex::~SparseIndex() {
+	for (unsigned i = 0; i < containers.size(); i++)
+		delete containers[i];
+}
+
+int SparseIndex::find(uint16_t key) const {
+	unsigned i = __atomic_load_n(&last, __ATOMIC_RELAXED);
+	if (i < keys.size() && keys[i] == key)
+		return i;
+	std::vector<uint16_t>::const_iterator it = std::lower_bound(keys.begin(), keys.end(), key);
+	if (it == keys.end() || *it != key)
+		return -1;
+	i = it - keys.begin();
+	__atomic_store_n(&last, i, __ATOMIC_RELAXED);
+	return i;
+}
+
+void SparseIndex::orWord(unsigned ip, uint64_t mask) {
+	if (!mask) return;
+	uint16_t key = ip >> (SPARSEINDEX_CONTAINER_BITS - 6);
+	int i = find(key);
+	if (i < 0) {
+		/* New containers are rare, at most one per 64K values */
+		i = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+		keys.insert(keys.begin() + i, key);
+		containers.insert(containers.begin() + i, new Container());
+		last = i;
+	}
+	Container* c = containers[i];
+	const unsigned before = c->cardinality;
+	c->orWord(ip & (SPARSEINDEX_CONTAINER_WORDS - 1), mask);
+	count += c->cardinality - before;
+}
+
+uint64_t SparseIndex::word(unsigned ip) const {
+	int i = find(ip >> (SPARSEINDEX_CONTAINER_BITS - 6));
+	if (i < 0) return 0;
+	return containers[i]->word(ip & (SPARSEINDEX_CONTAINER_WORDS - 1));
+}
+
+unsigned SparseIndex::nextWord(unsigned ip, unsigned stride_log) const {
+	const unsigned shift = SPARSEINDEX_CONTAINER_BITS - 6;
+	const unsigned stride = 1U << stride_log;
+	const unsigned rem = ip & (stride - 1);
+	if ((ip >> shift) > 0xffff) return ~0U;
+	std::vector<uint16_t>::const_iterator it = std::lower_bound(keys.begin(), keys.end(), (uint16_t) (ip >> shift));
+
+	if (stride >= SPARSEINDEX_CONTAINER_WORDS) {
+		/* Only every (stride/container)-th container has a candidate, the
+		 * same word in each of them. Look them up directly if there are
+		 * fewer of them than containers to scan. */
+		const unsigned key_stride = stride >> shift;
+		const unsigned w = ip & (SPARSEINDEX_CONTAINER_WORDS - 1);
+		unsigned key = ip >> shift;
+		if ((0x10000 - key) / key_stride < (unsigned) (keys.end() - it)) {
+			for (; key <= 0xffff; key += key_stride) {
+				int i = find(key);
+				if (i >= 0 && containers[i]->word(w))
+					return (key << shift) | w;
+			}
+			return ~0U;
+		}
+		for (; it != keys.end(); ++it) {
+			if (((*it - key) & (key_stride - 1)) == 0 && containers[it - keys.begin()]->word(w))
+				return ((unsigned) *it << shift) | w;
+		}
+		return ~0U;
+	}
+
+	if (stride == 1) {
+		for (; it != keys.end(); ++it) {
+			unsigned lo = (unsigned) *it << shift;
+			unsigned w = containers[it - keys.begin()]->nextWord((lo <= ip) ? ip - lo : 0);
+			if (w < SPARSEINDEX_CONTAINER_WORDS)
+				return lo + w;
+		}
+		return ~0U;
+	}
+
+	for (; it != keys.end(); ++it) {
+		unsigned lo = (unsigned) *it << shift;
+		unsigned hi = lo + SPARSEINDEX_CONTAINER_WORDS;
+		/* The first word of the container in the right residue class */
+		unsigned cand = (lo <= ip) ? ip : lo + ((rem - lo) & (stride - 1));
+		const Container* c = containers[it - keys.begin()];
+		for (; cand < hi; cand += stride)
+			if (c->word(cand - lo)) return cand;
+	}
+	return ~0U;
+}
+
+void SparseIndex::optimize(void) {
+	for (unsigned i = 0; i < containers.size(); i++) {
+		Container* c = containers[i];
+		size_t array_size = 2*c->cardinality;
+		size_t bitmap_size = SPARSEINDEX_CONTAINER_WORDS*sizeof(uint64_t);
+		size_t run_size = 4*c->runCount();
+		if (run_size < array_size && run_size < bitmap_size)
+			c->toRuns();
+		else if (array_size < bitmap_size)
+			c->toArray();
+		else
+			c->toBitmap();
+	}
+	std::vector<uint16_t>(keys).swap(keys);
+	std::vector<Container*>(containers).swap(containers);
+}
+
+size_t SparseIndex::cardinality(unsigned lo, unsigned hi) const {
+	const unsigned shift = SPARSEINDEX_CONTAINER_BITS - 6;
+	size_t n = 0;
+	if (lo >= hi) return 0;
+	std::vector<uint16_t>::const_iterator it = std::lower_bound(keys.begin(), keys.end(), (uint16_t) (lo >> shift));
+	for (; it != keys.end() && *it <= (hi - 1) >> shift; ++it) {
+		unsigned base = (unsigned) *it << shift;
+		unsigned a = std::max(lo, base) - base;
+		unsigned b = std::min(hi, base + SPARSEINDEX_CONTAINER_WORDS) - base;
+		n += containers[it - keys.begin()]->count(a, b - a);
+	}
+	return n;
+}
+
+void SparseIndex::words(unsigned first, unsigned len, uint64_t* out) const {
+	const unsigned shift = SPARSEINDEX_CONTAINER_BITS - 6;
+	memset(out, 0, len*sizeof(uint64_t));
+	if (!len) return;
+	const unsigned last = first + len - 1;
+	std::vector<uint16_t>::const_iterator it = std::lower_bound(keys.begin(), keys.end(), (uint16_t) (first >> shift));
+	for (; it != keys.end() && *it <= last >> shift; ++it) {
+		unsigned base = (unsigned) *it << shift;
+		unsigned a = std::max(first, base);
+		unsigned b = std::min(last + 1, base + SPARSEINDEX_CONTAINER_WORDS);
+		containers[it - keys.begin()]->words(a - base, b - a, out + (a - first));
+	}
+}
+
+void SparseIndex::orWith(const SparseIndex& other) {
+	std::vector<uint16_t> k;
+	std::vector<Container*> c;
+	unsigned i = 0, j = 0;
+	while (i < keys.size() || j < other.keys.size()) {
+		if (j == other.keys.size() || (i < keys.size() && keys[i] < other.keys[j])) {
+			k.push_back(keys[i]);
+			c.push_back(containers[i++]);
+		} else if (i == keys.size() || other.keys[j] < keys[i]) {
+			k.push_back(other.keys[j]);
+			c.push_back(new Container(*other.containers[j++]));
+		} else {
+			containers[i]->orWith(*other.containers[j++]);
+			k.push_back(keys[i]);
+			c.push_back(containers[i++]);
+		}
+	}
+	keys.swap(k);
+	containers.swap(c);
+	sweep();
+}
+
+void SparseIndex::andWith(const SparseIndex& other) {
+	unsigned j = 0;
+	for (unsigned i = 0; i < keys.size(); i++) {
+		while (j < other.keys.size() && other.keys[j] < keys[i]) j++;
+		if (j < other.keys.size() && other.keys[j] == keys[i])
+			containers[i]->andWith(*other.containers[j]);
+		else
+			containers[i]->andWords(NULL, 0);
+	}
+	sweep();
+}
+
+void SparseIndex::andWords(const uint64_t* words, unsigned n) {
+	for (unsigned i = 0; i < keys.size(); i++) {
+		unsigned base = (unsigned) keys[i] << (SPARSEINDEX_CONTAINER_BITS - 6);
+		unsigned len = (base >= n) ? 0 : std::min(n - base, SPARSEINDEX_CONTAINER_WORDS);
+		containers[i]->andWords(len ? words + base : NULL, len);
+	}
+	sweep();
+}
+
+void SparseIndex::sweep(void) {
+	unsigned n = 0;
+	count = 0;
+	for (unsigned i = 0; i < keys.size(); i++) {
+		if (!containers[i]->cardinality) {
+			delete containers[i];
+			continue;
+		}
+		count += containers[i]->cardinality;
+		keys[n] = keys[i];
+		containers[n++] = containers[i];
+	}
+	keys.resize(n);
+	containers.resize(n);
+	last = 0;
+}
+
+size_t SparseIndex::memoryUsage(void) const {
+	size_t size = sizeof(*this) + keys.capacity()*sizeof(uint16_t) + containers.capacity()*sizeof(Container*);
+	for (unsigned i = 0; i < containers.size(); i++) {
+		const Container* c = containers[i];
+		size += sizeof(Container) + c->data.capacity()*sizeof(uint16_t) + c->bitmap.capacity()*sizeof(uint64_t);
+	}
+	return size;
+}
+
+/* Containers */
+
+void SparseIndex::Container::orWord(unsigned w, uint64_t mask) {
+	unsigned base = w << 6;
+	if (type == BITMAP) {
+		cardinality += __builtin_popcountll(mask & ~bitmap[w]);
+		bitmap[w] |= mask;
+		return;
+	}
+	if (type == RUN) {
+		/* Values in the existing runs, or right after the last one (which
+		 * is how sequential IDs arrive) keep the runs. Anything else turns
+		 * the container into a bitmap. */
+		uint64_t rest = mask & ~word(w);
+		while (rest) {
+			unsigned v = base + __builtin_ctzll(rest);
+			const unsigned n = data.size();
+			const unsigned end = n ? (unsigned) data[n-2] + data[n-1] + 1 : 0;
+			if (n && end == v) {
+				data[n-1]++;
+			} else if (!n || end < v) {
+				data.push_back(v);
+				data.push_back(0);
+			} else {
+				toBitmap();
+				orWord(w, rest);
+				return;
+			}
+			cardinality++;
+			rest &= rest - 1;
+		}
+		if (data.size()*sizeof(uint16_t) > SPARSEINDEX_CONTAINER_WORDS*sizeof(uint64_t))
+			toBitmap();
+		return;
+	}
+	/* ARRAY */
+	while (mask) {
+		uint16_t v = base + __builtin_ctzll(mask);
+		std::vector<uint16_t>::iterator it = std::lower_bound(data.begin(), data.end(), v);
+		if (it == data.end() || *it != v) {
+			data.insert(it, v);
+			cardinality++;
+		}
+		mask &= mask - 1;
+	}
+	if (cardinality > SPARSEINDEX_ARRAY_MAX)
+		toBitmap();
+}
+
+uint64_t SparseIndex::Container::word(unsigned w) const {
+	unsigned lo = w << 6;
+	unsigned hi = lo + 63;
+	if (type == BITMAP)
+		return bitmap[w];
+
+	uint64_t res = 0;
+	if (type == ARRAY) {
+		std::vector<uint16_t>::const_iterator it = std::lower_bound(data.begin(), data.end(), lo);
+		for (; it != data.end() && *it <= hi; ++it)
+			res |= 1ULL << (*it - lo);
+		return res;
+	}
+
+	/* RUN, find the first run ending at lo or later */
+	unsigned l = 0, r = data.size() / 2;
+	while (l < r) {
+		unsigned mid = (l + r) / 2;
+		if ((unsigned) data[2*mid] + data[2*mid+1] < lo) l = mid + 1;
+		else r = mid;
+	}
+	for (unsigned i = l; i < data.size() / 2 && data[2*i] <= hi; i++) {
+		unsigned a = std::max((unsigned) data[2*i], lo);
+		unsigned b = std::min((unsigned) data[2*i] + data[2*i+1], hi);
+		unsigned width = b - a + 1;
+		res |= ((width == 64) ? ~0ULL : ((1ULL << width) - 1)) << (a - lo);
+	}
+	return res;
+}
+
+unsigned SparseIndex::Container::nextWord(unsigned w) const {
+	if (type == BITMAP) {
+		while (w < SPARSEINDEX_CONTAINER_WORDS && !bitmap[w]) w++;
+		return w;
+	}
+	unsigned lo = w << 6;
+	if (type == ARRAY) {
+		std::vector<uint16_t>::const_iterator it = std::lower_bound(data.begin(), data.end(), lo);
+		return (it == data.end()) ? SPARSEINDEX_CONTAINER_WORDS : *it >> 6;
+	}
+	/* RUN, the first run ending at lo or later */
+	unsigned l = 0, r = data.size() / 2;
+	while (l < r) {
+		unsigned mid = (l + r) / 2;
+		if ((unsigned) data[2*mid] + data[2*mid+1] < lo) l = mid + 1;
+		else r = mid;
+	}
+	if (l == data.size() / 2) return SPARSEINDEX_CONTAINER_WORDS;
+	return std::max((unsigned) data[2*l], lo) >> 6;
+}
+
+void SparseIndex::Container::words(unsigned w, unsigned len, uint64_t* out) const {
+	if (type == BITMAP) {
+		memcpy(out, &bitmap[w], len*sizeof(uint64_t));
+		return;
+	}
+	const unsigned lo = w << 6;
+	const unsigned hi = (w + len) << 6;
+	if (type == ARRAY) {
+		std::vector<uint16_t>::const_iterator it = std::lower_bound(data.begin(), data.end(), lo);
+		for (; it != data.end() && *it < hi; ++it)
+			out[(*it - lo) >> 6] |= 1ULL << (*it & 63);
+		return;
+	}
+	/* RUN, bit by bit is good enough, the runs are rarely in maps */
+	for (unsigned i = 0; i < data.size(); i += 2) {
+		unsigned a = std::max((unsigned) data[i], lo);
+		unsigned b = std::min((unsigned) data[i] + data[i+1] + 1, hi);
+		for (unsigned v = a; v < b; v++)
+			out[(v - lo) >> 6] |= 1ULL << (v & 63);
+	}
+}
+
+unsigned SparseIndex::Container::count(unsigned w, unsigned len) const {
+	const unsigned lo = w << 6;
+	const unsigned hi = (w + len) << 6;
+	if (lo == 0 && hi == SPARSEINDEX_CONTAINER_WORDS << 6)
+		return cardinality;
+	unsigned n = 0;
+	if (type == BITMAP) {
+		for (unsigned i = w; i < w + len; i++)
+			n += __builtin_popcountll(bitmap[i]);
+	} else if (type == ARRAY) {
+		n = std::lower_bound(data.begin(), data.end(), hi) - std::lower_bound(data.begin(), data.end(), lo);
+	} else {
+		for (unsigned i = 0; i < data.size(); i += 2) {
+			unsigned a = std::max((unsigned) data[i], lo);
+			unsigned b = std::min((unsigned) data[i] + data[i+1] + 1, hi);
+			if (a < b) n += b - a;
+		}
+	}
+	return n;
+}
+
+void SparseIndex::Container::orWith(const Container& other) {
+	if (type == BITMAP || other.type == BITMAP) {
+		toBitmap();
+		if (other.type == BITMAP) {
+			for (unsigned i = 0; i < SPARSEINDEX_CONTAINER_WORDS; i++)
+				bitmap[i] |= other.bitmap[i];
+		} else {
+			other.words(0, SPARSEINDEX_CONTAINER_WORDS, &bitmap[0]);
+		}
+		unsigned n = 0;
+		for (unsigned i = 0; i < SPARSEINDEX_CONTAINER_WORDS; i++)
+			n += __builtin_popcountll(bitmap[i]);
+		cardinality = n;
+		return;
+	}
+	std::vector<uint16_t> a, b, u;
+	values(a);
+	other.values(b);
+	std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(u));
+	data.swap(u);
+	type = ARRAY;
+	cardinality = data.size();
+	if (cardinality > SPARSEINDEX_ARRAY_MAX)
+		toBitmap();
+}
+
+void SparseIndex::Container::andWith(const Container& other) {
+	if (other.type == BITMAP) {
+		andWords(&other.bitmap[0], SPARSEINDEX_CONTAINER_WORDS);
+		return;
+	}
+	std::vector<uint16_t> r;
+	if (type == BITMAP && other.type == ARRAY) {
+		for (unsigned i = 0; i < other.data.size(); i++) {
+			uint16_t v = other.data[i];
+			if (bitmap[v >> 6] & (1ULL << (v & 63)))
+				r.push_back(v);
+		}
+	} else if (type == ARRAY && other.type == ARRAY) {
+		/* Through a bitmap of the other one, a merge of random values
+		 * mispredicts all the time */
+		uint64_t b[SPARSEINDEX_CONTAINER_WORDS];
+		memset(b, 0, sizeof(b));
+		other.words(0, SPARSEINDEX_CONTAINER_WORDS, b);
+		andWords(b, SPARSEINDEX_CONTAINER_WORDS);
+		return;
+	} else {
+		std::vector<uint16_t> a, b;
+		values(a);
+		other.values(b);
+		std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(r));
+	}
+	data.swap(r);
+	std::vector<uint64_t>().swap(bitmap);
+	type = ARRAY;
+	cardinality = data.size();
+}
+
+void SparseIndex::Container::andWords(const uint64_t* words, unsigned len) {
+	if (type == BITMAP) {
+		unsigned n = 0;
+		for (unsigned i = 0; i < SPARSEINDEX_CONTAINER_WORDS; i++) {
+			bitmap[i] &= (i < len) ? words[i] : 0;
+			n += __builtin_popcountll(bitmap[i]);
+		}
+		cardinality = n;
+		shrink();
+		return;
+	}
+	if (type == RUN) toArray();
+	unsigned n = 0;
+	for (unsigned i = 0; i < data.size(); i++) {
+		unsigned w = data[i] >> 6;
+		if (w < len && (words[w] & (1ULL << (data[i] & 63))))
+			data[n++] = data[i];
+	}
+	data.resize(n);
+	type = ARRAY;
+	cardinality = data.size();
+}
+
+void SparseIndex::Container::shrink(void) {
+	if (type == BITMAP && cardinality <= SPARSEINDEX_ARRAY_MAX)
+		toArray();
+}
+
+unsigned SparseIndex::Container::runCount(void) const {
+	if (type == RUN)
+		return data.size() / 2;
+	unsigned runs = 0;
+	if (type == ARRAY) {
+		for (unsigned i = 0; i < data.size(); i++)
+			if (i == 0 || data[i-1] + 1 != data[i]) runs++;
+		return runs;
+	}
+	/* A run starts at every set bit whose predecessor is not set */
+	uint64_t carry = 0;
+	for (unsigned i = 0; i < SPARSEINDEX_CONTAINER_WORDS; i++) {
+		runs += __builtin_popcountll(bitmap[i] & ~((bitmap[i] << 1) | carry));
+		carry = bitmap[i] >> 63;
+	}
+	return runs;
+}
+
+void SparseIndex::Container::toBitmap(void) {
+	if (type == BITMAP) return;
+	std::vector<uint16_t> values;
+	this->values(values);
+	bitmap.assign(SPARSEINDEX_CONTAINER_WORDS, 0);
+	for (unsigned i = 0; i < values.size(); i++)
+		bitmap[values[i] >> 6] |= 1ULL << (values[i] & 63);
+	std::vector<uint16_t>().swap(data);
+	type = BITMAP;
+}
+
+void SparseIndex::Container::toArray(void) {
+	std::vector<uint16_t> values;
+	this->values(values);
+	data.swap(values);
+	std::vector<uint64_t>().swap(bitmap);
+	type = ARRAY;
+}
+
+void SparseIndex::Container::toRuns(void) {
+	std::vector<uint16_t> values;
+	this->values(values);
+	std::vector<uint16_t> runs;
+	for (unsigned i = 0; i < values.size(); i++) {
+		if (i && runs[runs.size()-2] + runs[runs.size()-1] + 1 == values[i]) {
+			runs[runs.size()-1]++;
+		} else {
+			runs.push_back(values[i]);
+			runs.push_back(0);
+		}
+	}
+	data.swap(runs);
+	std::vector<uint64_t>().swap(bitmap);
+	type = RUN;
+}
+
+void SparseIndex::Container::values(std::vector<uint16_t>& out) const {
+	out.clear();
+	if (type == ARRAY) {
+		out.assign(data.begin(), data.end());
+	} else if (type == BITMAP) {
+		for (unsigned i = 0; i < bitmap.size(); i++) {
+			for (uint64_t w = bitmap[i]; w; w &= w - 1)
+				out.push_back((i << 6) + __builtin_ctzll(w));
+		}
+	} else {
+		for (unsigned i = 0; i < data.size(); i += 2) {
+			for (unsigned v = data[i]; v <= (unsigned) data[i] + data[i+1]; v++)
+				out.push_back(v);
+		}
+	}
+}
@@ -0,0 +1,119 @@
+/******************************************************************************
+ * Filename: sparseindex.h
+ *
+ * Created: 2026/10/17 09:40
+ *
+ ******************************************************************************/
+
+#ifndef __SPARSEINDEX_H__
+#define __SPARSEINDEX_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/* Values in one container, a 64K range of the 32-bit space */
+#define SPARSEINDEX_CONTAINER_BITS 16
+#define SPARSEINDEX_CONTAINER_WORDS (1U << (SPARSEINDEX_CONTAINER_BITS - 6))
+/* Arrays larger than this take more space than a bitmap */
+#define SPARSEINDEX_ARRAY_MAX 4096
+
+/* A set of 32-bit numbers, stored in the roaring bitmap fashion: the space is
+ * split into 64K ranges, and each non-empty range has a container, which is
+ * one of
+ *
+ *   ARRAY	sorted 16-bit values, for up to SPARSEINDEX_ARRAY_MAX of them
+ *   BITMAP	1024 words, for denser ranges
+ *   RUN	sorted (start, length - 1) pairs, for long runs of values
+ *
+ * Arrays turn into bitmaps when they grow. Runs are only created by
+ * optimize(), once the set is (mostly) built.
+ *
+ * The interface is word based, like the dense family index: word(ip) holds
+ * the values ip*64 ... ip*64 + 63. */
+class SparseIndex {
+	public:
+		SparseIndex();
+		SparseIndex(const SparseIndex& orig);
+		/* The values of the n words of a plain bitmap */
+		SparseIndex(const uint64_t* words, unsigned n);
+		~SparseIndex();
+
+		/* word(ip) |= mask */
+		void orWord(unsigned ip, uint64_t mask);
+		uint64_t word(unsigned ip) const;
+		/* Smallest ip2 >= ip with ip2 == ip (mod 2^stride_log) and a
+		 * non-zero word, or ~0U if there is none. Skips whole missing
+		 * containers. */
+		unsigned nextWord(unsigned ip, unsigned stride_log) const;
+
+		/* Converts each container into its smallest representation. */
+		void optimize(void);
+
+		/* Number of values, and memory used (in bytes) */
+		size_t cardinality(void) const { return count; }
+		size_t memoryUsage(void) const;
+		/* Number of values in the words lo ... hi - 1 */
+		size_t cardinality(unsigned lo, unsigned hi) const;
+		/* Copies the words first ... first + len - 1 into out */
+		void words(unsigned first, unsigned len, uint64_t* out) const;
+
+		/* Set operations, container by container: this |= other, this &=
+		 * other, and this &= the n words of a plain bitmap */
+		void orWith(const SparseIndex& other);
+		void andWith(const SparseIndex& other);
+		void andWords(const uint64_t* words, unsigned n);
+
+	protected:
+		struct Container {
+			enum { ARRAY, BITMAP, RUN } type;
+			unsigned cardinality;
+			/* Values (ARRAY) or runs (RUN) */
+			std::vector<uint16_t> data;
+			/* SPARSEINDEX_CONTAINER_WORDS words (BITMAP) */
+			std::vector<uint64_t> bitmap;
+
+			Container() : type(ARRAY), cardinality(0) {};
+			void orWord(unsigned w, uint64_t mask);
+			uint64_t word(unsigned w) const;
+			/* First non-empty word at w or later, or
+			 * SPARSEINDEX_CONTAINER_WORDS if there is none */
+			unsigned nextWord(unsigned w) const;
+			/* ORs words w ... w + len - 1 into out, and counts the
+			 * values in them */
+			void words(unsigned w, unsigned len, uint64_t* out) const;
+			unsigned count(unsigned w, unsigned len) const;
+			void orWith(const Container& other);
+			void andWith(const Container& other);
+			/* ANDs with the container's words of a plain bitmap, of
+			 * which len are there */
+			void andWords(const uint64_t* words, unsigned len);
+			/* Bitmaps turn into arrays once small enough */
+			void shrink(void);
+			unsigned runCount(void) const;
+			/* All the values, sorted */
+			void values(std::vector<uint16_t>& out) const;
+			void toBitmap(void);
+			void toArray(void);
+			void toRuns(void);
+		};
+
+		/* Sorted keys (upper 16 bits) and their containers */
+		std::vector<uint16_t> keys;
+		std::vector<Container*> containers;
+		/* The last container accessed, sequential access is common.
+		 * Readers in several threads update it, relaxed atomically. */
+		mutable unsigned last;
+		/* Values in all the containers */
+		size_t count;
+
+		int find(uint16_t key) const;
+		/* Drops the empty containers, recounts the values */
+		void sweep(void);
+
+	private:
+		/* Not assignable */
+		SparseIndex& operator=(const SparseIndex&);
+};
+
+#endif
@@ -0,0 +1,122 @@
+/******************************************************************************
+ * Filename: staticbloomap.h
+ *
+ * Created: 2026/10/16 14:20
+ *
+ ******************************************************************************/
+
+#ifndef __STATICBLOOMAP_H__
+#define __STATICBLOOMAP_H__
+
+#include "bloomap.h"
+#include "bloomapfamily.h"
+
+/* Probe loops of StaticBloomap, unrolled at compile time. Probe I handles
+ * compartment I and recurses to I+1, the specialization for I == K ends it. */
+template<unsigned I, unsigned K, unsigned LogCompSize>
+struct StaticBloomapProbe {
+	static const unsigned segsize = (1U << LogCompSize) / BITS_WORD;
+
+	/* Sets the bits, returns the bits which were not set before. */
+	static inline BITS_TYPE set(BITS_TYPE* bits, const uint32_t* a, const uint32_t* b, unsigned ele) {
+		uint32_t h = (ele*a[I] + b[I]) >> (32 - LogCompSize);
+		BITS_TYPE mask = ((BITS_TYPE) 1) << (h % BITS_WORD);
+		BITS_TYPE& word = bits[I*segsize + h / BITS_WORD];
+		BITS_TYPE diff = mask & ~word;
+		word |= mask;
+		return diff | StaticBloomapProbe<I+1, K, LogCompSize>::set(bits, a, b, ele);
+	}
+
+	static inline bool get(const BITS_TYPE* bits, const uint32_t* a, const uint32_t* b, unsigned ele) {
+		uint32_t h = (ele*a[I] + b[I]) >> (32 - LogCompSize);
+		if (!(bits[I*segsize + h / BITS_WORD] & (((BITS_TYPE) 1) << (h % BITS_WORD))))
+			return false;
+		return StaticBloomapProbe<I+1, K, LogCompSize>::get(bits, a, b, ele);
+	}
+};
+
+template<unsigned K, unsigned LogCompSize>
+struct StaticBloomapProbe<K, K, LogCompSize> {
+	static inline BITS_TYPE set(BITS_TYPE*, const uint32_t*, const uint32_t*, unsigned) { return 0; }
+	static inline bool get(const BITS_TYPE*, const uint32_t*, const uint32_t*, unsigned) { return true; }
+};
+
+/* A Bloomap with the number of compartments (K) and their size (2^LogCompSize
+ * bits) fixed at compile time. The bits are laid out exactly like in a
+ * Bloomap of the same geometry, so it's a full member of its family: it can
+ * be enumerated, intersected and so on with the usual Bloomap interface. Only
+ * add() and contains() are replaced by inlined, fully unrolled versions with
+ * the hash seeds kept in the object.
+ *
+ * The family has to have matching geometry, see
+ * BloomapFamily::forCompartments(K, LogCompSize). Create the maps with
+ * BloomapFamily::newStaticMap<K, LogCompSize>(). */
+template<unsigned K, unsigned LogCompSize>
+class StaticBloomap : public Bloomap {
+	public:
+		StaticBloomap(BloomapFamily* f, unsigned index_logsize)
+			: Bloomap(f, f->m, f->k, index_logsize)
+		{
+			/* There is no static_assert in C++98 */
+			typedef char compartment_holds_a_word[(LogCompSize >= 6 && LogCompSize <= 32) ? 1 : -1];
+			(void) sizeof(compartment_holds_a_word);
+			assert(ncomp == K);
+			assert(nfunc == 1);
+			assert(compsize == (1ULL << LogCompSize));
+			assert(!blocked);
+			/* add() and contains() need plain bits */
+			packable = false;
+			unpack();
+			for (unsigned i = 0; i < K; i++)
+				seeds(i, seed_a + i, seed_b + i);
+		}
+
+		inline bool add(unsigned ele) {
+			/* The generic path handles atomic updates, change
+			 * tracking and shared bits */
+			if ((f && (f->isConcurrent() || dirty)) || snapshot)
+				return Bloomap::add(ele);
+#ifdef DEBUG_STATS
+			real_contents.insert(ele);
+#endif
+			if (f) {
+				unsigned h = f->newElement(ele);
+				side_index[h / BITS_WORD] |= ((BITS_TYPE) 1) << (h % BITS_WORD);
+			}
+			if (ele < sizeof(specials)*CHAR_BIT) {
+				SPECIALS_TYPE mask = 0x1 << ele;
+				changed = !(specials & mask);
+				specials |= mask;
+				return changed;
+			}
+			changed = StaticBloomapProbe<0, K, LogCompSize>::set(bits, seed_a, seed_b, ele) != 0;
+			return changed;
+		}
+
+		inline bool contains(unsigned ele) {
+			bool ret;
+			if (ele < sizeof(specials)*CHAR_BIT)
+				return specials & (0x1 << ele);
+			ret = StaticBloomapProbe<0, K, LogCompSize>::get(bits, seed_a, seed_b, ele);
+#ifdef DEBUG_STATS
+			counter_query++;
+			if (ret && !real_contents.count(ele))
+				counter_fp++;
+#endif
+			return ret;
+		}
+
+		/* Keep the rest of the add() overloads visible */
+		using Bloomap::add;
+
+	protected:
+		uint32_t seed_a[K];
+		uint32_t seed_b[K];
+};
+
+template<unsigned K, unsigned LogCompSize>
+StaticBloomap<K, LogCompSize>* BloomapFamily::newStaticMap(void) {
+	return new StaticBloomap<K, LogCompSize>(this, index_logsize);
+}
+
+#endif
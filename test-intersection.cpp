@@ -3,8 +3,11 @@
 #include <vector>
 #include <iomanip>
 #include <cstdlib>
+#include <cassert>
+#include <cstring>
+#include <ctime>
 
-#include "bloomfilter.h"
+#include "bloomap.h"
 #include "bloomapfamily.h"
 
 #ifndef SEED
@@ -14,10 +17,16 @@
 using namespace std;
 
 BloomapFamily *family;
+Bloomap *funky;
 
 unsigned empty_prepurge;
 unsigned empty_purge;
 
+BloomapFamily::IndexMode index_mode = BloomapFamily::INDEX_DENSE;
+/* CPU time spent filling the index and enumerating the maps, in clock ticks */
+clock_t time_prefill;
+clock_t time_enumerate;
+
 bool testIteration(unsigned ninsert, unsigned space, double prob, unsigned prefill) {
 	/* First, prepare two disjoint sets */
 	map<uint64_t,bool> insert1, insert2;
@@ -35,13 +44,16 @@ bool testIteration(unsigned ninsert, unsigned space, double prob, unsigned prefi
 
 	/* Preapre family and filters */
 	if (!family) {
-		family = BloomapFamily::forElementsAndProb(space, prob);
+		family = BloomapFamily::forElementsAndProb(space, prob, BloomapFamily::LAYOUT_COMPARTMENTS,
+				BLOOMAP_DEFAULT_SEED, index_mode);
 		/* Now, let's pretend to have 2^prefill elements in some map */
 		if (prefill) {
-			Bloomap *funky = family->newMap();
+			clock_t start = clock();
+			funky = family->newMap();
 			for (unsigned i = 0; i < (1U<<prefill); i++) {
 				funky->add(i);
 			}
+			time_prefill = clock() - start;
 		}
 	}
 
@@ -54,6 +66,15 @@ bool testIteration(unsigned ninsert, unsigned space, double prob, unsigned prefi
 	for (map<uint64_t,bool>::iterator it = insert2.begin(); it != insert2.end(); ++it) {
 		bmap2->add((*it).first);
 	}
+	/* Walks the family index for every hash of the map */
+	clock_t start = clock();
+	unsigned e, found = 0;
+	BLOOMAP_FOR_EACH(e, bmap1) {
+		found++;
+	}
+	time_enumerate += clock() - start;
+	assert(found >= ninsert);
+
 	cout << "==> These maps will be intersected: " << endl;
 	bmap1->dumpStats();
 	cout << "---" << endl;
@@ -74,22 +95,34 @@ bool testIteration(unsigned ninsert, unsigned space, double prob, unsigned prefi
 	bmap1->purge();
 	bmap1->dumpStats();
 
-	if (bmap1->isEmpty()) { empty_purge++; return true; }
-	else return false;
+	bool empty = bmap1->isEmpty();
+	if (empty) empty_purge++;
+	delete bmap1;
+	delete bmap2;
+	return empty;
 }
 
 void usage(void) {
-	cerr << "Usage: ./test insert_elements space_for probability iterations prefill" << endl;
+	cerr << "Usage: ./test insert_elements space_for probability iterations prefill [dense|sparse|bucketed]" << endl;
 	cerr << "  Where elements in number of elements to be inserted, and probability is the required false-positive rate." << endl;
+	cerr << "  The last argument is the layout of the family index, dense by default." << endl;
 }
 
 int main(int argc, char* argv[]) {
 	
 	/* Check for sufficient arguments and their sanity*/
-	if (argc != 6) {
+	if (argc != 6 && argc != 7) {
 		usage();
 		return 1;
 	}
+	if (argc == 7) {
+		if (!strcmp(argv[6], "sparse")) index_mode = BloomapFamily::INDEX_SPARSE;
+		else if (!strcmp(argv[6], "bucketed")) index_mode = BloomapFamily::INDEX_BUCKETED;
+		else if (strcmp(argv[6], "dense")) {
+			usage();
+			return 1;
+		}
+	}
 
 	unsigned ninsert = atoi(argv[1]);
 	unsigned space = atoi(argv[2]);
@@ -109,5 +142,10 @@ int main(int argc, char* argv[]) {
 	cout << ":: (pre-purge)   Attempted " << iter << " iterations, " << empty_prepurge << "(" << setprecision(2)<<(100*empty_prepurge/iter) <<"%) of there were empty." << endl;
 	cout << ":: (After purge) Attempted " << iter << " iterations, " << empty_purge << "(" << setprecision(2)<<(100*empty_purge/iter) <<"%) of there were empty." << endl;
 
+	cout << ":: Prefill took " << (double) time_prefill / CLOCKS_PER_SEC << "s, enumeration took "
+		<< (double) time_enumerate / CLOCKS_PER_SEC << "s in total." << endl;
+
+	delete funky;
+	delete family;
 	return 0;
 }
@@ -3,7 +3,7 @@
 #include <vector>
 #include <cstdlib>
 
-#include "bloomfilter.h"
+#include "bloomap.h"
 #include "bloomapfamily.h"
 
 #ifndef SEED
@@ -87,5 +87,7 @@ int main(int argc, char* argv[]) {
 	ncheck = bmap->counter_query;
 	fp_rate = (1.0*check_found)/ncheck;
 	cout << ninsert << "\t" << ncheck << "\t" << insert_found << "\t" << check_found << "\t" << fp_rate << "\t" << prob << "\t" << bmap->popcount()  << "\t" << (bmap->popcount()*1.0/ bmap->mapsize()) << endl;
+	delete bmap;
+	delete family;
 	return 0;
 }
@@ -0,0 +1,73 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(unsigned nthreads)
+	: fn(NULL), arg(NULL), ntasks(0), next(0), running(0), generation(0), stop(false)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&wake, NULL);
+	pthread_cond_init(&done, NULL);
+	for (unsigned i = 1; i < nthreads; i++) {
+		pthread_t t;
+		if (pthread_create(&t, NULL, worker, this))
+			break; /* Fewer threads, run() works with any number */
+		workers.push_back(t);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	pthread_mutex_lock(&lock);
+	stop = true;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+	for (unsigned i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	pthread_cond_destroy(&done);
+	pthread_cond_destroy(&wake);
+	pthread_mutex_destroy(&lock);
+}
+
+void ThreadPool::run(unsigned ntasks, Task fn, void* arg) {
+	pthread_mutex_lock(&lock);
+	this->fn = fn;
+	this->arg = arg;
+	this->ntasks = ntasks;
+	next = 0;
+	running = workers.size();
+	generation++;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	work();
+
+	pthread_mutex_lock(&lock);
+	while (running)
+		pthread_cond_wait(&done, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+void ThreadPool::work(void) {
+	unsigned task;
+	while ((task = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) < ntasks)
+		fn(arg, task);
+}
+
+void* ThreadPool::worker(void* p) {
+	ThreadPool* pool = (ThreadPool*) p;
+	unsigned seen = 0;
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->generation == seen && !pool->stop)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->stop) break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool->work();
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->running == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
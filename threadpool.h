@@ -0,0 +1,53 @@
+/******************************************************************************
+ * Filename: threadpool.h
+ *
+ * Created: 2026/10/17 11:05
+ *
+ ******************************************************************************/
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <pthread.h>
+#include <vector>
+
+/* A fixed set of worker threads running numbered tasks. run() hands out the
+ * tasks 0 ... ntasks-1 to the workers and the calling thread, and returns
+ * once all of them are done. Only one run() at a time. */
+class ThreadPool {
+	public:
+		typedef void (*Task)(void* arg, unsigned task);
+
+		/* nthreads includes the thread calling run() */
+		ThreadPool(unsigned nthreads);
+		~ThreadPool();
+
+		unsigned size(void) const { return workers.size() + 1; }
+		void run(unsigned ntasks, Task fn, void* arg);
+
+	protected:
+		std::vector<pthread_t> workers;
+		pthread_mutex_t lock;
+		pthread_cond_t wake;
+		pthread_cond_t done;
+
+		/* The current run, guarded by the lock except for next */
+		Task fn;
+		void* arg;
+		unsigned ntasks;
+		unsigned next;
+		unsigned running;
+		unsigned generation;
+		bool stop;
+
+		static void* worker(void* pool);
+		/* Takes tasks until there are none left */
+		void work(void);
+
+	private:
+		/* Not copyable */
+		ThreadPool(const ThreadPool&);
+		ThreadPool& operator=(const ThreadPool&);
+};
+
+#endif